@@ -78,6 +78,13 @@ uint16_t swapbytes16(uint16_t input) {
 	return ret;
 }
 
+bool RFBPixelFormat::operator==(const RFBPixelFormat& other) const {
+	return bitsPerPixel == other.bitsPerPixel && bitDepth == other.bitDepth &&
+		bigEndianFlag == other.bigEndianFlag && trueColourFlag == other.trueColourFlag &&
+		redMax == other.redMax && greenMax == other.greenMax && blueMax == other.blueMax &&
+		redShift == other.redShift && greenShift == other.greenShift && blueShift == other.blueShift;
+}
+
 void RFBPixelFormat::writeCommon(char** ptr, uint8_t r, uint8_t g, uint8_t b) {
 
 	// scale to max
@@ -144,8 +151,30 @@ void RFBPixelFormat::writeTo(char** ptr, uint8_t r, uint8_t g, uint8_t b) {
 }
 
 void RFBPixelFormat::writeCpixelTo(char** ptr, uint8_t r, uint8_t g, uint8_t b) {
+
+	if (cpixelSize() == 3) {
+
+		// The three bytes that hold the colour: the least significant three if
+		// they fit there, else the most significant three
+
+		uint32_t colourBits =
+			((uint32_t)redMax << redShift) |
+			((uint32_t)greenMax << greenShift) |
+			((uint32_t)blueMax << blueShift);
+
+		bool lowBytes = (colourBits <= 0xFFFFFF);
+
+		char pixel[4];
+		char* pixelPtr = pixel;
+		writeCommon(&pixelPtr, r, g, b);
+
+		memcpy(*ptr, pixel + ((lowBytes == (bigEndianFlag != 0)) ? 1 : 0), 3);
+		*ptr += 3;
+		return;
+	}
+
 	writeCommon(ptr, r, g, b);
-	*ptr += (bitDepth / 8);
+	*ptr += (bitsPerPixel / 8);
 }
 
 void RFBPixelFormat::copyRect(uint8_t* fromRGBX32, uint16_t sourceImageWidth, char* dest, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
@@ -184,4 +213,38 @@ void RFBPixelFormat::copyRectCpixel(uint8_t* fromRGBX32, uint16_t sourceImageWid
 		}
 	}
 
-}
\ No newline at end of file
+}
+
+size_t RFBPixelFormat::cpixelSize() {
+	if (bitsPerPixel == 32 && bitDepth <= 24 && trueColourFlag) {
+		return 3;
+	}
+	return bitsPerPixel / 8;
+}
+
+size_t RFBPixelFormat::tpixelSize() {
+	if (bitsPerPixel == 32 && bitDepth == 24 && trueColourFlag && redMax == 255 && greenMax == 255 && blueMax == 255) {
+		return 3;
+	}
+	return bitsPerPixel / 8;
+}
+
+void RFBPixelFormat::copyRectTpixel(uint8_t* fromRGBX32, uint16_t sourceImageWidth, char* dest, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	if (tpixelSize() != 3) {
+		copyRect(fromRGBX32, sourceImageWidth, dest, x, y, w, h);
+		return;
+	}
+
+	char* nextPos = dest;
+
+	for (size_t ypos = y; ypos < (size_t)y + (size_t)h; ++ypos) {
+		const uint8_t* src = fromRGBX32 + (x + (ypos * sourceImageWidth)) * 4;
+		for (size_t xpos = 0; xpos < w; ++xpos, src += 4) {
+			*nextPos++ = src[0];
+			*nextPos++ = src[1];
+			*nextPos++ = src[2];
+		}
+	}
+
+}
@@ -44,8 +44,16 @@ struct RFBPixelFormat {
 
 	void copyRectCpixel(uint8_t* fromRGBX32, uint16_t sourceImageWidth, char* dest, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
 
+	size_t cpixelSize(); // ZRLE drops the unused byte of 32-bit pixels with a depth of 24 or less
+
+	size_t tpixelSize(); // Tight packs 24-bit true colour into three bytes, R-G-B
+
+	void copyRectTpixel(uint8_t* fromRGBX32, uint16_t sourceImageWidth, char* dest, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
 	void setFrom(std::string PIXEL_FORMAT_STRING);
 
+	bool operator==(const RFBPixelFormat& other) const; // ignores the padding
+
 protected:
 
 	void writeCommon(char** ptr, uint8_t r, uint8_t g, uint8_t b);
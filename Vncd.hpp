@@ -1,5 +1,6 @@
 /* Vncd.hpp */
 
+
 /*
  * Copyright (c) 2015, the libvncd author
  *
@@ -19,71 +20,324 @@
 #pragma once
 #include <functional>
 #include <string>
-#include <list>
+#include <vector>
+#include <thread>
+#include <memory>
+#include <atomic>
 #include "asio_wrapper.h"
+#include "VncdTimer.hpp"
+#include "VncdEncoderPool.hpp"
+#include "VncdMemoryPool.hpp"
+#include "VncdConnectionRegistry.hpp"
+#include "VncdEncodeCache.hpp"
+#include "VncdBroadcast.hpp"
+#include "VncdTokenBucket.hpp"
+
+#if defined(_WIN32)
+	#include <windows.h>
+#elif defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+#endif
+
+#if defined(SO_REUSEPORT)
+	// Lets every shard bind its own acceptor to the same port; the kernel then
+	// balances incoming connections between them
+	typedef asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> VncdReusePort;
+	#define VNCD_HAS_REUSEPORT 1
+#else
+	#define VNCD_HAS_REUSEPORT 0
+#endif
+
+// Pass as encoderThreadCount to encode on the connection's own io thread
+#define VNCD_ENCODE_INLINE ((size_t)-1)
+
+#define VNCD_SEND_QUEUE_LIMIT (256 * 1024) // default for Vncd::sendQueueLimit
 
 template <typename ConnectionAcceptor>
 class Vncd {
 
 public:
 
+	// Runs shard 0, which is everything unless shardCount > 1
 	asio::io_service io_service;
 
-	Vncd() {
+	// Number of threads that run each shard's io_service. Each connection's
+	// handlers are serialized on its own strand, so one slow encode only
+	// occupies one thread. With more than one thread, the VncdConnection
+	// callbacks of different clients may run concurrently.
+	size_t threadCount;
+
+	// Each shard has its own io_service, threads, acceptor and allocator. A
+	// connection stays on the shard that accepted it for its whole life.
+	size_t shardCount;
+
+	// Rects that connections showing the same VncdSharedFramebuffer can share.
+	// Only used by connections that return one from getSharedFramebuffer().
+	VncdEncodeCache encodeCache;
+
+	// TightPNG tiles by the hash of their pixels, so content that is redrawn
+	// unchanged, or shown again after a while, is not compressed again
+	VncdEncodeCache tileCache;
+
+	// Rect encoding runs on this pool rather than on the io threads. Null when
+	// encoding inline, which keeps all of a session's work on its shard.
+	std::unique_ptr<VncdEncoderPool> encoderPool;
+
+	// A connection that hasn't sent an update for this long releases its
+	// compressors and cached update memory; they are recreated when needed.
+	// Zero keeps them for the life of the connection.
+	std::chrono::milliseconds idleTrimPeriod;
+
+	// Bytes that may wait in a connection's send queue before it stops
+	// encoding updates; damage arriving meanwhile is merged and sent from the
+	// latest pixels once the queue drains. Zero sends every update.
+	size_t sendQueueLimit;
+
+	// Bytes per second each connection may send, and all of them together.
+	// Zero is unlimited. A connection over either quota gets fewer frames
+	// first, then stronger compression; see VncdConnection::bandwidthReport().
+	size_t clientBandwidthLimit;
+
+	size_t totalBandwidthLimit;
+
+	VncdTokenBucket totalBandwidth;
+
+	// Connections accepted beyond this many are closed straight away. Zero
+	// accepts any number.
+	size_t maxConnections;
+
+	// For large view-only audiences. Connections that return the same
+	// VncdSharedFramebuffer and use the same pixel format and encoding are
+	// grouped, and each group encodes every update once for all of them.
+	// Viewers that fall behind are moved to groups that update less often.
+	bool broadcastMode;
+
+	VncdBroadcastHub broadcasts;
+
+	Vncd(size_t threadCount = 1, size_t encoderThreadCount = 0, size_t shardCount = 1) :
+		threadCount(threadCount ? threadCount : 1),
+		shardCount(shardCount ? shardCount : 1),
+		tileCache(VNCD_TILE_CACHE_SIZE),
+		idleTrimPeriod(0),
+		sendQueueLimit(VNCD_SEND_QUEUE_LIMIT),
+		clientBandwidthLimit(0),
+		totalBandwidthLimit(0),
+		maxConnections(0),
+		broadcastMode(false),
+		broadcasts(io_service),
+		nextShard(0),
+		reusePort(false)
+	{
+		if (encoderThreadCount != VNCD_ENCODE_INLINE) {
+			encoderPool.reset(new VncdEncoderPool(encoderThreadCount));
+		}
 	}
 
 	void reverseConnection(const char* connectTo, short port) {
+		createShards(1);
+
 		asio::ip::tcp::endpoint endpoint(asio::ip::address::from_string(connectTo), port);
-		asio::ip::tcp::socket socket(io_service);
+		std::shared_ptr<asio::ip::tcp::socket> socket = std::make_shared<asio::ip::tcp::socket>(io_service);
 
 		// connect to remote host
-		socket.connect(endpoint);
+		socket->connect(endpoint);
 
-		VncdTimer timer(io_service);
-		std::shared_ptr<ConnectionAcceptor> handler = std::make_shared<ConnectionAcceptor>(std::move(socket), std::move(timer));
-		handler->notifyClient_connectionAccepted();
+		startConnection(*shards[0], socket);
 
-		io_service.run();
+		runShards();
 	}
 
 	void acceptConnections(const char* bindTo, short port) {
+		createShards(shardCount);
+
+		asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), port);
+
+		// With a single shard a second server on the same port must still fail
+		// to bind, as it always has, rather than quietly take half the clients
+		reusePort = VNCD_HAS_REUSEPORT && shards.size() > 1;
+
+		if (reusePort) {
+
+			for (std::unique_ptr<Shard>& shard : shards) {
+				shard->acceptor.reset(new asio::ip::tcp::acceptor(*shard->io_service));
+				shard->acceptor->open(endpoint.protocol());
+				shard->acceptor->set_option(asio::ip::tcp::acceptor::reuse_address(true));
+#if VNCD_HAS_REUSEPORT
+				shard->acceptor->set_option(VncdReusePort(true));
+#endif
+				shard->acceptor->bind(endpoint);
+				shard->acceptor->listen();
+
+				acceptNext(*shard);
+			}
+
+		} else {
+
+			// One acceptor, handing connections to the shards in turn
+
+			shards[0]->acceptor.reset(new asio::ip::tcp::acceptor(io_service, endpoint));
+			acceptNext(*shards[0]);
+		}
+
+		// Start main loop
+
+		runShards();
+	}
+
+	size_t connectionCount() {
+		return connections.size();
+	}
+
+	// Safe from any thread; the callback runs on the caller's thread, so it
+	// should post to the connection's strand for anything that touches its state
+	void forEachConnection(const std::function<void(const std::shared_ptr<ConnectionAcceptor>&)>& callback) {
+		connections.forEach([&callback](const std::shared_ptr<VncdConnection>& connection) {
+			callback(std::static_pointer_cast<ConnectionAcceptor>(connection));
+		});
+	}
+
+protected:
+
+	struct Shard {
+
+		// Declared first so it outlives everything allocated from it
+		std::shared_ptr<VncdMemoryPool> memoryPool;
+
+		asio::io_service* io_service;
+
+		std::unique_ptr<asio::io_service> ownedIoService;
+
+		std::unique_ptr<asio::ip::tcp::acceptor> acceptor;
 
-		asio::ip::tcp::acceptor a(io_service, asio::ip::tcp::endpoint(asio::ip::tcp::v4(), port));
+		std::shared_ptr<asio::ip::tcp::socket> pendingSocket;
 
-		asio::ip::tcp::socket sock(io_service);
+	};
 
+	std::vector<std::unique_ptr<Shard>> shards;
 
-		std::list<std::shared_ptr<ConnectionAcceptor>> activeClients;
+	// Open connections on all shards; each removes itself when it closes
+	VncdConnectionRegistry connections;
 
-		std::function<void(std::error_code)> accept_callback = [this, &a, &sock, &activeClients, &accept_callback](std::error_code err) {
+	std::atomic<size_t> nextShard;
 
-			// First, let's clean up any closed sockets
+	// Every shard has its own acceptor on the port, rather than shard 0
+	// accepting for all of them
+	bool reusePort;
 
-			activeClients.remove_if( [](std::shared_ptr<ConnectionAcceptor>& client) {
-				return ! client->tcpConnection.is_open();
-			});
+	void createShards(size_t count) {
+		while (shards.size() < count) {
+			std::unique_ptr<Shard> shard(new Shard());
+			shard->memoryPool = std::make_shared<VncdMemoryPool>();
+
+			if (shards.empty()) {
+				shard->io_service = &io_service;
+			} else {
+				shard->ownedIoService.reset(new asio::io_service());
+				shard->io_service = shard->ownedIoService.get();
+			}
+
+			shards.push_back(std::move(shard));
+		}
+	}
+
+	void acceptNext(Shard& shard) {
+		Shard& target = reusePort ? shard : *shards[nextShard++ % shards.size()];
+
+		shard.pendingSocket = std::make_shared<asio::ip::tcp::socket>(*target.io_service);
+
+		shard.acceptor->async_accept(*shard.pendingSocket, [this, &shard, &target](std::error_code err) {
 
 			// Process our new connection
 
 			if (!err) {
+				std::shared_ptr<asio::ip::tcp::socket> socket = shard.pendingSocket;
 
-				VncdTimer timer(io_service);
-
-				std::shared_ptr<ConnectionAcceptor> handler = std::make_shared<ConnectionAcceptor>(std::move(sock), std::move(timer));
-				activeClients.push_back(handler);
-				handler->notifyClient_connectionAccepted();
+				target.io_service->post([this, &target, socket]() {
+					startConnection(target, socket);
+				});
 			}
 			
 			// Loop
 
-			a.async_accept(sock, accept_callback);
-		};
+			acceptNext(shard);
+		});
+	}
 
-		a.async_accept(sock, accept_callback);
+	void startConnection(Shard& shard, std::shared_ptr<asio::ip::tcp::socket> socket) {
 
-		// Start main loop
+		connections.setLimit(maxConnections);
+		totalBandwidth.setRate(totalBandwidthLimit);
+
+		VncdTimer timer(*shard.io_service);
+
+		std::shared_ptr<ConnectionAcceptor> handler = std::allocate_shared<ConnectionAcceptor>(
+			VncdPoolAllocator<ConnectionAcceptor>(shard.memoryPool), std::move(*socket), std::move(timer)
+		);
+
+		if (!connections.add(handler)) {
+			return; // over the limit; the socket closes with the handler
+		}
+
+		handler->encoderPool = encoderPool.get();
+		handler->encodeCache = &encodeCache;
+		handler->tileCache = &tileCache;
+		if (broadcastMode) {
+			handler->broadcastHub = &broadcasts;
+		}
+		handler->idleTrimPeriod = idleTrimPeriod;
+		handler->sendQueueLimit = sendQueueLimit;
+		handler->bandwidthLimit.setRate(clientBandwidthLimit);
+		if (totalBandwidthLimit) {
+			handler->totalBandwidthLimit = &totalBandwidth;
+		}
+		handler->notifyClient_connectionAccepted();
+	}
+
+	void runShards() {
+		std::vector<std::thread> workers;
+
+		for (size_t s = 0; s < shards.size(); ++s) {
+			for (size_t i = (s == 0 ? 1 : 0); i < threadCount; ++i) {
+				asio::io_service* shardIoService = shards[s]->io_service;
+				bool pin = shards.size() > 1;
+
+				workers.emplace_back([shardIoService, s, pin]() {
+					if (pin) {
+						pinCurrentThread(s);
+					}
+					shardIoService->run();
+				});
+			}
+		}
+
+		if (shards.size() > 1) {
+			pinCurrentThread(0);
+		}
 
 		io_service.run();
+
+		for (std::thread& t : workers) {
+			t.join();
+		}
+	}
+
+	static void pinCurrentThread(size_t shardIndex) {
+		size_t cpuCount = std::thread::hardware_concurrency();
+		if (cpuCount == 0) {
+			return;
+		}
+
+		size_t cpu = shardIndex % cpuCount;
+
+#if defined(_WIN32)
+		SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__)
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+#endif
 	}
 
 };
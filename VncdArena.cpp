@@ -0,0 +1,96 @@
+/* VncdArena.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdArena.hpp"
+#include <algorithm>
+
+VncdArena::VncdArena(std::shared_ptr<VncdMemoryPool> pool) :
+	pool(std::move(pool)),
+	blocks(nullptr)
+{
+}
+
+VncdArena::~VncdArena() {
+	while (blocks) {
+		Block* next = blocks->next;
+		pool->deallocate(blocks, Block::headerSize() + blocks->capacity);
+		blocks = next;
+	}
+}
+
+VncdArena::Block* VncdArena::newBlock(size_t minCapacity) {
+
+	size_t capacity = std::max((size_t)VNCD_ARENA_BLOCK_SIZE, minCapacity + Block::headerSize()) - Block::headerSize();
+
+	Block* block = static_cast<Block*>(pool->allocate(Block::headerSize() + capacity));
+	block->next = blocks;
+	block->capacity = capacity;
+	block->used = 0;
+
+	blocks = block;
+	return block;
+}
+
+void* VncdArena::allocate(size_t bytes) {
+
+	bytes = (bytes + VNCD_ARENA_ALIGNMENT - 1) & ~(size_t)(VNCD_ARENA_ALIGNMENT - 1);
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	Block* block = blocks;
+	if (!block || block->capacity - block->used < bytes) {
+		block = newBlock(bytes);
+	}
+
+	void* ptr = block->data() + block->used;
+	block->used += bytes;
+	return ptr;
+}
+
+void VncdArena::reset() {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!blocks) {
+		return;
+	}
+
+	// Keep the oldest block; anything that overflowed it goes back to the pool,
+	// where the next update's arena can pick it up again
+
+	Block* first = blocks;
+	while (first->next) {
+		Block* next = first->next;
+		pool->deallocate(first, Block::headerSize() + first->capacity);
+		first = next;
+	}
+
+	first->used = 0;
+	blocks = first;
+}
+
+size_t VncdArena::reservedBytes() {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	size_t total = 0;
+	for (Block* block = blocks; block; block = block->next) {
+		total += Block::headerSize() + block->capacity;
+	}
+	return total;
+}
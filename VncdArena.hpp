@@ -0,0 +1,123 @@
+/* VncdArena.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <new>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "VncdMemoryPool.hpp"
+
+#define VNCD_ARENA_BLOCK_SIZE	65536
+#define VNCD_ARENA_ALIGNMENT	16
+
+// Bump allocator for the scratch state of one FramebufferUpdate. Nothing is
+// freed individually; reset() drops everything at once. Blocks come from a
+// VncdMemoryPool, and the first one is kept across resets.
+
+class VncdArena : public asio::noncopyable {
+
+public:
+
+	VncdArena(std::shared_ptr<VncdMemoryPool> pool);
+
+	~VncdArena();
+
+	void* allocate(size_t bytes); // safe to call from several encoder threads
+
+	// Destructors are not run by reset(), so only use this for objects that
+	// are destroyed explicitly or don't need destroying
+	template <typename T, typename... Args>
+	T* create(Args&&... args) {
+		return new (allocate(sizeof(T))) T(std::forward<Args>(args)...);
+	}
+
+	void reset();
+
+	size_t reservedBytes();
+
+protected:
+
+	struct Block {
+		Block* next;
+		size_t capacity;
+		size_t used;
+		char* data() { return reinterpret_cast<char*>(this) + headerSize(); }
+		static size_t headerSize() { return (sizeof(Block) + VNCD_ARENA_ALIGNMENT - 1) & ~(size_t)(VNCD_ARENA_ALIGNMENT - 1); }
+	};
+
+	std::shared_ptr<VncdMemoryPool> pool;
+
+	std::mutex lock;
+
+	Block* blocks; // most recent first
+
+	Block* newBlock(size_t minCapacity);
+
+};
+
+// Standard allocator over a VncdArena, for containers that live no longer
+// than the update
+
+template <typename T>
+class VncdArenaAllocator {
+
+public:
+
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind {
+		typedef VncdArenaAllocator<U> other;
+	};
+
+	VncdArena* arena;
+
+	VncdArenaAllocator(VncdArena* arena) :
+		arena(arena)
+	{
+	}
+
+	template <typename U>
+	VncdArenaAllocator(const VncdArenaAllocator<U>& other) :
+		arena(other.arena)
+	{
+	}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(arena->allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T*, size_t) {
+		// released by VncdArena::reset()
+	}
+
+	template <typename U>
+	bool operator==(const VncdArenaAllocator<U>& other) const {
+		return arena == other.arena;
+	}
+
+	template <typename U>
+	bool operator!=(const VncdArenaAllocator<U>& other) const {
+		return arena != other.arena;
+	}
+
+};
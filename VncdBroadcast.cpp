@@ -0,0 +1,389 @@
+/* VncdBroadcast.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdBroadcast.hpp"
+#include "VncdConnection.hpp"
+#include <algorithm>
+
+VncdBroadcastGroup::VncdBroadcastGroup(VncdBroadcastHub& hub, asio::io_service& io_service, const VncdSharedFramebuffer* framebuffer, const RFBPixelFormat& pixelFormat, uint32_t encoding, size_t tier) :
+	hub(hub),
+	framebuffer(framebuffer),
+	pixelFormat(pixelFormat),
+	encoding(encoding),
+	tier(tier),
+	interval(tier ? (VNCD_BROADCAST_SLOW_INTERVAL << (tier - 1)) : 0),
+	encodingInProgress(false),
+	restartPending(true),
+	dirty(false),
+	recentCount(0),
+	timer(io_service),
+	timerArmed(false)
+{
+}
+
+bool VncdBroadcastGroup::matches(const VncdSharedFramebuffer* framebuffer, const RFBPixelFormat& pixelFormat, uint32_t encoding, size_t tier) const {
+	return this->framebuffer == framebuffer && this->encoding == encoding && this->tier == tier && this->pixelFormat == pixelFormat;
+}
+
+size_t VncdBroadcastGroup::memberCount() {
+	std::lock_guard<std::mutex> guard(lock);
+	return members.size();
+}
+
+void VncdBroadcastGroup::add(std::shared_ptr<VncdConnection> member, bool refresh, const VncdRegion& backlog) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	members.push_back(std::move(member));
+	restartPending = true;
+
+	// The newcomer may still have its own notifications queued for rects the
+	// group sent before it joined; those must not be taken for duplicates
+	recentCount = 0;
+
+	if (refresh) {
+
+		// A member that was moved here missed whatever its old group sent since
+
+		VncdRect all = { 0, 0, members.back()->getFrameWidth(), members.back()->getFrameHeight() };
+		markDirty(all);
+
+	} else if (!backlog.empty()) {
+		markDirty(backlog.bounds());
+
+	} else {
+		return;
+	}
+
+	if (!timerArmed) {
+		armTimer(std::chrono::milliseconds(0));
+	}
+}
+
+bool VncdBroadcastGroup::remove(VncdConnection* member) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	for (size_t i = 0; i < members.size(); ++i) {
+		if (members[i].get() == member) {
+			members.erase(members.begin() + i);
+			break;
+		}
+	}
+
+	if (members.empty()) {
+		std::error_code ec;
+		timer.cancel(ec);
+		return false;
+	}
+	return true;
+}
+
+void VncdBroadcastGroup::regionUpdated(VncdConnection& source, uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool refresh) {
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		// Every member is told about the same change; only the first one counts
+
+		VncdRect r = { x, y, w, h };
+		if (!refresh && alreadySent(framebuffer->currentVersion(), r)) {
+			return;
+		}
+
+		markDirty(r);
+
+		if (encodingInProgress || !due()) {
+			return;
+		}
+	}
+
+	sendDirty(source);
+}
+
+bool VncdBroadcastGroup::due() {
+
+	std::chrono::system_clock::duration sinceLast = std::chrono::system_clock::now() - lastSent;
+	if (!interval.count() || sinceLast >= interval) {
+		return true;
+	}
+
+	if (!timerArmed) {
+		armTimer(std::chrono::duration_cast<std::chrono::milliseconds>(interval - sinceLast));
+	}
+	return false;
+}
+
+bool VncdBroadcastGroup::alreadySent(uint64_t version, const VncdRect& r) const {
+	for (size_t i = 0; i < std::min(recentCount, (size_t)VNCD_BROADCAST_RECENT); ++i) {
+		const SentRect& sent = recent[i];
+		if (sent.version == version &&
+			r.x >= sent.rect.x && r.y >= sent.rect.y &&
+			r.x + r.w <= sent.rect.x + sent.rect.w && r.y + r.h <= sent.rect.y + sent.rect.h) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void VncdBroadcastGroup::markDirty(const VncdRect& r) {
+
+	if (!dirty) {
+		dirtyRect = r;
+		dirty = true;
+		return;
+	}
+
+	// Bounding box; slower tiers trade some extra pixels for fewer updates
+
+	uint16_t x0 = std::min(dirtyRect.x, r.x);
+	uint16_t y0 = std::min(dirtyRect.y, r.y);
+	uint16_t x1 = (uint16_t)std::max(dirtyRect.x + dirtyRect.w, r.x + r.w);
+	uint16_t y1 = (uint16_t)std::max(dirtyRect.y + dirtyRect.h, r.y + r.h);
+
+	dirtyRect.x = x0;
+	dirtyRect.y = y0;
+	dirtyRect.w = x1 - x0;
+	dirtyRect.h = y1 - y0;
+}
+
+void VncdBroadcastGroup::armTimer(std::chrono::milliseconds delay) {
+
+	std::shared_ptr<VncdBroadcastGroup> self = shared_from_this();
+
+	timerArmed = true;
+	timer.expires_from_now(delay);
+
+	timer.async_wait([self](std::error_code ec) {
+
+		std::shared_ptr<VncdConnection> source;
+
+		{
+			std::lock_guard<std::mutex> guard(self->lock);
+
+			self->timerArmed = false;
+
+			if (ec || self->members.empty() || self->encodingInProgress) {
+				return;
+			}
+
+			source = self->members.front();
+		}
+
+		// The encoder reads the member's framebuffer and memory pool, which
+		// are only safe to touch from its strand
+		source->strand.post([self, source]() {
+			self->sendDirty(*source);
+		});
+	});
+}
+
+void VncdBroadcastGroup::sendDirty(VncdConnection& source) {
+
+	uint16_t framebufferWidth = source.getFrameWidth();
+	uint16_t framebufferHeight = source.getFrameHeight();
+
+	for (;;) {
+
+		// What to send, and to whom, is settled under the lock. Members that
+		// join while the update is encoded don't get it: its compressed data
+		// may refer back to earlier updates they never saw.
+
+		VncdRect r;
+		bool restart;
+		std::vector<std::shared_ptr<VncdConnection>> recipients;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			if (encodingInProgress || !dirty || members.empty() || !due()) {
+				return;
+			}
+
+			r = dirtyRect;
+			dirty = false;
+
+			if (r.w == 0 || r.h == 0 || r.x + r.w > framebufferWidth || r.y + r.h > framebufferHeight) {
+				return;
+			}
+
+			SentRect& sent = recent[recentCount++ % VNCD_BROADCAST_RECENT];
+			sent.version = framebuffer->currentVersion(); // read before the pixels are
+			sent.rect = r;
+
+			restart = restartPending;
+			restartPending = false;
+
+			lastSent = std::chrono::system_clock::now();
+			recipients = members;
+			encodingInProgress = true;
+		}
+
+		std::shared_ptr<VncdBufferChain> update = std::make_shared<VncdBufferChain>(source.newMessage());
+		encodeUpdate(source, *update, r, restart);
+		arena->reset();
+
+		// A member that can't keep up is moved to a slower tier rather than
+		// letting its queue grow; the others carry on at full rate
+
+		std::vector<std::shared_ptr<VncdConnection>> slow;
+		VncdEncodeCache::Payload payload = update;
+		VncdBroadcastGroup* group = this;
+
+		{
+			std::lock_guard<std::mutex> guard(lock);
+
+			encodingInProgress = false;
+
+			for (std::shared_ptr<VncdConnection>& member : recipients) {
+
+				if (tier + 1 < VNCD_BROADCAST_TIERS && member->sendQueueBytes > VNCD_BROADCAST_SLOW_BYTES) {
+					auto found = std::find(members.begin(), members.end(), member);
+					if (found != members.end()) {
+						members.erase(found);
+						slow.push_back(member);
+					}
+					continue;
+				}
+
+				// Members that have left since drop it in deliverBroadcast()
+				member->strand.post([member, group, payload]() {
+					member->deliverBroadcast(group, payload);
+				});
+			}
+		}
+
+		demote(slow);
+	}
+}
+
+void VncdBroadcastGroup::encodeUpdate(VncdConnection& source, VncdBufferChain& out, const VncdRect& r, bool restart) {
+
+	// Scratch state comes from the group's arena, which is reset after every update
+
+	if (!arena) {
+		arena.reset(new VncdArena(source.memoryPool));
+	}
+
+	VncdRectEncoder encoder(source.getFramebufferRGBX32(), source.getFrameWidth(), pixelFormat, arena.get());
+
+	if (encoding == VEM_TIGHT) {
+
+		// Tight can tell the client to reset its inflaters, so the streams start
+		// over from a zlib header
+
+		uint8_t resetStreams = 0;
+		if (restart) {
+			for (VncdDeflateStream& stream : tightStreams) {
+				stream.restart(true);
+			}
+			resetStreams = 0x0F;
+		}
+
+		VncdRectList rects((VncdArenaAllocator<VncdRect>(arena.get())));
+		VncdRectEncoder::splitTightRects(r.x, r.y, r.w, r.h, rects);
+
+		VncdRectEncoder::appendUpdateHeader(out, (uint16_t)rects.size());
+		for (size_t i = 0; i < rects.size(); ++i) {
+			uint8_t streamId = i % VNCD_TIGHT_STREAMS;
+			encoder.encodeTight(out, tightStreams[streamId].get(VNCD_ZLIB_COMPRESSION), streamId, rects[i].x, rects[i].y, rects[i].w, rects[i].h, i == 0 ? resetStreams : 0);
+		}
+
+	} else if (encoding == VEM_ZRLE || encoding == VEM_ZLIB) {
+
+		VncdDeflateStream& stream = (encoding == VEM_ZRLE) ? zrleStream : zlibStream;
+
+		// Every member's stream has already started, so only raw blocks follow
+		if (restart) {
+			stream.restart(false);
+		}
+
+		VncdRectEncoder::appendUpdateHeader(out, 1);
+		if (encoding == VEM_ZRLE) {
+			encoder.encodeZrle(out, stream.get(VNCD_ZLIB_COMPRESSION), r.x, r.y, r.w, r.h);
+		} else {
+			encoder.encodeZlib(out, stream.get(VNCD_ZLIB_COMPRESSION), r.x, r.y, r.w, r.h);
+		}
+
+	} else if (encoding == (uint32_t)VEM_TIGHTPNG) {
+
+		size_t rows = std::max((size_t)1, (size_t)VNCD_TIGHT_PNG_MAX_PIXELS / r.w);
+
+		VncdRectEncoder::appendUpdateHeader(out, (uint16_t)((r.h + rows - 1) / rows));
+		for (size_t strip_y = r.y; strip_y < (size_t)r.y + (size_t)r.h; strip_y += rows) {
+			encoder.encodeTightPng(out, r.x, (uint16_t)strip_y, r.w, (uint16_t)std::min(rows, (size_t)r.y + (size_t)r.h - strip_y));
+		}
+
+	} else {
+		VncdRectEncoder::appendUpdateHeader(out, 1);
+		encoder.encodeRaw(out, r.x, r.y, r.w, r.h);
+
+	}
+}
+
+void VncdBroadcastGroup::demote(std::vector<std::shared_ptr<VncdConnection>>& slow) {
+
+	VncdBroadcastGroup* group = this;
+
+	for (std::shared_ptr<VncdConnection>& member : slow) {
+		member->strand.post([member, group]() {
+			member->demoteBroadcast(group);
+		});
+	}
+}
+
+VncdBroadcastHub::VncdBroadcastHub(asio::io_service& io_service) :
+	io_service(io_service)
+{
+}
+
+std::shared_ptr<VncdBroadcastGroup> VncdBroadcastHub::join(std::shared_ptr<VncdConnection> member, const VncdSharedFramebuffer* framebuffer, const RFBPixelFormat& pixelFormat, uint32_t encoding, size_t tier, bool refresh, const VncdRegion& backlog) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	std::shared_ptr<VncdBroadcastGroup> group;
+
+	for (std::shared_ptr<VncdBroadcastGroup>& candidate : groups) {
+		if (candidate->matches(framebuffer, pixelFormat, encoding, tier)) {
+			group = candidate;
+			break;
+		}
+	}
+
+	if (!group) {
+		group = std::make_shared<VncdBroadcastGroup>(*this, io_service, framebuffer, pixelFormat, encoding, tier);
+		groups.push_back(group);
+	}
+
+	group->add(std::move(member), refresh, backlog);
+	return group;
+}
+
+void VncdBroadcastHub::leave(VncdConnection* member, const std::shared_ptr<VncdBroadcastGroup>& group) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (!group->remove(member)) {
+		groups.erase(std::remove(groups.begin(), groups.end(), group), groups.end());
+	}
+}
+
+size_t VncdBroadcastHub::groupCount() {
+	std::lock_guard<std::mutex> guard(lock);
+	return groups.size();
+}
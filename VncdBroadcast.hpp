@@ -0,0 +1,169 @@
+/* VncdBroadcast.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <vector>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "RFBPixelFormat.hpp"
+#include "VncdTimer.hpp"
+#include "VncdRectEncoder.hpp"
+#include "VncdDeflateStream.hpp"
+#include "VncdEncodeCache.hpp"
+#include "VncdRegion.hpp"
+
+#define VNCD_BROADCAST_TIERS			3
+#define VNCD_BROADCAST_SLOW_BYTES		(4 * 1024 * 1024)	// queued bytes that mark a viewer as slow
+#define VNCD_BROADCAST_SLOW_INTERVAL	250					// ms between updates in the first slower tier; doubles per tier
+#define VNCD_BROADCAST_RECENT			8					// rects remembered to drop duplicate notifications
+
+class VncdConnection;
+class VncdBroadcastHub;
+
+// Viewers of one shared framebuffer that use the same pixel format and
+// encoding. Every update is encoded once, with the group's own compressors,
+// and the identical bytes are queued on every member's socket.
+//
+// A member's zlib streams switch to the group's compressors at a flush
+// boundary. When anyone joins, the group drops its compression history: Tight
+// resets the client's inflaters in-band, and the other encodings carry on as
+// raw deflate blocks that don't refer back to data the newcomer never saw.
+
+class VncdBroadcastGroup : public asio::noncopyable, public std::enable_shared_from_this<VncdBroadcastGroup> {
+
+	friend class VncdBroadcastHub;
+	friend class VncdConnection;
+
+public:
+
+	VncdBroadcastGroup(VncdBroadcastHub& hub, asio::io_service& io_service, const VncdSharedFramebuffer* framebuffer, const RFBPixelFormat& pixelFormat, uint32_t encoding, size_t tier);
+
+	// Called on the member's strand. A refresh is sent even if the rect has
+	// already gone out for the current framebuffer version.
+	void regionUpdated(VncdConnection& source, uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool refresh);
+
+	bool matches(const VncdSharedFramebuffer* framebuffer, const RFBPixelFormat& pixelFormat, uint32_t encoding, size_t tier) const;
+
+	size_t memberCount();
+
+protected:
+
+	struct SentRect {
+		uint64_t version;
+		VncdRect rect;
+	};
+
+	VncdBroadcastHub& hub;
+
+	const VncdSharedFramebuffer* framebuffer;
+
+	RFBPixelFormat pixelFormat;
+
+	uint32_t encoding;
+
+	size_t tier;
+
+	std::chrono::milliseconds interval; // zero sends every update as it comes
+
+	// Guards everything below but the encoder state, which belongs to
+	// whichever member's strand has set encodingInProgress
+	std::mutex lock;
+
+	std::vector<std::shared_ptr<VncdConnection>> members;
+
+	bool encodingInProgress;
+
+	std::unique_ptr<VncdArena> arena;
+
+	VncdDeflateStream zlibStream;
+	VncdDeflateStream zrleStream;
+	VncdDeflateStream tightStreams[VNCD_TIGHT_STREAMS];
+
+	bool restartPending; // someone joined since the last update
+
+	// Waiting to be sent, for groups that are rate limited or owe a refresh
+	bool dirty;
+
+	VncdRect dirtyRect;
+
+	SentRect recent[VNCD_BROADCAST_RECENT];
+
+	size_t recentCount;
+
+	std::chrono::system_clock::time_point lastSent;
+
+	VncdTimer timer;
+
+	bool timerArmed;
+
+	// Damage the member held back while it was congested is sent to the whole
+	// group, as the group has no way to send to one member alone
+	void add(std::shared_ptr<VncdConnection> member, bool refresh, const VncdRegion& backlog);
+
+	bool remove(VncdConnection* member); // false once the group is empty
+
+	bool alreadySent(uint64_t version, const VncdRect& r) const;
+
+	void markDirty(const VncdRect& r);
+
+	void armTimer(std::chrono::milliseconds delay);
+
+	// Called on the source member's strand, without the lock. Encodes and
+	// sends the dirty rect, and then whatever was marked dirty meanwhile.
+	// Only one member encodes at a time; the others leave it their damage.
+	void sendDirty(VncdConnection& source);
+
+	// With the lock held: whether the group may send now, or has to wait for
+	// its tier's interval
+	bool due();
+
+	void encodeUpdate(VncdConnection& source, VncdBufferChain& out, const VncdRect& r, bool restart);
+
+	void demote(std::vector<std::shared_ptr<VncdConnection>>& slow);
+
+};
+
+// The broadcast groups of one server
+
+class VncdBroadcastHub : public asio::noncopyable {
+
+public:
+
+	explicit VncdBroadcastHub(asio::io_service& io_service);
+
+	// Called on the member's strand; the member must not be in a group
+	std::shared_ptr<VncdBroadcastGroup> join(std::shared_ptr<VncdConnection> member, const VncdSharedFramebuffer* framebuffer, const RFBPixelFormat& pixelFormat, uint32_t encoding, size_t tier, bool refresh, const VncdRegion& backlog = VncdRegion());
+
+	void leave(VncdConnection* member, const std::shared_ptr<VncdBroadcastGroup>& group);
+
+	size_t groupCount();
+
+protected:
+
+	asio::io_service& io_service;
+
+	std::mutex lock;
+
+	std::vector<std::shared_ptr<VncdBroadcastGroup>> groups;
+
+};
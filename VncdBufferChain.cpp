@@ -0,0 +1,239 @@
+/* VncdBufferChain.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdBufferChain.hpp"
+#include <cstring>
+#include <algorithm>
+#include <new>
+
+VncdBufferChain::VncdBufferChain(std::shared_ptr<VncdMemoryPool> pool) :
+	pool(std::move(pool)),
+	head(nullptr),
+	tail(nullptr),
+	totalSize(0)
+{
+}
+
+VncdBufferChain::VncdBufferChain(VncdBufferChain&& other) :
+	pool(other.pool),
+	head(other.head),
+	tail(other.tail),
+	totalSize(other.totalSize)
+{
+	other.head = other.tail = nullptr;
+	other.totalSize = 0;
+}
+
+VncdBufferChain& VncdBufferChain::operator=(VncdBufferChain&& other) {
+	if (this != &other) {
+		release();
+		pool = other.pool;
+		head = other.head;
+		tail = other.tail;
+		totalSize = other.totalSize;
+		other.head = other.tail = nullptr;
+		other.totalSize = 0;
+	}
+	return *this;
+}
+
+VncdBufferChain::~VncdBufferChain() {
+	release();
+}
+
+void VncdBufferChain::release() {
+	while (head) {
+		Chunk* next = head->next;
+		if (head->shared) {
+			reinterpret_cast<SharedChain*>(head->data())->~SharedChain();
+			pool->deallocate(head, sizeof(Chunk) + sizeof(SharedChain));
+		} else {
+			pool->deallocate(head, sizeof(Chunk) + head->capacity);
+		}
+		head = next;
+	}
+	tail = nullptr;
+	totalSize = 0;
+}
+
+size_t VncdBufferChain::size() const {
+	return totalSize;
+}
+
+bool VncdBufferChain::empty() const {
+	return totalSize == 0;
+}
+
+void VncdBufferChain::clear() {
+	release();
+}
+
+VncdBufferChain::Chunk* VncdBufferChain::tailWithSpace(size_t minFree) {
+
+	if (tail && tail->capacity - tail->size >= minFree) {
+		return tail;
+	}
+
+	size_t capacity = head ? VNCD_CHUNK_SIZE : VNCD_CHUNK_SIZE_SMALL;
+	capacity = std::max(capacity, minFree + sizeof(Chunk)) - sizeof(Chunk); // whole pool blocks
+
+	Chunk* c = static_cast<Chunk*>(pool->allocate(sizeof(Chunk) + capacity));
+	c->capacity = capacity;
+	c->size = 0;
+	c->shared = nullptr;
+
+	link(c);
+	return c;
+}
+
+void VncdBufferChain::link(Chunk* c) {
+	c->next = nullptr;
+
+	if (tail) {
+		tail->next = c;
+	} else {
+		head = c;
+	}
+	tail = c;
+}
+
+void VncdBufferChain::append(const void* data, size_t len) {
+
+	const char* src = static_cast<const char*>(data);
+
+	while (len) {
+		Chunk* c = tailWithSpace(1);
+		size_t n = std::min(len, c->capacity - c->size);
+		memcpy(c->data() + c->size, src, n);
+		c->size += n;
+		totalSize += n;
+		src += n;
+		len -= n;
+	}
+}
+
+void VncdBufferChain::append(const std::string& data) {
+	append(data.data(), data.size());
+}
+
+void VncdBufferChain::append(VncdBufferChain&& other) {
+
+	if (!other.head) {
+		return;
+	}
+
+	if (tail) {
+		tail->next = other.head;
+	} else {
+		head = other.head;
+	}
+	tail = other.tail;
+	totalSize += other.totalSize;
+
+	other.head = other.tail = nullptr;
+	other.totalSize = 0;
+}
+
+void VncdBufferChain::appendShared(const std::shared_ptr<const VncdBufferChain>& other, size_t skip) {
+
+	// One small chunk per chunk of the other chain. They are full, so later
+	// appends start a chunk of their own.
+
+	for (Chunk* src = other->head; src; src = src->next) {
+		if (src->size <= skip) {
+			skip -= src->size;
+			continue;
+		}
+
+		Chunk* c = static_cast<Chunk*>(pool->allocate(sizeof(Chunk) + sizeof(SharedChain)));
+		new (c->data()) SharedChain(other);
+		c->capacity = src->size - skip;
+		c->size = src->size - skip;
+		c->shared = src->bytes() + skip;
+		skip = 0;
+
+		link(c);
+		totalSize += c->size;
+	}
+}
+
+char* VncdBufferChain::reserve(size_t len) {
+	Chunk* c = tailWithSpace(len);
+	return c->data() + c->size;
+}
+
+void VncdBufferChain::commit(size_t len) {
+	tail->size += len;
+	totalSize += len;
+}
+
+VncdBufferChain::Placeholder VncdBufferChain::placeholder(size_t len) {
+	Placeholder where;
+	where.ptr = reserve(len);
+	where.len = len;
+
+	commit(len);
+	return where;
+}
+
+void VncdBufferChain::patch(const Placeholder& where, const void* data, size_t len) {
+	memcpy(where.ptr, data, std::min(len, where.len));
+}
+
+size_t VncdBufferChain::appendDeflated(mz_stream* stream, const void* in, size_t len, int flush) {
+
+	size_t before = totalSize;
+
+	stream->next_in = static_cast<const unsigned char*>(in);
+	stream->avail_in = (unsigned int)len;
+
+	do {
+		Chunk* c = tailWithSpace(64);
+
+		stream->next_out = reinterpret_cast<unsigned char*>(c->data() + c->size);
+		stream->avail_out = (unsigned int)(c->capacity - c->size);
+
+		unsigned int availBefore = stream->avail_out;
+		int status = mz_deflate(stream, flush);
+		commit(availBefore - stream->avail_out);
+
+		if (status != MZ_OK && status != MZ_BUF_ERROR) {
+			break;
+		}
+
+	} while (stream->avail_out == 0 || stream->avail_in != 0);
+
+	return totalSize - before;
+}
+
+void VncdBufferChain::buffers(std::vector<asio::const_buffer>& out) const {
+	for (Chunk* c = head; c; c = c->next) {
+		if (c->size) {
+			out.push_back(asio::const_buffer(c->bytes(), c->size));
+		}
+	}
+}
+
+std::string VncdBufferChain::toString() const {
+	std::string ret;
+	ret.reserve(totalSize);
+	for (Chunk* c = head; c; c = c->next) {
+		ret.append(c->bytes(), c->size);
+	}
+	return ret;
+}
@@ -0,0 +1,131 @@
+/* VncdBufferChain.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "miniz_wrapper.h"
+#include "VncdMemoryPool.hpp"
+
+#define VNCD_CHUNK_SIZE_SMALL	4096	// first chunk of a message
+#define VNCD_CHUNK_SIZE			65536	// every chunk after that
+
+// A buffer sequence over a vector that stays put for the length of a write,
+// so asio's write operation doesn't copy the vector
+
+struct VncdConstBufferList {
+	typedef asio::const_buffer value_type;
+	typedef std::vector<asio::const_buffer>::const_iterator const_iterator;
+
+	const std::vector<asio::const_buffer>* list;
+
+	const_iterator begin() const { return list->begin(); }
+	const_iterator end() const { return list->end(); }
+};
+
+// An outgoing message held as a list of pooled chunks. Encoders write, and
+// deflate, straight into the chunks; the socket writes them with a gather
+// write, and the chunks go back to the pool when the chain is destroyed.
+
+class VncdBufferChain : public asio::noncopyable {
+
+public:
+
+	// A reserved span that is filled in later, such as a length prefix that
+	// isn't known until the data after it has been compressed
+	struct Placeholder {
+		char* ptr; // chunks never move
+		size_t len;
+	};
+
+	explicit VncdBufferChain(std::shared_ptr<VncdMemoryPool> pool);
+
+	VncdBufferChain(VncdBufferChain&& other);
+
+	VncdBufferChain& operator=(VncdBufferChain&& other);
+
+	~VncdBufferChain();
+
+	size_t size() const;
+
+	bool empty() const;
+
+	void clear();
+
+	void append(const void* data, size_t len);
+
+	void append(const std::string& data);
+
+	void append(VncdBufferChain&& other); // takes over other's chunks without copying
+
+	// Refers to a finished chain's data instead of copying it, keeping that
+	// chain alive until this one is released. Several chains may share it.
+	// The first skip bytes of the other chain are left out.
+	void appendShared(const std::shared_ptr<const VncdBufferChain>& other, size_t skip = 0);
+
+	// Contiguous space for up to VNCD_CHUNK_SIZE bytes; call commit() with the
+	// number of bytes actually written
+	char* reserve(size_t len);
+
+	void commit(size_t len);
+
+	Placeholder placeholder(size_t len);
+
+	void patch(const Placeholder& where, const void* data, size_t len);
+
+	// Runs mz_deflate with its output going directly into the chain. Returns
+	// the number of compressed bytes added.
+	size_t appendDeflated(mz_stream* stream, const void* in, size_t len, int flush);
+
+	void buffers(std::vector<asio::const_buffer>& out) const;
+
+	std::string toString() const;
+
+protected:
+
+	struct Chunk {
+		Chunk* next;
+		size_t capacity;
+		size_t size;
+		const char* shared; // set on chunks that point into a shared chain, which is held in data()
+		char* data() { return reinterpret_cast<char*>(this + 1); }
+		const char* bytes() { return shared ? shared : data(); }
+	};
+
+	typedef std::shared_ptr<const VncdBufferChain> SharedChain;
+
+	std::shared_ptr<VncdMemoryPool> pool;
+
+	Chunk* head;
+
+	Chunk* tail;
+
+	size_t totalSize;
+
+	Chunk* tailWithSpace(size_t minFree);
+
+	void link(Chunk* c);
+
+	void release();
+
+};
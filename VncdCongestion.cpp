@@ -0,0 +1,118 @@
+/* VncdCongestion.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdCongestion.hpp"
+#include <algorithm>
+
+VncdCongestion::VncdCongestion() :
+	position(0),
+	acknowledged(0),
+	congestionWindow(VNCD_CONGESTION_INITIAL_WINDOW),
+	slowStart(true),
+	measured(false),
+	smoothedRtt(0),
+	minRtt(0),
+	lastPongPosition(0),
+	throughput(0)
+{
+}
+
+void VncdCongestion::sent(size_t bytes) {
+	position += bytes;
+}
+
+void VncdCongestion::sentPing() {
+	Ping ping = { Clock::now(), position, inFlight() };
+	pings.push_back(ping);
+}
+
+void VncdCongestion::gotPong() {
+
+	if (pings.empty()) {
+		return; // not one of ours
+	}
+
+	Ping ping = pings.front();
+	pings.pop_front();
+
+	Clock::time_point now = Clock::now();
+	Clock::duration rtt = now - ping.sent;
+
+	acknowledged = std::max(acknowledged, ping.position);
+
+	if (!measured) {
+		minRtt = smoothedRtt = rtt;
+	} else {
+		minRtt = std::min(minRtt, rtt);
+		smoothedRtt = (smoothedRtt * 7 + rtt) / 8;
+	}
+
+	// Only fences that were sent while the previous one was outstanding show
+	// what the link delivers; after an idle spell the time between answers
+	// says nothing about it
+
+	if (measured && ping.sent < lastPong && now > lastPong) {
+		double seconds = std::chrono::duration<double>(now - lastPong).count();
+		double rate = (double)(ping.position - lastPongPosition) / seconds;
+		throughput = throughput ? throughput * 0.75 + rate * 0.25 : rate;
+	}
+
+	lastPong = now;
+	lastPongPosition = ping.position;
+	measured = true;
+
+	// Growing is only justified if the window was being used
+
+	if (rtt - minRtt > std::chrono::milliseconds(VNCD_CONGESTION_EXTRA_DELAY)) {
+		congestionWindow = std::max((size_t)VNCD_CONGESTION_MIN_WINDOW, congestionWindow * 3 / 4);
+		slowStart = false;
+
+	} else if (ping.inFlight >= congestionWindow / 2) {
+		if (slowStart) {
+			congestionWindow *= 2;
+		} else {
+			congestionWindow += congestionWindow / 8;
+		}
+		congestionWindow = std::min(congestionWindow, (size_t)VNCD_CONGESTION_MAX_WINDOW);
+
+	}
+}
+
+bool VncdCongestion::congested() const {
+	return measured && !pings.empty() && inFlight() >= congestionWindow;
+}
+
+size_t VncdCongestion::inFlight() const {
+	return (size_t)(position - acknowledged);
+}
+
+size_t VncdCongestion::window() const {
+	return congestionWindow;
+}
+
+std::chrono::milliseconds VncdCongestion::roundTripTime() const {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(smoothedRtt);
+}
+
+std::chrono::milliseconds VncdCongestion::baseRoundTripTime() const {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(minRtt);
+}
+
+size_t VncdCongestion::bandwidth() const {
+	return (size_t)throughput;
+}
@@ -0,0 +1,96 @@
+/* VncdCongestion.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <deque>
+
+#define VNCD_CONGESTION_INITIAL_WINDOW	(64 * 1024)
+#define VNCD_CONGESTION_MIN_WINDOW		(16 * 1024)
+#define VNCD_CONGESTION_MAX_WINDOW		(32 * 1024 * 1024)
+#define VNCD_CONGESTION_EXTRA_DELAY		50 // ms over the shortest round trip that mean the link is queueing
+
+// Estimates how much a client's link can carry from fences sent after
+// updates. The client answers a fence once it has processed everything sent
+// before it, so each answer gives a round trip time and acknowledges the
+// bytes up to that fence. A window limits the bytes not yet acknowledged: it
+// grows while round trips stay near the shortest seen, and shrinks once they
+// rise, which means the bytes are queueing somewhere on the way.
+
+class VncdCongestion {
+
+public:
+
+	typedef std::chrono::steady_clock Clock;
+
+	VncdCongestion();
+
+	void sent(size_t bytes); // queued for the client
+
+	void sentPing(); // a fence has just been queued
+
+	void gotPong(); // the client answered the oldest fence
+
+	// True while the bytes not yet acknowledged fill the window. Always false
+	// until a round trip has been measured, or when no fence is outstanding
+	// that could acknowledge them.
+	bool congested() const;
+
+	size_t inFlight() const;
+
+	size_t window() const;
+
+	std::chrono::milliseconds roundTripTime() const; // smoothed; zero until measured
+
+	std::chrono::milliseconds baseRoundTripTime() const; // the shortest seen
+
+	size_t bandwidth() const; // bytes per second delivered while busy; zero until measured
+
+protected:
+
+	struct Ping {
+		Clock::time_point sent;
+		uint64_t position;
+		size_t inFlight; // when it was sent
+	};
+
+	std::deque<Ping> pings;
+
+	uint64_t position; // bytes queued
+
+	uint64_t acknowledged; // bytes the client has processed
+
+	size_t congestionWindow;
+
+	bool slowStart;
+
+	bool measured;
+
+	Clock::duration smoothedRtt;
+
+	Clock::duration minRtt;
+
+	Clock::time_point lastPong;
+
+	uint64_t lastPongPosition;
+
+	double throughput;
+
+};
@@ -18,44 +18,260 @@
 
 #include "VncdConnection.hpp"
 #include <sstream>
+#include <algorithm>
 
 #include "miniz_wrapper.h"
 #include "des/d3des.h"
 
 // {{{ 
 
-#define VNCD_MAX_RECT_SIZE_HEIGHT	512
-#define VNCD_MAX_RECT_SIZE_WIDTH	512
-#define VNCD_ZLIB_COMPRESSION		MZ_DEFAULT_COMPRESSION
+#define VNCD_STRIP_PIXELS			(1024 * 1024)	// larger updates are sent a strip at a time
+#define VNCD_STRIP_QUEUED_BYTES		(4 * 1024 * 1024)	// the next strip waits until less than this is queued
+#define VNCD_PARALLEL_MIN_PIXELS	(256 * 256)	// smaller stateless rects are not split
+#define VNCD_PARALLEL_MIN_STRIP		64
+#define VNCD_UPDATES_IN_FLIGHT		2	// with this many being encoded, new damage waits
+#define VNCD_DEFERRED_RECTS			1024	// deferred rects are merged into their region at least this often
+#define VNCD_INLINE_SLICE_PIXELS	(64 * 1024)	// about 16 ZRLE tiles between trips to the io_service
+#define VNCD_MESSAGE_UNKNOWN		((size_t)-1)
+#define VNCD_MESSAGE_TOO_LONG		((size_t)-2)
+#define VNCD_CUT_TEXT_MAX			(1024 * 1024)	// longer ClientCutText closes the connection
+#define VNCD_FENCE_MAX_PAYLOAD		64
+#define VNCD_LOW_BANDWIDTH			(1024 * 1024)		// bytes per second
+#define VNCD_HIGH_BANDWIDTH			(16 * 1024 * 1024)
+#define VNCD_THROTTLE_DEGRADE_AFTER	4	// writes in a row held back by a quota before compressing harder
 
 // }}}
 
 VncdConnection::VncdConnection(asio::ip::tcp::socket tcpConnection, VncdTimer timer) :
 	tcpConnection(std::move(tcpConnection)),
 	timer(std::move(timer)),
+	strand(this->tcpConnection.get_io_service()),
+	sendQueueHead(nullptr),
+	sendQueueTail(nullptr),
+	sendQueueBytes(0),
+	connectionOpen(true),
+	registry(nullptr),
+	registrySlot(0),
+	pendingHead(nullptr),
+	pendingTail(nullptr),
+	encoderPool(nullptr),
+	slicePosted(false),
+	encodeCache(nullptr),
+	tileCache(nullptr),
+	broadcastHub(nullptr),
+	desktopSizeSupported(false),
+	extendedDesktopSizeSupported(false),
+	sizeChangePending(false),
+	sizeChangeReason(VDR_SERVER),
 	sb_mutable(sb.prepare(4096)),
 	useEncodingMode(VEM_RAW),
-	zrleStream({ 0 }),
-	zlibStream({ 0 })
+	tightResetPending(false),
+	damageSentVersion(0),
+	damagePending(false),
+	sendQueueLimit(0),
+	damagePullDeferred(false),
+	stripBacklog(false),
+	speculation(nullptr),
+	speculationValid(false),
+	fenceSupported(false),
+	totalBandwidthLimit(nullptr),
+	throttleTimer(this->tcpConnection.get_io_service()),
+	throttleWaiting(false),
+	throttleStreak(0),
+	throttledTime(0),
+	bytesSent(0),
+	rateWindowBytes(0),
+	rateWindowStart(std::chrono::steady_clock::now()),
+	recentRate(0),
+	continuousUpdatesSupported(false),
+	continuousUpdates(false),
+	endOfContinuousUpdatesPending(false),
+	sentCursorEncoding(0),
+	cursorShapeSupported(false),
+	cursorPosSupported(false),
+	idleTrimPeriod(0),
+	trimTimerArmed(false)
 {
-	// One ZRLE stream is used for the entire protocol session
-	mz_deflateInit(&zrleStream, VNCD_ZLIB_COMPRESSION);
+	// One ZRLE, one ZLIB and four Tight streams are used for the entire
+	// protocol session; each is set up the first time it is needed
+}
+
+VncdConnection::~VncdConnection() {
+
+	while (sendQueueHead) {
+		popQueuedMessage();
+	}
 
-	// One ZLIB stream is used for the entire protocol session
-	mz_deflateInit(&zlibStream, VNCD_ZLIB_COMPRESSION);
+	// A finished speculative update no longer holds a reference to us
+	if (speculation) {
+		discardSpeculation();
+	}
 
 }
 
-VncdConnection::~VncdConnection() {
+bool VncdConnection::isOpen() const {
+	return connectionOpen;
+}
+
+size_t VncdConnection::heapAllocations() const {
+	return memoryPool ? memoryPool->heapAllocations() : 0;
+}
+
+void VncdConnection::closeConnection() {
+	if (connectionOpen.exchange(false)) {
+		std::error_code ec;
+		tcpConnection.close(ec);
+		timer.cancel(ec);
+		throttleTimer.cancel(ec);
+
+		leaveBroadcast();
+
+		if (registry) {
+			registry->remove(registrySlot);
+		}
+	}
+}
+
+VncdBufferChain VncdConnection::newMessage() {
+	if (!memoryPool) {
+		memoryPool = std::make_shared<VncdMemoryPool>();
+	}
+	return VncdBufferChain(memoryPool);
+}
+
+void VncdConnection::queueMessage(std::string message, std::function<void()> onSent) {
+	VncdBufferChain chain = newMessage();
+	chain.append(message);
+	queueMessage(std::move(chain), std::move(onSent));
+}
+
+void VncdConnection::queueMessage(VncdBufferChain message, std::function<void()> onSent) {
 	
-	mz_deflateEnd(&zrleStream);
-	mz_deflateEnd(&zlibStream);
+	// Only one write may be outstanding on the socket at a time, and the
+	// message must stay alive until it completes
+
+	sendQueueBytes += message.size();
+	congestion.sent(message.size());
+
+	QueuedMessage* queued = new (memoryPool->allocate(sizeof(QueuedMessage))) QueuedMessage(std::move(message), std::move(onSent));
+
+	if (sendQueueTail) {
+		sendQueueTail->next = queued;
+		sendQueueTail = queued;
+		return;
+	}
+
+	sendQueueHead = sendQueueTail = queued;
+	sendNextQueuedMessage();
+}
+
+void VncdConnection::popQueuedMessage() {
+	QueuedMessage* front = sendQueueHead;
+
+	sendQueueHead = front->next;
+	if (!sendQueueHead) {
+		sendQueueTail = nullptr;
+	}
 
+	sendQueueBytes -= front->data.size();
+	front->~QueuedMessage(); // returns the chunks
+	memoryPool->deallocate(front, sizeof(QueuedMessage));
 }
 
-std::string VncdConnection::getBuffer(size_t numBytes) {
-	const char* ptr = asio::buffer_cast<const char*>(sb.data());
-	return std::string(ptr, numBytes);	
+void VncdConnection::sendNextQueuedMessage() {
+
+	if (throttle(sendQueueHead->data.size())) {
+		return;
+	}
+
+	auto self = shared_from_this();
+
+	sendBuffers.clear();
+	sendQueueHead->data.buffers(sendBuffers);
+
+	VncdConstBufferList buffers = { &sendBuffers };
+
+	asio::async_write(
+		tcpConnection,
+		buffers,
+		strand.wrap(vncdAllocHandler(writeHandlerMemory, [this, self](std::error_code ec, std::size_t nb) {
+
+			if (ec) {
+				while (sendQueueHead) {
+					popQueuedMessage();
+				}
+				closeConnection();
+				return;
+			}
+
+			bytesSent += nb;
+			rateWindowBytes += nb;
+
+			auto now = std::chrono::steady_clock::now();
+			if (now - rateWindowStart >= std::chrono::seconds(1)) {
+				recentRate = (size_t)(rateWindowBytes / std::chrono::duration<double>(now - rateWindowStart).count());
+				rateWindowBytes = 0;
+				rateWindowStart = now;
+			}
+
+			std::function<void()> onSent = std::move(sendQueueHead->onSent);
+			popQueuedMessage();
+
+			if (onSent) {
+				onSent();
+			}
+
+			if (sendQueueHead) {
+				sendNextQueuedMessage();
+			}
+
+			sendDeferredUpdates();
+		}))
+	);
+}
+
+bool VncdConnection::throttle(size_t bytes) {
+
+	// The handshake is a few bytes, and shouldn't wait behind other clients
+	if (currentState != VCS_READY) {
+		return false;
+	}
+
+	VncdTokenBucket::Clock::duration wait = bandwidthLimit.delay();
+	if (totalBandwidthLimit) {
+		wait = std::max(wait, totalBandwidthLimit->delay());
+	}
+
+	if (wait == VncdTokenBucket::Clock::duration::zero()) {
+		bandwidthLimit.take(bytes);
+		if (totalBandwidthLimit) {
+			totalBandwidthLimit->take(bytes);
+		}
+
+		if (!throttleWaiting) {
+			throttleStreak = 0;
+		}
+		throttleWaiting = false;
+		return false;
+	}
+
+	// Another connection may take the shared quota first, in which case this
+	// one waits again
+
+	throttleWaiting = true;
+	++throttleStreak;
+	throttledTime += wait;
+
+	auto self = shared_from_this();
+
+	throttleTimer.expires_from_now(std::chrono::duration_cast<VncdTimer::duration>(wait));
+	throttleTimer.async_wait(strand.wrap([this, self](std::error_code ec) {
+		if (!ec && isOpen() && sendQueueHead) {
+			sendNextQueuedMessage();
+		}
+	}));
+
+	return true;
 }
 
 void VncdConnection::notifyClient_connectionAccepted() {
@@ -65,40 +281,119 @@ void VncdConnection::notifyClient_connectionAccepted() {
 
 	// Send handshake message
 
-	tcpConnection.async_send(
-		asio::buffer("RFB 003.008\n", 12),
-		[this](std::error_code ec, std::size_t nb) {
-			// Wait for "RFB XXX.YYY\n" response from client
-			currentState = VCS_HANDSHAKE_2_WAITING_FOR_PROTOCOL_RESPONSE;			
-		}
-	);
+	auto self = shared_from_this();
+
+	strand.dispatch([this, self]() {
+		// Wait for "RFB XXX.YYY\n" response from client
+		currentState = VCS_HANDSHAKE_2_WAITING_FOR_PROTOCOL_RESPONSE;
+		queueMessage(std::string("RFB 003.008\n", 12));
 
-	awaitProtocolMessage();
+		awaitProtocolMessage();
+	});
 }
 
 void VncdConnection::awaitProtocolMessage() {
+	auto self = shared_from_this();
+
 	tcpConnection.async_read_some(
 		sb_mutable,
-		[this](std::error_code ec, std::size_t nb) {
+		strand.wrap(vncdAllocHandler(readHandlerMemory, [this, self](std::error_code ec, std::size_t nb) {
 
 			if (ec) {
 				setCurrentStatusMessage("Network failure.");
-				tcpConnection.close();
+				closeConnection();
 				return;
 
 			} else {
-				std::string message = getBuffer(nb);
-				handleProtocolMessage(message);
-				if (tcpConnection.is_open()) {
+				inbox.append(asio::buffer_cast<const char*>(sb_mutable), nb);
+				handleProtocolMessages();
+				if (isOpen()) {
 					awaitProtocolMessage(); // loop (tail call)
 				}
 
 			}
 
-		}
+		}))
 	);
 }
 
+void VncdConnection::handleProtocolMessages() {
+
+	size_t offset = 0;
+
+	while (isOpen()) {
+		size_t length = protocolMessageLength(inbox.data() + offset, inbox.size() - offset);
+
+		if (length == VNCD_MESSAGE_UNKNOWN) {
+			// There's no telling where the next message starts
+			setCurrentStatusMessage("Got message (unknown type)");
+			offset = inbox.size();
+			break;
+		}
+
+		if (length == VNCD_MESSAGE_TOO_LONG) {
+			// Rather than buffer whatever the client claims to be sending
+			setCurrentStatusMessage("Got message (too long)");
+			closeConnection();
+			offset = inbox.size();
+			break;
+		}
+
+		if (length == 0 || length > inbox.size() - offset) {
+			break;
+		}
+
+		handleProtocolMessage(inbox.substr(offset, length));
+		offset += length;
+	}
+
+	inbox.erase(0, offset);
+}
+
+size_t VncdConnection::protocolMessageLength(const char* data, size_t available) const {
+
+	switch (currentState) {
+		case VCS_HANDSHAKE_2_WAITING_FOR_PROTOCOL_RESPONSE: return 12;
+		case VCS_HANDSHAKE_4_WAITING_FOR_SECURITY_SELECTION: return 1;
+		case VCS_HANDSHAKE_6_WAITING_FOR_SECURITY_RESPONSE: return 16;
+		case VCS_HANDSHAKE_8_WAITING_FOR_CLIENTINIT: return 1;
+		case VCS_READY: break;
+		default: return available; // handleProtocolMessage() rejects it
+	}
+
+	if (available == 0) {
+		return 0;
+	}
+
+	switch ((uint8_t)data[0]) {
+		case 0: return 20;	// SetPixelFormat
+		case 3: return 10;	// FramebufferUpdateRequest
+		case 4: return 8;	// KeyEvent
+		case 5: return 6;	// PointerEvent
+
+		case 2: // SetEncodings
+			return available < 4 ? 0 : 4 + 4 * (((uint8_t)data[2] << 8) | (uint8_t)data[3]);
+
+		case 6: { // ClientCutText
+			if (available < 8) {
+				return 0;
+			}
+			uint32_t textLength = ntohl(*(uint32_t*)(data + 4));
+			return textLength > VNCD_CUT_TEXT_MAX ? VNCD_MESSAGE_TOO_LONG : 8 + textLength;
+		}
+
+		case 150: return 10; // EnableContinuousUpdates
+
+		case 251: // SetDesktopSize
+			return available < 8 ? 0 : 8 + 16 * (uint8_t)data[6];
+
+		case 248: // ClientFence
+			return available < 9 ? 0 : 9 + (uint8_t)data[8];
+
+		default: return VNCD_MESSAGE_UNKNOWN;
+	}
+}
+
 void VncdConnection::handleProtocolMessage(std::string message) {
 
 	switch (currentState) {
@@ -106,12 +401,11 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 		case VCS_HANDSHAKE_2_WAITING_FOR_PROTOCOL_RESPONSE: {
 			if (message != "RFB 003.008\n") {
 				setCurrentStatusMessage("Failed to agree on protocol version.");
-				tcpConnection.close();
+				closeConnection();
 				return;
 			}
 
 			setCurrentStatusMessage("Negotiating protocol security...");
-			currentState = VCS_HANDSHAKE_3_SENDING_SECURITY_TYPES;
 
 			// Send (lack of) security types
 
@@ -123,12 +417,8 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 				securityMessage = "\x01\x01"; // No authentication necessary
 			}
 
-			tcpConnection.async_send(
-				asio::buffer(securityMessage.c_str(), securityMessage.size()),
-				[this](std::error_code ec, std::size_t nb) {
-					currentState = VCS_HANDSHAKE_4_WAITING_FOR_SECURITY_SELECTION;
-				}
-			);
+			currentState = VCS_HANDSHAKE_4_WAITING_FOR_SECURITY_SELECTION;
+			queueMessage(securityMessage);
 		} break;
 
 		case VCS_HANDSHAKE_4_WAITING_FOR_SECURITY_SELECTION: {
@@ -137,32 +427,26 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 
 				if (message != "\x01") {
 					setCurrentStatusMessage("Failed to agree on protocol security.");
-					tcpConnection.close();
+					closeConnection();
 					return;
 				}
 
 				setCurrentStatusMessage("Negotiating session parameters...");
-				currentState = VCS_HANDSHAKE_7_SENDING_SECURITY_OK;
 
 				// Send successful security result
 
-				tcpConnection.async_send(
-					asio::buffer("\x00\x00\x00\x00", 4),
-					[this](std::error_code ec, std::size_t nb) {
-						currentState = VCS_HANDSHAKE_8_WAITING_FOR_CLIENTINIT;
-					}
-				);
+				currentState = VCS_HANDSHAKE_8_WAITING_FOR_CLIENTINIT;
+				queueMessage(std::string("\x00\x00\x00\x00", 4));
 
 			} else {
 
 				if (message != "\x02") {
 					setCurrentStatusMessage("Failed to agree on protocol security.");
-					tcpConnection.close();
+					closeConnection();
 					return;
 				}
 
 				setCurrentStatusMessage("Exchanging password challenge...");
-				currentState = VCS_HANDSHAKE_5_SENDING_SECURITY_CHALLENGE;
 
 				desChallengeNonce.resize(16);
 
@@ -171,12 +455,8 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 					desChallengeNonce[i] = rand() % 0xFF;
 				}
 
-				tcpConnection.async_send(
-					asio::buffer(desChallengeNonce.c_str(), desChallengeNonce.size()),
-						[this](std::error_code ec, std::size_t nb) {
-						currentState = VCS_HANDSHAKE_6_WAITING_FOR_SECURITY_RESPONSE;
-					}
-				);
+				currentState = VCS_HANDSHAKE_6_WAITING_FOR_SECURITY_RESPONSE;
+				queueMessage(desChallengeNonce);
 			}
 
 		} break;
@@ -198,20 +478,16 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 
 			if (desChallengeNonce == message) {
 				// Password match
-				tcpConnection.async_send(
-					asio::buffer("\x00\x00\x00\x00", 4), 
-					[this](std::error_code ec, std::size_t nb) {
-						currentState = VCS_HANDSHAKE_8_WAITING_FOR_CLIENTINIT;
-					}
-				);
+				currentState = VCS_HANDSHAKE_8_WAITING_FOR_CLIENTINIT;
+				queueMessage(std::string("\x00\x00\x00\x00", 4));
 				
 			} else {
 				// Password mismatch
-				tcpConnection.async_send(
-					asio::buffer("\x00\x00\x00\x01" "\x00\x00\x00\x0C" "Bad password", 4+4+0x0C),
-					[this](std::error_code ec, std::size_t nb) {
-						currentState = VCS_INVALID;
-						tcpConnection.close();
+				currentState = VCS_INVALID;
+				queueMessage(
+					std::string("\x00\x00\x00\x01" "\x00\x00\x00\x0C" "Bad password", 4+4+0x0C),
+					[this]() {
+						closeConnection();
 					}
 				);
 				
@@ -224,7 +500,7 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 
 			if (message.length() != 1) {
 				setCurrentStatusMessage("Failed to agree on session parameters.");
-				tcpConnection.close();
+				closeConnection();
 				return;
 			}
 
@@ -232,7 +508,9 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 
 			char serverInit[24] = { 0 };
 
-			uint16_t fbWidth = htons(getFrameWidth()), fbHeight = htons(getFrameHeight());
+			updateScale();
+
+			uint16_t fbWidth = htons(clientFrameWidth()), fbHeight = htons(clientFrameHeight());
 			memcpy(serverInit + 0, &fbWidth, 2);
 			memcpy(serverInit + 2, &fbHeight, 2);
 
@@ -247,12 +525,14 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 			messageToSend.append(desc);
 
 			// Send ServerInit message
-			currentState = VCS_HANDSHAKE_9_SENDING_SERVERINIT;
+			// The state advances as soon as the reply is queued, since the client may
+			// answer before our write completion handler gets to run
+
+			currentState = VCS_READY;
 
-			tcpConnection.async_send(
-				asio::buffer(messageToSend.c_str(), messageToSend.length()),
-				[this](std::error_code ec, std::size_t nb) {
-					currentState = VCS_READY;
+			queueMessage(
+				messageToSend,
+				[this]() {
 					setCurrentStatusMessage("Connected.");
 					connectionStarted();
 				}
@@ -264,9 +544,11 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 
 			if (message.length() == 20 && message[0] == '\x00') {
 				setCurrentStatusMessage("Client requested new pixel bit depth");
+				leaveBroadcast();
+				dropSpeculation();
 				networkPixelFormat.setFrom(message.substr(4));
 
-				notifyClient_regionUpdated(0, 0, getFrameWidth(), getFrameHeight()); // redraw all
+				sendRegionUpdate(0, 0, clientFrameWidth(), clientFrameHeight(), true); // redraw all
 
 			} else if (message.length() == 10 && message[0] == '\x03') {
 				setCurrentStatusMessage("Client requested rect");
@@ -277,7 +559,7 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 					uint16_t ypos = (unsigned char)message[5] + ((unsigned char)message[4] * 256);
 					uint16_t wval = (unsigned char)message[7] + ((unsigned char)message[6] * 256);
 					uint16_t hval = (unsigned char)message[9] + ((unsigned char)message[8] * 256);
-					notifyClient_regionUpdated(xpos, ypos, wval, hval);
+					sendRegionUpdate(xpos, ypos, wval, hval, true);
 				} else {
 					// await dirty-rect in this area
 				}
@@ -287,8 +569,18 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 				uint8_t buttonMask = message[1];
 				uint16_t xpos = (unsigned char)message[3] + ((unsigned char)message[2] * 256);
 				uint16_t ypos = (unsigned char)message[5] + ((unsigned char)message[4] * 256);
+				scaler.mapPoint(xpos, ypos);
 				mouseEventRecieved(xpos, ypos, buttonMask);
 
+			} else if (message.length() >= 9 && message[0] == '\xF8') {
+				handleFence(message);
+
+			} else if (message.length() == 10 && message[0] == '\x96') {
+				handleEnableContinuousUpdates(message);
+
+			} else if (message.length() >= 8 && message[0] == '\xFB') {
+				handleSetDesktopSize(message);
+
 			} else if (message.length() == 8 && message[0] == '\x04') {
 				setCurrentStatusMessage("Keyboard event");
 
@@ -300,6 +592,8 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 				}
 
 			} else if (message.length() >= 4 && message[0] == '\x02') {
+				leaveBroadcast();
+				dropSpeculation();
 				supportedEncodings.clear();
 				useEncodingMode = VEM_RAW;
 
@@ -310,7 +604,7 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 					uint32_t sval = ntohl(*(uint32_t*)(i));
 
 					// The client sends in preference order
-					if (useEncodingMode == VEM_RAW && (sval == VEM_ZLIB || sval == VEM_ZRLE || sval == VEM_TIGHTPNG)) {
+					if (useEncodingMode == VEM_RAW && (sval == VEM_ZLIB || sval == VEM_TIGHT || sval == VEM_ZRLE || sval == (uint32_t)VEM_TIGHTPNG)) {
 						useEncodingMode = (enum VncdEncodingMode)sval;
 					};
 
@@ -323,7 +617,37 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 				} else if (useEncodingMode == VEM_ZRLE) {
 					setCurrentStatusMessage("In ZRLE mode");
 
+				} else if (useEncodingMode == VEM_TIGHT) {
+					setCurrentStatusMessage("In Tight mode");
+
+				}
+
+				releaseUnusedEncoderState();
+
+				// The first fence tells whether the client answers them at all
+				if (!fenceSupported && std::find(supportedEncodings.begin(), supportedEncodings.end(), (uint32_t)VEM_FENCE) != supportedEncodings.end()) {
+					fenceSupported = true;
+					sendPing();
+				}
+
+				if (!continuousUpdatesSupported && std::find(supportedEncodings.begin(), supportedEncodings.end(), (uint32_t)VEM_CONTINUOUS_UPDATES) != supportedEncodings.end()) {
+					continuousUpdatesSupported = true;
+					sendEndOfContinuousUpdates();
+				}
+
+				cursorPosSupported = std::find(supportedEncodings.begin(), supportedEncodings.end(), (uint32_t)VEM_CURSOR_POS) != supportedEncodings.end();
+				desktopSizeSupported = std::find(supportedEncodings.begin(), supportedEncodings.end(), (uint32_t)VEM_DESKTOP_SIZE) != supportedEncodings.end();
+
+				// The first ExtendedDesktopSize rect tells the client it may ask
+				// for a new size, and what the screens are
+				bool extendedDesktopSizeListed = std::find(supportedEncodings.begin(), supportedEncodings.end(), (uint32_t)VEM_EXTENDED_DESKTOP_SIZE) != supportedEncodings.end();
+				if (extendedDesktopSizeListed && !extendedDesktopSizeSupported) {
+					extendedDesktopSizeSupported = true;
+					queueDesktopSize(VDR_SERVER, VRS_OK);
 				}
+				extendedDesktopSizeSupported = extendedDesktopSizeListed;
+				cursorShapeSupported = cursorEncoding() != 0;
+				sendCursorShape();
 
 			} else {
 				setCurrentStatusMessage("Got message (unknown type)");
@@ -334,91 +658,89 @@ void VncdConnection::handleProtocolMessage(std::string message) {
 		default: {
 			// No response was expected at this time
 			setCurrentStatusMessage("Unexpected incoming message at this time");
-			tcpConnection.close();
+			closeConnection();
 		} break;
 
 	}
 
 }
 
-static std::string buildFramebufferUpdateMessage(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint32_t e) {
-	std::string message;
-
-	message.append("\x00\x00", 2); // FramebufferUpdate message
+void VncdConnection::notifyClient_regionUpdated(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+	auto self = shared_from_this();
 
-	uint16_t numRects = htons(1);
-	message.append((char*)&numRects, sizeof(uint16_t));
+	strand.dispatch(vncdAllocHandler(notifyHandlerMemory, [this, self, x, y, w, h]() {
+		uint16_t client_x = x, client_y = y, client_w = w, client_h = h;
+		if (scaleDamage(client_x, client_y, client_w, client_h)) {
+			sendRegionUpdate(client_x, client_y, client_w, client_h);
+		}
+	}));
+}
 
-	uint16_t
-		xnet = htons(x),
-		ynet = htons(y),
-		wnet = htons(w),
-		hnet = htons(h)
-		;
+void VncdConnection::notifyClient_framebufferDamaged() {
 
-	message.append((char*)&xnet, sizeof(uint16_t));
-	message.append((char*)&ynet, sizeof(uint16_t));
-	message.append((char*)&wnet, sizeof(uint16_t));
-	message.append((char*)&hnet, sizeof(uint16_t));
+	if (damagePending.exchange(true)) {
+		return;
+	}
 
-	uint32_t encoding_type = htonl(e);
-	message.append((char*)&encoding_type, sizeof(uint32_t));
+	auto self = shared_from_this();
 
-	return message;
+	strand.post(vncdAllocHandler(damageHandlerMemory, [this, self]() {
+		damagePending = false;
+		sendFramebufferDamage();
+	}));
 }
 
-static void deflateString(mz_stream* mzs, std::string& in, std::string& out) {
+void VncdConnection::sendFramebufferDamage() {
 
-	out.clear();
-	unsigned long outBufferSize = compressBound(in.size());
-	out.resize(outBufferSize, '\x00');
+	VncdSharedFramebuffer* framebuffer = getSharedFramebuffer();
 
-	size_t previously_written = mzs->total_out;
+	if (!framebuffer || !isOpen()) {
+		return;
+	}
 
-	mzs->avail_in = in.size();
-	mzs->next_in = (unsigned char*)in.c_str();
+	// The framebuffer keeps the damage; it is fetched once the client drains
+	if (congested()) {
+		damagePullDeferred = true;
+		return;
+	}
 
-	mzs->avail_out = outBufferSize;
-	mzs->next_out = (unsigned char*)out.c_str();
+	damagedRects.clear();
+	damageSentVersion = framebuffer->damageSince(damageSentVersion, damagedRects);
 
-	mz_deflate(mzs, MZ_SYNC_FLUSH);
+	if (scaled()) {
+		size_t kept = 0;
+		for (VncdRect r : damagedRects) {
+			if (scaleDamage(r.x, r.y, r.w, r.h)) {
+				damagedRects[kept++] = r;
+			}
+		}
+		damagedRects.resize(kept);
+	}
 
-	size_t written_now = mzs->total_out - previously_written;
+	if (damagedRects.size() > 1) {
 
-	out.resize(written_now);
-}
+		// Tiles close together go out as one rect where that's cheaper
 
-void VncdConnection::notifyClient_regionUpdated(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
-	
-#if 0
+		VncdRegion damage;
+		damage.unite(damagedRects);
 
-	// Some transmission types (e.g. TightPNG) have maximum rect sizes
-	// Let's just never transmit anything bigger than 512x512.
-	// n.b. This works on TightVNC Viewer, but fails on vnc4viewer! Disable for now.
-	
-	{
-		if (w > VNCD_MAX_RECT_SIZE_WIDTH) {
-			for (size_t xtmp = x; xtmp < x + w; xtmp += VNCD_MAX_RECT_SIZE_WIDTH) {
-				notifyClient_regionUpdated(xtmp, y, std::min((size_t)VNCD_MAX_RECT_SIZE_WIDTH, w - xtmp), h);
-			}
-			return;
-		}
-		if (h > VNCD_MAX_RECT_SIZE_HEIGHT) {
-			for (size_t ytmp = y; ytmp < y + h; ytmp += VNCD_MAX_RECT_SIZE_HEIGHT) {
-				notifyClient_regionUpdated(x, ytmp, w, std::min((size_t)VNCD_MAX_RECT_SIZE_HEIGHT, h - ytmp));
-			}
-			return;
-		}
+		damagedRects.clear();
+		damage.cover(VncdRectEncoder::rectCost(useEncodingMode, networkPixelFormat), damagedRects);
+	}
+
+	for (const VncdRect& r : damagedRects) {
+		sendRegionUpdate(r.x, r.y, r.w, r.h);
 	}
+}
 
-#endif
+void VncdConnection::sendRegionUpdate(uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool refresh) {
 
 	setCurrentStatusMessage("Transmitting rect");
 
 	//
 
-	uint16_t framebufferWidth = getFrameWidth();
-	uint16_t framebufferHeight = getFrameHeight();
+	uint16_t framebufferWidth = clientFrameWidth();
+	uint16_t framebufferHeight = clientFrameHeight();
 
 	if (w == 0 || h == 0 || x + w > framebufferWidth || y + h > framebufferHeight) {
 		setCurrentStatusMessage("Skipping out-of-bounds region update");
@@ -427,163 +749,1458 @@ void VncdConnection::notifyClient_regionUpdated(uint16_t x, uint16_t y, uint16_t
 
 	//
 
-	std::string message = buildFramebufferUpdateMessage(x, y, w, h, useEncodingMode == VEM_TIGHTPNG ? VEM_TIGHT : useEncodingMode);
+	lastUpdateTime = std::chrono::system_clock::now();
+	if (idleTrimPeriod.count() && !trimTimerArmed) {
+		armTrimTimer(idleTrimPeriod);
+	}
 
-	//
+	if (broadcastGroup) {
+		broadcastGroup->regionUpdated(*this, x, y, w, h, refresh);
+		return;
+	}
+
+	if (!refresh) {
+		invalidateSpeculation(x, y, w, h);
+	}
 
-	uint8_t* framebuffer = getFramebufferRGBX32();
+	if (continuousUpdates && !refresh) {
+		const VncdRect& area = continuousUpdatesArea;
+		uint16_t x2 = std::min(x + w, area.x + area.w), y2 = std::min(y + h, area.y + area.h);
+		x = std::max(x, area.x);
+		y = std::max(y, area.y);
+		if (x >= x2 || y >= y2) {
+			return;
+		}
+		w = x2 - x;
+		h = y2 - y;
+	}
 
-	if (useEncodingMode == VEM_RAW) {
+	if (congested()) {
+		deferRect(x, y, w, h, refresh);
+		setCurrentStatusMessage("Deferring region update until the client catches up");
+		speculate();
+		return;
+	}
 
-		std::string textBuffer;
-		textBuffer.resize(w * h * (networkPixelFormat.bitsPerPixel / 8), '\x00');
+	// A large update is sent as strips of whole tile rows, each its own
+	// FramebufferUpdate. The rest waits in the deferred regions until the strip
+	// has been encoded and mostly written, so neither the encoder nor the send
+	// queue ever holds much more than a strip, however large the framebuffer.
+	if ((size_t)w * (size_t)h > VNCD_STRIP_PIXELS) {
+		size_t rows = std::max((size_t)1, (size_t)VNCD_STRIP_PIXELS / w);
+		if (rows > VNCD_SHADOW_TILE_SIZE) {
+			rows -= rows % VNCD_SHADOW_TILE_SIZE;
+		}
 
-		networkPixelFormat.copyRect(framebuffer, framebufferWidth, const_cast<char*>(textBuffer.c_str()), x, y, w, h);
+		deferRect(x, (uint16_t)(y + rows), w, (uint16_t)(h - rows), refresh);
+		h = (uint16_t)rows;
+		stripBacklog = true;
+	}
 
-		message.append(textBuffer);
+	// The tiles are hashed and encoded from a copy, so a tile drawn over and
+	// back again while the update is being encoded still goes out
 
-		
-	} else if (useEncodingMode == VEM_ZLIB) {
+	VncdRect area = { x, y, w, h };
+	VncdTileHashes::alignToTiles(framebufferWidth, framebufferHeight, area.x, area.y, area.w, area.h);
+	std::vector<uint8_t> pixels = takeSnapshot(area);
 
-		std::string textBuffer;
-		textBuffer.resize(w * h * (networkPixelFormat.bitsPerPixel / 8), '\x00');
+	if (!sentTiles.filter(pixels.data(), area, framebufferWidth, framebufferHeight, x, y, w, h, refresh)) {
+		idleSnapshots.push_back(std::move(pixels));
+		setCurrentStatusMessage("Skipping unchanged region update");
+		return;
+	}
 
-		networkPixelFormat.copyRect(framebuffer, framebufferWidth, const_cast<char*>(textBuffer.c_str()), x, y, w, h);
+	uint32_t encoding = useEncodingMode;
+	PendingUpdate* update = beginUpdate(encoding);
+	update->setSnapshot(std::move(pixels), area);
 
-		// Compress
+	if (encoding == VEM_TIGHT && tightResetPending) {
+		restartTightStreams();
+		update->tightReset = 0x0F;
+		tightResetPending = false;
+	}
 
-		std::string compressedData;
-		deflateString(&zlibStream, textBuffer, compressedData);
+	if (!encoderPool) {
 
-		// Tidy up
+		if (encoding == VEM_TIGHT) {
+			VncdRectEncoder::splitTightRects(x, y, w, h, update->rects);
 
-		textBuffer.clear(); // free slightly earlier
+		} else {
 
-		// Add stream size to buffer
+			// Strips of about a slice each, in whole ZRLE tile rows where the
+			// width allows. TightPNG strips also keep within the PNG length limit.
 
-		uint32_t compressedData_network = htonl(compressedData.size());
-		message.append((char*)&compressedData_network, sizeof(uint32_t));
+			size_t rows = std::max((size_t)1, (size_t)VNCD_INLINE_SLICE_PIXELS / w);
+			if (rows > 64) {
+				rows -= rows % 64;
+			}
 
-		// Add stream to buffer
+			for (size_t strip_y = y; strip_y < (size_t)y + (size_t)h; strip_y += rows) {
+				VncdRect strip = { x, (uint16_t)strip_y, w, (uint16_t)std::min(rows, (size_t)y + (size_t)h - strip_y) };
+				update->rects.push_back(strip);
+			}
+		}
 
-		message.append(compressedData);
-		
+		// A rect that another update is already encoding holds up the slices
+		// until its result has been posted back to the strand
+
+		if (update->sharedFramebuffer) {
+			update->waiters.resize(1);
+			update->waiters[0].onStored = [update](VncdEncodeCache::Payload payload) {
+				VncdConnection* connection = update->connection.get();
+				connection->strand.post(vncdAllocHandler(connection->updateHandlerMemory, [update, payload]() {
+					update->connection->resumeSlice(update, payload);
+				}));
+			};
+		}
 
-	} else if (useEncodingMode == VEM_TIGHTPNG) {
+		VncdRectEncoder::appendUpdateHeader(update->message, (uint16_t)update->rects.size());
+		postEncodeSlice();
+		return;
+	}
 
-		message.append("\x0A", 1); // png
+	// Jobs capture no more than a pointer or two, so std::function keeps them
+	// inline instead of allocating
 
-		std::string textBuffer;
-		textBuffer.resize(w * h * (networkPixelFormat.bitsPerPixel / 8), '\x00');
+	if (encoding == VEM_ZLIB || encoding == VEM_ZRLE) {
 
-		networkPixelFormat.copyRect(framebuffer, framebufferWidth, const_cast<char*>(textBuffer.c_str()), x, y, w, h);
+		// Deflate streams carry state from one rect to the next, so these are
+		// encoded whole and in order
 
-		size_t pngLen = 0;
-		void* pngData = tdefl_write_image_to_png_file_in_memory(textBuffer.c_str(), w, h, 3, &pngLen);
-		
-		// Tight length format
+		if (!deflateSequence) {
+			deflateSequence = std::make_shared<VncdEncoderSequence>(*encoderPool);
+		}
 
-		if (pngLen < 128) {
-			uint8_t a = pngLen;
-			message.append((char*)&a, 1);
+		VncdRect r = { x, y, w, h };
+		update->rects.push_back(r);
+		update->remaining = 1;
+
+		deflateSequence->submit([update]() {
+			encodePart(update, [update]() {
+				const VncdRect& r = update->rects[0];
+				VncdRectEncoder::appendUpdateHeader(update->message, 1);
+				update->connection->encodeRect(update->encoder, update->encoding, update->message, r.x, r.y, r.w, r.h);
+			});
+		});
+		return;
+	}
 
-		} else if (pngLen < 16384) {
-			uint8_t a = (pngLen & 0x7F);
-			uint8_t b = (pngLen >> 7) | 0x80;
-			message.append((char*)b, 1);
-			message.append((char*)a, 1);
+	if (encoding == VEM_TIGHT) {
 
-		} else {
-			uint8_t a = (pngLen & 0x7F);
-			uint8_t b = (pngLen >> 7) | 0x80;
-			uint8_t c = (pngLen >> 14) | 0x80;
-			message.append((char*)c, 1);
-			message.append((char*)b, 1);
-			message.append((char*)a, 1);
+		// Sub-rect i goes to zlib stream i % 4. Each stream is advanced by its own
+		// sequence, so the four streams compress in parallel while every stream
+		// still sees its rects in protocol order.
 
+		VncdRectEncoder::splitTightRects(x, y, w, h, update->rects);
+		update->reserveParts(update->rects.size());
+
+		size_t numStreams = std::min((size_t)VNCD_TIGHT_STREAMS, update->rects.size());
+		update->remaining = numStreams;
+
+		for (size_t streamId = 0; streamId < numStreams; ++streamId) {
+			if (!tightSequences[streamId]) {
+				tightSequences[streamId] = std::make_shared<VncdEncoderSequence>(*encoderPool);
+			}
+
+			tightSequences[streamId]->submit([update, streamId]() {
+				encodePart(update, [update, streamId]() {
+					for (size_t i = streamId; i < update->rects.size(); i += VNCD_TIGHT_STREAMS) {
+						update->connection->encodeTightRect(update->encoder, (uint8_t)streamId, update->parts[i], update->rects[i], i == 0 ? update->tightReset : 0);
+					}
+				});
+			});
 		}
-		
-		message.append((const char*)pngData, pngLen);
+		return;
+	}
 
-		free(pngData); 
+	// Stateless encodings: split large rects into strips, one per worker, and
+	// send them as the rects of a single FramebufferUpdate
 
+	size_t numStrips = 1;
+	if ((size_t)w * (size_t)h >= VNCD_PARALLEL_MIN_PIXELS) {
+		numStrips = std::max((size_t)1, std::min(encoderPool->workerCount(), (size_t)h / VNCD_PARALLEL_MIN_STRIP));
+	}
 
-	} else if (useEncodingMode == VEM_ZRLE) {
+	if (encoding == (uint32_t)VEM_TIGHTPNG) {
+		numStrips = std::max(numStrips, ((size_t)w * (size_t)h + VNCD_TIGHT_PNG_MAX_PIXELS - 1) / VNCD_TIGHT_PNG_MAX_PIXELS);
+	}
 
-		std::string compressedStream;
-		std::string compressionBuffer;
+	uint16_t stripHeight = (uint16_t)((h + numStrips - 1) / numStrips);
+	numStrips = (h + stripHeight - 1) / stripHeight;
+
+	update->rects.reserve(numStrips);
+	for (size_t i = 0; i < numStrips; ++i) {
+		VncdRect strip;
+		strip.x = x;
+		strip.y = (uint16_t)(y + i * stripHeight);
+		strip.w = w;
+		strip.h = std::min(stripHeight, (uint16_t)(y + h - strip.y));
+		update->rects.push_back(strip);
+	}
 
-		for (size_t tile_y = y; tile_y < (size_t)y + (size_t)h; tile_y += 64) {
-			for (size_t tile_x = x; tile_x < (size_t)x + (size_t)w; tile_x += 64) {						
+	submitSharedParts(update);
+}
 
-				// start at tile_x,tile_y ;; go to MIN(tile_x + 64, x+w),MIN(tile_y+64, y+h)
+void VncdConnection::submitSharedParts(PendingUpdate* update) {
 
-				size_t tile_y_max = std::min(tile_y + 64, (size_t)y + (size_t)h);
-				size_t tile_x_max = std::min(tile_x + 64, (size_t)x + (size_t)w);
-				size_t tile_width = tile_x_max - tile_x;
-				size_t tile_height = tile_y_max - tile_y;
+	size_t count = update->rects.size();
 
-				// Read tile pixels
+	update->reserveParts(count);
+	update->remaining = count;
 
-				std::string tileUncompressed;
-				// tileUncompressed.append("\x00", 1); // added by next resize() call anyway
-				tileUncompressed.resize(tile_width * tile_height * (networkPixelFormat.bitDepth / 8) + 1, '\x00');
-				
-				networkPixelFormat.copyRectCpixel(
-					framebuffer, framebufferWidth, const_cast<char*>(tileUncompressed.c_str()) + 1,
-					tile_x, tile_y, tile_width, tile_height
-				);
-				
-				// Compress
+	// A rect that another update is already encoding is not encoded again.
+	// Its result arrives on that update's encoder thread, and counts the part
+	// as done; if that encode failed, the job is simply run again.
 
-				deflateString(&zrleStream, tileUncompressed, compressionBuffer);
-				compressedStream.append(compressionBuffer);
-			}
+	if (update->sharedFramebuffer) {
+		update->waiters.resize(count);
+
+		for (size_t i = 0; i < count; ++i) {
+			update->waiters[i].onStored = [update, i](VncdEncodeCache::Payload payload) {
+				if (!payload) {
+					update->connection->encoderPool->submit([update, i]() {
+						encodeSharedPart(update, i);
+					});
+					return;
+				}
+
+				update->parts[i].appendShared(payload);
+				update->connection->finishPart(update);
+			};
 		}
-		
-		// Add stream size + stream to buffer
+	}
 
-		uint32_t compressedData_network = htonl(compressedStream.size());
-		message.append((char*)&compressedData_network, sizeof(uint32_t));
-		message.append(compressedStream);
-		
+	for (size_t i = 0; i < count; ++i) {
+		encoderPool->submit([update, i]() {
+			encodeSharedPart(update, i);
+		});
+	}
+}
+
+void VncdConnection::encodeSharedPart(PendingUpdate* update, size_t index) {
+
+	// Like encodePart(), except that a part waiting for another update's
+	// encode is finished by its waiter
+
+	bool done = true;
+
+	try {
+		const VncdRect& r = update->rects[index];
+		VncdEncodeWaiter* waiter = update->waiters.empty() ? nullptr : &update->waiters[index];
+		done = update->connection->encodeSharedRect(update, update->parts[index], r.x, r.y, r.w, r.h, waiter);
+	} catch (...) {
+		update->failed = true;
 	}
 
-	tcpConnection.async_send(
-		asio::buffer(message.c_str(), message.length()),
-		[this](std::error_code ec, std::size_t nb) {
-			// do nothing
-		}
-	);
+	if (done) {
+		update->connection->finishPart(update);
+	}
 }
 
-void VncdConnection::notifyClient_bell() {
-	tcpConnection.async_send(
-		asio::buffer("\x02", 1),
-		[this](std::error_code ec, std::size_t nb) {
-			// do nothing
+VncdConnection::PendingUpdate::PendingUpdate(std::shared_ptr<VncdConnection> connection, VncdArena* arena, const VncdRectEncoder& encoder, uint32_t encoding) :
+	connection(std::move(connection)),
+	arena(arena),
+	message(this->connection->newMessage()),
+	encoder(encoder),
+	encoding(encoding),
+	sharedFramebuffer(nullptr),
+	framebufferVersion(0),
+	tightReset(0),
+	snapshotArea(),
+	speculative(false),
+	rects(VncdArenaAllocator<VncdRect>(arena)),
+	nextRect(0),
+	parts(VncdArenaAllocator<VncdBufferChain>(arena)),
+	waiters(VncdArenaAllocator<VncdEncodeWaiter>(arena)),
+	waiting(false),
+	remaining(0),
+	failed(false),
+	finished(false),
+	next(nullptr)
+{
+}
+
+void VncdConnection::PendingUpdate::reserveParts(size_t count) {
+	parts.reserve(count);
+	for (size_t i = 0; i < count; ++i) {
+		parts.emplace_back(connection->newMessage());
+	}
+}
+
+void VncdConnection::PendingUpdate::setSnapshot(std::vector<uint8_t> pixels, const VncdRect& area) {
+	snapshot = std::move(pixels);
+	snapshotArea = area;
+	encoder.setSource(snapshot.data(), area);
+}
+
+VncdConnection::PendingUpdate* VncdConnection::beginUpdate(uint32_t encoding, bool speculative) {
+
+	// Arenas are recycled, so once there are as many as the deepest pipeline
+	// needs, an update allocates nothing outside the memory pool
+
+	VncdArena* arena;
+
+	if (idleArenas.empty()) {
+		if (!memoryPool) {
+			memoryPool = std::make_shared<VncdMemoryPool>();
 		}
-	);
+		arenas.emplace_back(new VncdArena(memoryPool));
+		arena = arenas.back().get();
+	} else {
+		arena = idleArenas.back();
+		idleArenas.pop_back();
+	}
+
+	VncdRectEncoder encoder(clientFramebuffer(), clientFrameWidth(), networkPixelFormat, arena);
+	encoder.setCompressionLevel(compressionLevel());
+
+	PendingUpdate* update = arena->create<PendingUpdate>(shared_from_this(), arena, encoder, encoding);
+
+	if (encodeCache && !scaled()) {
+		update->sharedFramebuffer = getSharedFramebuffer();
+		if (update->sharedFramebuffer) {
+			update->framebufferVersion = update->sharedFramebuffer->currentVersion();
+		}
+	}
+
+	if (speculative) {
+		update->speculative = true;
+		return update;
+	}
+
+	// Kept in request order; finishUpdate() sends them in the same order
+	if (pendingTail) {
+		pendingTail->next = update;
+	} else {
+		pendingHead = update;
+	}
+	pendingTail = update;
+
+	return update;
 }
 
-void VncdConnection::notifyClient_sizeChanged() {
+std::vector<uint8_t> VncdConnection::takeSnapshot(const VncdRect& area) {
 
-	for (uint32_t allowed : supportedEncodings) {
-		if (allowed == -223) {
+	// Into the largest buffer a recent update needed, so a warmed-up
+	// connection copies without allocating
+
+	std::vector<uint8_t> pixels;
+	if (!idleSnapshots.empty()) {
+		pixels.swap(idleSnapshots.back());
+		idleSnapshots.pop_back();
+	}
 
-			// We can change the framebuffer size on the client
+	VncdTileHashes::snapshot(clientFramebuffer(), clientFrameWidth(), area, pixels);
+	return pixels;
+}
 
-			std::string message = buildFramebufferUpdateMessage(0, 0, getFrameWidth(), getFrameHeight(), -223);
+void VncdConnection::releaseUpdate(PendingUpdate* update) {
 
-			tcpConnection.async_send(
-				asio::buffer(message.c_str(), message.length()),
-				[this](std::error_code ec, std::size_t nb) {
-					// do nothing
-				}
-			);
-			return;
+	idleSnapshots.push_back(std::move(update->snapshot));
 
+	VncdArena* arena = update->arena;
+	update->~PendingUpdate();
+	arena->reset();
+	idleArenas.push_back(arena);
+}
+
+void VncdConnection::finishPart(PendingUpdate* update) {
+
+	// Called on an encoder thread. The one that completes the last part joins
+	// the parts and hands the update back to the strand.
+
+	if (--update->remaining != 0) {
+		return;
+	}
+
+	if (!update->parts.empty()) {
+		VncdRectEncoder::appendUpdateHeader(update->message, (uint16_t)update->parts.size());
+		for (VncdBufferChain& part : update->parts) {
+			update->message.append(std::move(part)); // moves the chunks, no copy
 		}
 	}
 
+	strand.post(vncdAllocHandler(updateHandlerMemory, [update]() {
+		update->connection->finishUpdate(update);
+	}));
+}
+
+void VncdConnection::postEncodeSlice() {
+
+	if (slicePosted) {
+		return;
+	}
+	slicePosted = true;
+
+	auto self = shared_from_this();
+
+	strand.post(vncdAllocHandler(sliceHandlerMemory, [this, self]() {
+		slicePosted = false;
+		encodeSlice();
+	}));
+}
+
+void VncdConnection::encodeSlice() {
+
+	// Inline updates finish in order, so the oldest unfinished one is at the
+	// front. Deflate streams see its rects before any of the next update's.
+
+	PendingUpdate* update = pendingHead;
+
+	if (!update || update->finished || update->waiting) {
+		return;
+	}
+
+	if (!isOpen()) {
+		update->nextRect = update->rects.size();
+	}
+
+	size_t pixels = 0;
+
+	while (update->nextRect < update->rects.size() && pixels < VNCD_INLINE_SLICE_PIXELS) {
+		size_t i = update->nextRect++;
+		const VncdRect& r = update->rects[i];
+
+		try {
+			if (update->encoding == VEM_TIGHT) {
+				encodeTightRect(update->encoder, i % VNCD_TIGHT_STREAMS, update->message, r, i == 0 ? update->tightReset : 0);
+
+			} else if (!encodeSharedRect(update, update->message, r.x, r.y, r.w, r.h, update->waiters.empty() ? nullptr : &update->waiters[0])) {
+				update->nextRect = i; // resumeSlice() appends it
+				update->waiting = true;
+				return;
+			}
+		} catch (...) {
+			update->failed = true;
+			update->nextRect = update->rects.size();
+		}
+
+		pixels += (size_t)r.w * (size_t)r.h;
+	}
+
+	if (update->nextRect == update->rects.size()) {
+		finishUpdate(update);
+	}
+
+	if (pendingHead) {
+		postEncodeSlice();
+	}
+}
+
+void VncdConnection::resumeSlice(PendingUpdate* update, VncdEncodeCache::Payload payload) {
+
+	update->waiting = false;
+
+	// Null if the other update failed to encode the rect; the slice then
+	// encodes it itself
+	if (payload) {
+		update->message.appendShared(payload);
+		++update->nextRect;
+	}
+
+	postEncodeSlice();
+}
+
+void VncdConnection::encodeTightRect(VncdRectEncoder& encoder, uint8_t streamId, VncdBufferChain& out, const VncdRect& r, uint8_t resetStreams) {
+
+	encoder.encodeTight(out, tightStreams[streamId].get(encoder.level()), streamId, r.x, r.y, r.w, r.h, resetStreams);
+}
+
+void VncdConnection::encodeRect(VncdRectEncoder& encoder, uint32_t encoding, VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	if (encoding == VEM_RAW) {
+		encoder.encodeRaw(out, x, y, w, h);
+		
+	} else if (encoding == VEM_ZLIB) {
+		encoder.encodeZlib(out, zlibStream.get(encoder.level()), x, y, w, h);
+
+	} else if (encoding == (uint32_t)VEM_TIGHTPNG) {
+		encoder.encodeTightPng(out, x, y, w, h);
+
+	} else if (encoding == VEM_ZRLE) {
+		encoder.encodeZrle(out, zrleStream.get(encoder.level()), x, y, w, h);
+
+	}
+}
+
+bool VncdConnection::encodeSharedRect(PendingUpdate* update, VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h, VncdEncodeWaiter* waiter) {
+
+	// Only stateless encodings produce the same bytes for every viewer
+
+	if (!update->sharedFramebuffer || (update->encoding != VEM_RAW && update->encoding != (uint32_t)VEM_TIGHTPNG)) {
+		encodeTile(update->encoder, update->encoding, out, x, y, w, h);
+		return true;
+	}
+
+	VncdEncodeKey key;
+	key.framebuffer = update->sharedFramebuffer->id();
+	key.version = update->framebufferVersion;
+	key.contentHash = update->encoder.hashRect(x, y, w, h); // viewers may copy mid-draw, between versions
+	key.pixelFormat = update->encoder.format();
+	key.encoding = update->encoding;
+	key.compressionLevel = update->encoding == VEM_RAW ? 0 : update->encoder.level();
+	key.x = x;
+	key.y = y;
+	key.w = w;
+	key.h = h;
+
+	VncdEncodeCache::Payload payload;
+	VncdEncodeLookup found = encodeCache->find(key, payload, waiter);
+
+	if (found == VEL_WAITING) {
+		return false;
+	}
+
+	if (found == VEL_MISS) {
+
+		// Our claim on the entry has to be released even if encoding throws,
+		// or the rect would never be cached and its waiters never called
+
+		try {
+			std::shared_ptr<VncdBufferChain> encoded = std::make_shared<VncdBufferChain>(newMessage());
+			encodeTile(update->encoder, update->encoding, *encoded, x, y, w, h);
+			payload = encoded;
+		} catch (...) {
+			encodeCache->store(key, nullptr);
+			throw;
+		}
+
+		encodeCache->store(key, payload);
+	}
+
+	out.appendShared(payload);
+	return true;
+}
+
+void VncdConnection::encodeTile(VncdRectEncoder& encoder, uint32_t encoding, VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	// Only worth it where compressing costs far more than hashing, and only for
+	// encodings whose output depends on nothing but the pixels. Raw is about as
+	// cheap as the hash; the deflate encodings carry their streams across rects.
+
+	if (!tileCache || encoding != (uint32_t)VEM_TIGHTPNG) {
+		encodeRect(encoder, encoding, out, x, y, w, h);
+		return;
+	}
+
+	// The same pixels anywhere on screen give the same PNG, which is always
+	// sent as 24-bit RGB whatever the client's pixel format
+
+	VncdEncodeKey key;
+	key.framebuffer = 0;
+	key.version = 0;
+	key.contentHash = encoder.hashRect(x, y, w, h);
+	key.encoding = encoding;
+	key.compressionLevel = encoder.level();
+	key.x = 0;
+	key.y = 0;
+	key.w = w;
+	key.h = h;
+
+	// Nothing waits for a tile; it is cheaper to compress it twice than to
+	// hold up the rect it is part of
+
+	VncdEncodeCache::Payload payload;
+
+	if (tileCache->find(key, payload) == VEL_MISS) {
+		try {
+			std::shared_ptr<VncdBufferChain> encoded = std::make_shared<VncdBufferChain>(newMessage());
+			encodeRect(encoder, encoding, *encoded, x, y, w, h);
+			payload = encoded;
+		} catch (...) {
+			tileCache->store(key, nullptr);
+			throw;
+		}
+
+		tileCache->store(key, payload);
+	}
+
+	// The cached rect may have been encoded at some other position. TightPNG
+	// rects go out as Tight.
+	VncdRectEncoder::appendRectHeader(out, x, y, w, h, VEM_TIGHT);
+	out.appendShared(payload, VNCD_RECT_HEADER_SIZE);
+}
+
+void VncdConnection::finishUpdate(PendingUpdate* update) {
+
+	if (update->speculative) {
+		finishSpeculation(update);
+		return;
+	}
+
+	update->finished = true;
+
+	// Updates may finish encoding out of order; send every finished update at
+	// the front of the queue. They may hold the last reference to this
+	// connection, so that is only dropped on the way out.
+
+	std::shared_ptr<VncdConnection> self;
+
+	while (pendingHead && pendingHead->finished) {
+		PendingUpdate* done = pendingHead;
+
+		pendingHead = done->next;
+		if (!pendingHead) {
+			pendingTail = nullptr;
+		}
+
+		if (done->failed) {
+			setCurrentStatusMessage("Closing connection after an update failed to encode");
+			closeConnection();
+
+		} else if (isOpen()) {
+			queueMessage(std::move(done->message));
+
+			if (fenceSupported) {
+				sendPing();
+			}
+		}
+
+		self = std::move(done->connection);
+		releaseUpdate(done);
+	}
+
+	if (endOfContinuousUpdatesPending && !pendingHead) {
+		sendEndOfContinuousUpdates();
+	}
+
+	if (sizeChangePending && !pendingHead) {
+		sendSizeChanged(sizeChangeReason);
+	}
+
+	if (broadcastHub && !broadcastGroup && !pendingHead) {
+		joinBroadcast();
+	}
+
+	sendDeferredUpdates();
+}
+
+bool VncdConnection::congested() const {
+
+	// Updates being encoded count as well, or a burst of damage would start
+	// an encode for each change before any of them reached the queue
+
+	size_t encoding = arenas.size() - idleArenas.size() - (speculation ? 1 : 0);
+
+	if (sendQueueLimit && (sendQueueBytes >= sendQueueLimit || encoding >= VNCD_UPDATES_IN_FLIGHT)) {
+		return true;
+	}
+
+	if (stripBacklog && (encoding > 0 || sendQueueBytes >= VNCD_STRIP_QUEUED_BYTES)) {
+		return true;
+	}
+
+	return throttleWaiting || sizeChangePending || congestion.congested();
+}
+
+void VncdConnection::sendDeferredUpdates() {
+
+	if (!isOpen() || congested()) {
+		return;
+	}
+
+	stripBacklog = false;
+
+	if (damagePullDeferred) {
+		damagePullDeferred = false;
+		sendFramebufferDamage();
+	}
+
+	mergeDeferred();
+
+	if (deferredDamage.empty() && deferredRefresh.empty()) {
+		return;
+	}
+
+	// A speculative update still being encoded will be ready sooner than a
+	// new one; finishSpeculation() calls back here
+	if (speculation && speculationValid) {
+		if (!speculation->finished || commitSpeculation()) {
+			return;
+		}
+	}
+
+	// Whatever can't be sent before the client is congested again goes back
+	// into the deferred regions
+
+	VncdRegion refresh, damage;
+	refresh.swap(deferredRefresh);
+	damage.swap(deferredDamage);
+	damage.subtract(refresh);
+
+	VncdRectCost cost = VncdRectEncoder::rectCost(useEncodingMode, networkPixelFormat);
+
+	damagedRects.clear();
+	refresh.cover(cost, damagedRects);
+	size_t refreshRects = damagedRects.size();
+	damage.cover(cost, damagedRects);
+
+	for (size_t i = 0; i < damagedRects.size(); ++i) {
+		const VncdRect& r = damagedRects[i];
+		sendRegionUpdate(r.x, r.y, r.w, r.h, i < refreshRects);
+	}
+}
+
+void VncdConnection::deferRect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool refresh) {
+
+	std::vector<VncdRect>& rects = refresh ? deferredRefreshRects : deferredDamageRects;
+
+	VncdRect r = { x, y, w, h };
+	rects.push_back(r);
+
+	// However long the client stays congested, the list stays short
+	if (rects.size() >= VNCD_DEFERRED_RECTS) {
+		mergeDeferred();
+	}
+}
+
+void VncdConnection::mergeDeferred() {
+
+	if (!deferredDamageRects.empty()) {
+		deferredDamage.unite(deferredDamageRects);
+		deferredDamageRects.clear();
+	}
+
+	if (!deferredRefreshRects.empty()) {
+		deferredRefresh.unite(deferredRefreshRects);
+		deferredRefreshRects.clear();
+	}
+}
+
+void VncdConnection::speculate() {
+
+	if (speculation || sizeChangePending || stripBacklog || !encoderPool || broadcastGroup || (deferredDamage.empty() && deferredDamageRects.empty()) || (useEncodingMode != VEM_RAW && useEncodingMode != (uint32_t)VEM_TIGHTPNG)) {
+		return;
+	}
+
+	uint16_t framebufferWidth = clientFrameWidth();
+	uint16_t framebufferHeight = clientFrameHeight();
+
+	mergeDeferred();
+
+	speculationRects.clear();
+	deferredDamage.rects(speculationRects);
+
+	for (VncdRect& r : speculationRects) {
+		VncdTileHashes::alignToTiles(framebufferWidth, framebufferHeight, r.x, r.y, r.w, r.h);
+	}
+
+	speculationRegion.clear();
+	speculationRegion.unite(speculationRects);
+
+	speculationRects.clear();
+	speculationRegion.cover(VncdRectEncoder::rectCost(useEncodingMode, networkPixelFormat), speculationRects);
+
+	PendingUpdate* update = beginUpdate(useEncodingMode, true);
+	update->setSnapshot(takeSnapshot(speculationRegion.bounds()), speculationRegion.bounds());
+
+	// TightPNG lengths have to fit in three bytes
+	for (const VncdRect& r : speculationRects) {
+		size_t rows = r.h;
+		if (useEncodingMode == (uint32_t)VEM_TIGHTPNG) {
+			rows = std::max((size_t)1, (size_t)VNCD_TIGHT_PNG_MAX_PIXELS / r.w);
+		}
+		for (size_t strip_y = r.y; strip_y < (size_t)r.y + r.h; strip_y += rows) {
+			VncdRect strip = { r.x, (uint16_t)strip_y, r.w, (uint16_t)std::min(rows, (size_t)r.y + r.h - strip_y) };
+			update->rects.push_back(strip);
+		}
+	}
+
+	speculation = update;
+	speculationValid = true;
+
+	submitSharedParts(update);
+}
+
+void VncdConnection::finishSpeculation(PendingUpdate* update) {
+
+	update->finished = true;
+
+	// Dropping it may release the last reference to this connection
+	std::shared_ptr<VncdConnection> self = std::move(update->connection);
+
+	if (update->failed) {
+		setCurrentStatusMessage("Closing connection after an update failed to encode");
+		closeConnection();
+	}
+
+	if (!isOpen() || !speculationValid) {
+		discardSpeculation();
+
+		if (isOpen() && congested()) {
+			speculate(); // from the latest damage
+		}
+		return;
+	}
+
+	sendDeferredUpdates();
+}
+
+void VncdConnection::invalidateSpeculation(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	if (!speculation || !speculationValid) {
+		return;
+	}
+
+	VncdRegion damage(x, y, w, h);
+	damage.intersect(speculationRegion);
+
+	if (!damage.empty()) {
+		dropSpeculation();
+	}
+}
+
+void VncdConnection::dropSpeculation() {
+
+	if (!speculation) {
+		return;
+	}
+
+	// Still encoding; finishSpeculation() throws it away
+	speculationValid = false;
+
+	if (speculation->finished) {
+		discardSpeculation();
+	}
+}
+
+void VncdConnection::discardSpeculation() {
+
+	PendingUpdate* update = speculation;
+	speculation = nullptr;
+	speculationValid = false;
+
+	releaseUpdate(update);
+}
+
+bool VncdConnection::commitSpeculation() {
+
+	if (!isOpen()) {
+		return false;
+	}
+
+	// The rects go out whole, including any tiles the filter would have
+	// dropped as unchanged. It is only run to record what the client now has,
+	// from the snapshot the rects were encoded from.
+
+	uint16_t framebufferWidth = clientFrameWidth();
+	uint16_t framebufferHeight = clientFrameHeight();
+
+	PendingUpdate* update = speculation;
+	speculation = nullptr;
+	speculationValid = false;
+
+	for (VncdRect r : update->rects) {
+		sentTiles.filter(update->snapshot.data(), update->snapshotArea, framebufferWidth, framebufferHeight, r.x, r.y, r.w, r.h, true);
+	}
+
+	mergeDeferred();
+	deferredDamage.subtract(speculationRegion);
+	deferredRefresh.subtract(speculationRegion);
+
+	// Joins the pending updates as the newest, so anything still being
+	// encoded goes out first
+	update->speculative = false;
+	update->connection = shared_from_this();
+
+	if (pendingTail) {
+		pendingTail->next = update;
+	} else {
+		pendingHead = update;
+	}
+	pendingTail = update;
+
+	lastUpdateTime = std::chrono::system_clock::now();
+	setCurrentStatusMessage("Sending speculatively encoded update");
+
+	finishUpdate(update);
+	return true;
+}
+
+void VncdConnection::sendFence(uint32_t flags, const std::string& payload) {
+
+	std::string message("\xF8\x00\x00\x00", 4); // ServerFence, padding
+	uint32_t flags_network = htonl(flags);
+	message.append((const char*)&flags_network, 4);
+	message.push_back((char)payload.size());
+	message.append(payload);
+
+	queueMessage(message);
+}
+
+void VncdConnection::sendPing() {
+
+	// The client answers once it has processed everything before the fence
+	sendFence(VFF_REQUEST | VFF_BLOCK_BEFORE, std::string());
+	congestion.sentPing();
+}
+
+void VncdConnection::handleFence(const std::string& message) {
+
+	uint32_t flags = ntohl(*(uint32_t*)(message.c_str() + 4));
+	std::string payload = message.substr(9);
+
+	if (payload.size() > VNCD_FENCE_MAX_PAYLOAD) {
+		setCurrentStatusMessage("Malformed fence.");
+		closeConnection();
+		return;
+	}
+
+	if (flags & VFF_REQUEST) {
+		// Messages are handled one at a time and in order, so whatever the
+		// client asked to be synchronised already is
+		sendFence(flags & (VFF_BLOCK_BEFORE | VFF_BLOCK_AFTER | VFF_SYNC_NEXT), payload);
+		return;
+	}
+
+	congestion.gotPong();
+	sendDeferredUpdates();
+}
+
+void VncdConnection::handleEnableContinuousUpdates(const std::string& message) {
+
+	if (!continuousUpdatesSupported) {
+		setCurrentStatusMessage("Unexpected EnableContinuousUpdates.");
+		closeConnection();
+		return;
+	}
+
+	if (message[1] != '\x00') {
+		setCurrentStatusMessage("Client enabled continuous updates");
+		continuousUpdates = true;
+		continuousUpdatesArea.x = (unsigned char)message[3] + ((unsigned char)message[2] * 256);
+		continuousUpdatesArea.y = (unsigned char)message[5] + ((unsigned char)message[4] * 256);
+		continuousUpdatesArea.w = (unsigned char)message[7] + ((unsigned char)message[6] * 256);
+		continuousUpdatesArea.h = (unsigned char)message[9] + ((unsigned char)message[8] * 256);
+		return;
+	}
+
+	setCurrentStatusMessage("Client disabled continuous updates");
+	continuousUpdates = false;
+	sendEndOfContinuousUpdates();
+}
+
+void VncdConnection::sendEndOfContinuousUpdates() {
+
+	// Updates still being encoded were pushed under the old mode, so the
+	// client must see them first
+	if (pendingHead) {
+		endOfContinuousUpdatesPending = true;
+		return;
+	}
+
+	endOfContinuousUpdatesPending = false;
+	queueMessage(std::string("\x96", 1));
+}
+
+int VncdConnection::compressionLevel() const {
+
+	if (throttleStreak >= VNCD_THROTTLE_DEGRADE_AFTER) {
+		return MZ_BEST_COMPRESSION;
+	}
+
+	size_t bandwidth = congestion.bandwidth();
+
+	if (!bandwidth) {
+		return VNCD_ZLIB_COMPRESSION;
+	} else if (bandwidth < VNCD_LOW_BANDWIDTH) {
+		return MZ_BEST_COMPRESSION;
+	} else if (bandwidth > VNCD_HIGH_BANDWIDTH) {
+		return MZ_BEST_SPEED;
+	}
+	return VNCD_ZLIB_COMPRESSION;
+}
+
+void VncdConnection::joinBroadcast() {
+
+	VncdSharedFramebuffer* framebuffer = getSharedFramebuffer();
+
+	if (!framebuffer || scaled() || !isOpen()) {
+		return;
+	}
+
+	// ZRLE and zlib have no way to reset the client's inflater, so the client
+	// must already have had the zlib header from our own stream
+
+	if ((useEncodingMode == VEM_ZRLE && !zrleStream.begun()) || (useEncodingMode == VEM_ZLIB && !zlibStream.begun())) {
+		return;
+	}
+
+	// The group's compressors take over from ours
+
+	releaseStream(zlibStream, deflateSequence);
+	releaseStream(zrleStream, deflateSequence);
+
+	for (size_t i = 0; i < VNCD_TIGHT_STREAMS; ++i) {
+		releaseStream(tightStreams[i], tightSequences[i]);
+	}
+
+	// Once in the group our own updates stop, so whatever was held back while
+	// we were congested goes to the group instead
+
+	mergeDeferred();
+
+	VncdRegion backlog;
+	backlog.swap(deferredDamage);
+	backlog.unite(deferredRefresh);
+	deferredRefresh.clear();
+	dropSpeculation();
+
+	broadcastGroup = broadcastHub->join(shared_from_this(), framebuffer, networkPixelFormat, useEncodingMode, 0, false, backlog);
+}
+
+void VncdConnection::leaveBroadcast() {
+
+	if (!broadcastGroup) {
+		return;
+	}
+
+	broadcastHub->leave(this, broadcastGroup);
+	broadcastGroup.reset();
+
+	sentTiles.clear(); // the group's updates weren't recorded
+
+	if (useEncodingMode == VEM_TIGHT) {
+		tightResetPending = true;
+	}
+}
+
+void VncdConnection::deliverBroadcast(VncdBroadcastGroup* group, VncdEncodeCache::Payload update) {
+
+	// Anything the group sent after we left is dropped; our own updates have
+	// taken over, and they don't depend on it
+
+	if (broadcastGroup.get() != group || !isOpen()) {
+		return;
+	}
+
+	VncdBufferChain message = newMessage();
+	message.appendShared(update);
+	queueMessage(std::move(message));
+}
+
+void VncdConnection::demoteBroadcast(VncdBroadcastGroup* group) {
+
+	if (broadcastGroup.get() != group || !isOpen()) {
+		return;
+	}
+
+	setCurrentStatusMessage("Falling behind, moving to a slower broadcast tier");
+
+	// The old group has already let us go; this drops it if we were the last
+
+	std::shared_ptr<VncdBroadcastGroup> slower = broadcastHub->join(shared_from_this(), group->framebuffer, networkPixelFormat, useEncodingMode, group->tier + 1, true);
+
+	broadcastHub->leave(this, broadcastGroup);
+	broadcastGroup = slower;
+}
+
+
+void VncdConnection::releaseStream(VncdDeflateStream& stream, std::shared_ptr<VncdEncoderSequence>& sequence) {
+
+	if (!encoderPool || !sequence) {
+		stream.release(); // nothing else touches it
+		return;
+	}
+
+	// Behind any rect still being compressed on it
+
+	auto self = shared_from_this();
+	VncdDeflateStream* target = &stream;
+
+	sequence->submit([self, target]() {
+		target->release();
+	});
+}
+
+void VncdConnection::releaseUnusedEncoderState() {
+
+	if (useEncodingMode != VEM_ZLIB) {
+		releaseStream(zlibStream, deflateSequence);
+	}
+
+	if (useEncodingMode != VEM_ZRLE) {
+		releaseStream(zrleStream, deflateSequence);
+	}
+
+	if (useEncodingMode != VEM_TIGHT) {
+		for (size_t i = 0; i < VNCD_TIGHT_STREAMS; ++i) {
+			releaseStream(tightStreams[i], tightSequences[i]);
+		}
+	}
+}
+
+void VncdConnection::restartTightStreams() {
+
+	for (size_t i = 0; i < VNCD_TIGHT_STREAMS; ++i) {
+
+		if (!encoderPool || !tightSequences[i]) {
+			tightStreams[i].restart(true);
+			continue;
+		}
+
+		auto self = shared_from_this();
+		VncdDeflateStream* target = &tightStreams[i];
+
+		tightSequences[i]->submit([self, target]() {
+			target->restart(true);
+		});
+	}
+}
+
+void VncdConnection::armTrimTimer(std::chrono::milliseconds delay) {
+	auto self = shared_from_this();
+
+	trimTimerArmed = true;
+	timer.expires_from_now(delay);
+
+	timer.async_wait(strand.wrap(vncdAllocHandler(timerHandlerMemory, [this, self](std::error_code ec) {
+
+		trimTimerArmed = false;
+
+		if (ec || !isOpen()) {
+			return;
+		}
+
+		auto idle = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now() - lastUpdateTime);
+
+		if (idle >= idleTrimPeriod) {
+			trimIdleState();
+		} else {
+			armTrimTimer(idleTrimPeriod - idle);
+		}
+	})));
+}
+
+void VncdConnection::trimIdleState() {
+
+	setCurrentStatusMessage("Idle, releasing encoder state");
+
+	releaseStream(zlibStream, deflateSequence);
+	releaseStream(zrleStream, deflateSequence);
+
+	for (size_t i = 0; i < VNCD_TIGHT_STREAMS; ++i) {
+		releaseStream(tightStreams[i], tightSequences[i]);
+	}
+
+	if (speculation && speculation->finished) {
+		discardSpeculation();
+	}
+
+	if (!pendingHead && !speculation) {
+		idleArenas.clear(); // every arena is idle
+		arenas.clear();
+	}
+
+	idleSnapshots.clear();
+	idleSnapshots.shrink_to_fit();
+
+	if (memoryPool) {
+		memoryPool->trim();
+	}
+}
+
+VncdMemoryReport VncdConnection::memoryReport() {
+
+	VncdMemoryReport report;
+
+	report.connection = sizeof(*this);
+
+	report.encoderState = zlibStream.memoryUsage() + zrleStream.memoryUsage();
+	for (VncdDeflateStream& stream : tightStreams) {
+		report.encoderState += stream.memoryUsage();
+	}
+
+	report.updateArenas = 0;
+	for (std::unique_ptr<VncdArena>& arena : arenas) {
+		report.updateArenas += arena->reservedBytes();
+	}
+	for (std::vector<uint8_t>& pixels : idleSnapshots) {
+		report.updateArenas += pixels.capacity();
+	}
+	for (PendingUpdate* update = pendingHead; update; update = update->next) {
+		report.updateArenas += update->snapshot.capacity();
+	}
+	if (speculation) {
+		report.updateArenas += speculation->snapshot.capacity();
+	}
+
+	report.sendQueue = sendQueueBytes;
+	report.receiveBuffer = sb.size() + asio::buffer_size(sb_mutable) + inbox.capacity();
+	report.tileHashes = sentTiles.memoryUsage();
+	report.scaledFramebuffer = scaler.memoryUsage();
+	report.pooledMemory = memoryPool ? memoryPool->pooledBytes() : 0;
+
+	return report;
+}
+
+VncdBandwidthReport VncdConnection::bandwidthReport() {
+
+	VncdBandwidthReport report;
+
+	report.bytesSent = bytesSent;
+
+	auto elapsed = std::chrono::steady_clock::now() - rateWindowStart;
+	if (elapsed >= std::chrono::seconds(1)) {
+		report.bytesPerSecond = (size_t)(rateWindowBytes / std::chrono::duration<double>(elapsed).count());
+	} else {
+		report.bytesPerSecond = recentRate;
+	}
+
+	report.limit = bandwidthLimit.rate();
+	report.throttledTime = std::chrono::duration_cast<std::chrono::milliseconds>(throttledTime);
+	report.estimatedBandwidth = congestion.bandwidth();
+	report.roundTripTime = congestion.roundTripTime();
+	report.compressionLevel = compressionLevel();
+
+	return report;
+}
+
+void VncdConnection::notifyClient_bell() {
+	auto self = shared_from_this();
+
+	strand.dispatch([this, self]() {
+		queueMessage(std::string("\x02", 1));
+	});
+}
+
+void VncdConnection::notifyClient_cursorChanged(std::shared_ptr<const VncdCursor> cursor) {
+	auto self = shared_from_this();
+
+	strand.dispatch([this, self, cursor]() {
+		this->cursor = cursor;
+		sendCursorShape();
+	});
+}
+
+void VncdConnection::notifyClient_cursorMoved(uint16_t x, uint16_t y) {
+	auto self = shared_from_this();
+
+	strand.dispatch([this, self, x, y]() {
+
+		if (currentState != VCS_READY || !cursorPosSupported) {
+			return;
+		}
+
+		uint16_t clientX = std::min<uint16_t>(x / scaler.divisor(), clientFrameWidth() - 1);
+		uint16_t clientY = std::min<uint16_t>(y / scaler.divisor(), clientFrameHeight() - 1);
+
+		VncdBufferChain message = newMessage();
+		VncdRectEncoder::appendUpdateHeader(message, 1);
+		VncdRectEncoder::appendRectHeader(message, clientX, clientY, 0, 0, VEM_CURSOR_POS);
+
+		queueMessage(std::move(message));
+	});
+}
+
+bool VncdConnection::clientDrawsCursor() const {
+	return cursorShapeSupported;
+}
+
+int32_t VncdConnection::cursorEncoding() const {
+	for (uint32_t allowed : supportedEncodings) {
+		if (allowed == (uint32_t)VEM_CURSOR || allowed == (uint32_t)VEM_XCURSOR) {
+			return (int32_t)allowed;
+		}
+	}
+	return 0;
+}
+
+void VncdConnection::sendCursorShape() {
+
+	int32_t encoding = cursorEncoding();
+	if (currentState != VCS_READY || !encoding || !cursor) {
+		return;
+	}
+
+	if (encoding == sentCursorEncoding && (sentCursor == cursor || sentCursor->sameShape(*cursor))) {
+		return;
+	}
+
+	VncdBufferChain message = newMessage();
+	VncdRectEncoder::appendUpdateHeader(message, 1);
+	if (encoding == VEM_CURSOR) {
+		cursor->encode(message, networkPixelFormat);
+	} else {
+		cursor->encodeX(message);
+	}
+
+	queueMessage(std::move(message));
+
+	sentCursor = cursor;
+	sentCursorEncoding = encoding;
+}
+
+void VncdConnection::notifyClient_sizeChanged() {
+	auto self = shared_from_this();
+
+	strand.dispatch([this, self]() {
+		sendSizeChanged();
+	});
+}
+
+uint8_t* VncdConnection::clientFramebuffer() {
+	return scaled() ? scaler.data() : getFramebufferRGBX32();
+}
+
+uint16_t VncdConnection::clientFrameWidth() {
+	return scaled() ? scaler.width() : getFrameWidth();
+}
+
+uint16_t VncdConnection::clientFrameHeight() {
+	return scaled() ? scaler.height() : getFrameHeight();
+}
+
+void VncdConnection::updateScale() {
+	scaler.setSource(getFrameWidth(), getFrameHeight(), getScaleDivisor());
+	scaler.resample(getFramebufferRGBX32(), 0, 0, scaler.width(), scaler.height());
+}
+
+bool VncdConnection::scaleDamage(uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h) {
+
+	if (!scaled()) {
+		return true;
+	}
+
+	// The copy would be read past its end if the source had changed size
+	// without notifyClient_sizeChanged()
+	if (getFrameWidth() != scaler.sourceWidth() || getFrameHeight() != scaler.sourceHeight()) {
+		updateScale();
+	}
+
+	if (!scaler.mapRect(x, y, w, h)) {
+		return false;
+	}
+
+	scaler.resample(getFramebufferRGBX32(), x, y, w, h);
+	return true;
+}
+
+void VncdConnection::sendSizeChanged(VncdDesktopSizeReason reason) {
+
+	dropSpeculation();
+
+	// A reply to the client's own request takes precedence
+	if (sizeChangePending && sizeChangeReason == VDR_CLIENT) {
+		reason = VDR_CLIENT;
+	}
+
+	if (pendingHead) {
+		sizeChangePending = true;
+		sizeChangeReason = reason;
+		return;
+	}
+
+	sizeChangePending = false;
+	sizeChangeReason = VDR_SERVER;
+
+	// Everything sized to the old framebuffer starts over; the client's own
+	// copy is reallocated and is repainted by its next full request
+
+	leaveBroadcast();
+	updateScale();
+	sentTiles.clear();
+
+	mergeDeferred();
+
+	VncdRegion bounds(0, 0, clientFrameWidth(), clientFrameHeight());
+	deferredDamage.intersect(bounds);
+	deferredRefresh.intersect(bounds);
+
+	if (desktopSizeSupported || extendedDesktopSizeSupported) {
+		queueDesktopSize(reason, VRS_OK);
+	}
+
+	sendDeferredUpdates();
+}
+
+void VncdConnection::queueDesktopSize(VncdDesktopSizeReason reason, VncdResizeStatus status) {
+
+	VncdBufferChain message = newMessage();
+	VncdRectEncoder::appendUpdateHeader(message, 1);
+
+	if (!extendedDesktopSizeSupported) {
+		VncdRectEncoder::appendRectHeader(message, 0, 0, clientFrameWidth(), clientFrameHeight(), VEM_DESKTOP_SIZE);
+		queueMessage(std::move(message));
+		return;
+	}
+
+	std::vector<VncdScreen> screens = getScreenLayout();
+
+	size_t kept = 0;
+	for (VncdScreen screen : screens) {
+		if (!scaled() || scaler.mapRect(screen.area.x, screen.area.y, screen.area.w, screen.area.h)) {
+			screens[kept++] = screen;
+		}
+	}
+	screens.resize(std::min(kept, (size_t)255));
+
+	if (screens.empty()) {
+		VncdScreen whole = { 0, { 0, 0, clientFrameWidth(), clientFrameHeight() }, 0 };
+		screens.push_back(whole);
+	}
+
+	// The rect's position carries the reason and status
+	VncdRectEncoder::appendRectHeader(message, reason, status, clientFrameWidth(), clientFrameHeight(), VEM_EXTENDED_DESKTOP_SIZE);
+
+	uint8_t count[4] = { (uint8_t)screens.size(), 0, 0, 0 };
+	message.append(count, sizeof(count));
+
+	for (const VncdScreen& screen : screens) {
+		uint32_t id = htonl(screen.id), flags = htonl(screen.flags);
+		uint16_t area[4] = { htons(screen.area.x), htons(screen.area.y), htons(screen.area.w), htons(screen.area.h) };
+
+		message.append(&id, sizeof(id));
+		message.append(area, sizeof(area));
+		message.append(&flags, sizeof(flags));
+	}
+
+	queueMessage(std::move(message));
+}
+
+void VncdConnection::handleSetDesktopSize(const std::string& message) {
+
+	setCurrentStatusMessage("Client requested desktop size");
+
+	if (!extendedDesktopSizeSupported) {
+		return;
+	}
+
+	uint16_t width = (unsigned char)message[3] + ((unsigned char)message[2] * 256);
+	uint16_t height = (unsigned char)message[5] + ((unsigned char)message[4] * 256);
+	size_t count = (unsigned char)message[6];
+
+	std::vector<VncdScreen> screens(count);
+	bool valid = width > 0 && height > 0 && count > 0;
+
+	for (size_t i = 0; i < count; ++i) {
+		const char* p = message.c_str() + 8 + i * 16;
+		VncdScreen& screen = screens[i];
+
+		screen.id = ntohl(*(uint32_t*)(p));
+		screen.area.x = ntohs(*(uint16_t*)(p + 4));
+		screen.area.y = ntohs(*(uint16_t*)(p + 6));
+		screen.area.w = ntohs(*(uint16_t*)(p + 8));
+		screen.area.h = ntohs(*(uint16_t*)(p + 10));
+		screen.flags = ntohl(*(uint32_t*)(p + 12));
+
+		if (screen.area.w == 0 || screen.area.h == 0 || screen.area.x + screen.area.w > width || screen.area.y + screen.area.h > height) {
+			valid = false;
+		}
+	}
+
+	// The request is in the client's coordinates, which a scaled connection
+	// can't map back to a framebuffer size
+	VncdResizeStatus status = !valid ? VRS_INVALID_LAYOUT : scaled() ? VRS_PROHIBITED : desktopResizeRequested(width, height, screens);
+
+	if (status == VRS_OK) {
+		sendSizeChanged(VDR_CLIENT);
+	} else {
+		queueDesktopSize(VDR_CLIENT, status);
+	}
+}
+
+std::vector<VncdScreen> VncdConnection::getScreenLayout() {
+	VncdScreen whole = { 0, { 0, 0, getFrameWidth(), getFrameHeight() }, 0 };
+	return std::vector<VncdScreen>(1, whole);
 }
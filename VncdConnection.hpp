@@ -22,11 +22,28 @@
 #include <cstdint>
 #include <chrono>
 #include <vector>
+#include <atomic>
 #include "asio_wrapper.h"
 #include "asio/asio/detail/noncopyable.hpp"
 #include "miniz_wrapper.h"
 #include "RFBPixelFormat.hpp"
 #include "VncdTimer.hpp"
+#include "VncdEncoderPool.hpp"
+#include "VncdRectEncoder.hpp"
+#include "VncdBufferChain.hpp"
+#include "VncdMemoryPool.hpp"
+#include "VncdArena.hpp"
+#include "VncdHandlerMemory.hpp"
+#include "VncdDeflateStream.hpp"
+#include "VncdConnectionRegistry.hpp"
+#include "VncdEncodeCache.hpp"
+#include "VncdBroadcast.hpp"
+#include "VncdTileHashes.hpp"
+#include "VncdRegion.hpp"
+#include "VncdCongestion.hpp"
+#include "VncdTokenBucket.hpp"
+#include "VncdScaler.hpp"
+#include "VncdCursor.hpp"
 
 enum VncdConnectionState {
 	VCS_INVALID = 0,
@@ -49,7 +66,22 @@ enum VncdEncodingMode {
 	VEM_ZLIB = 6,
 	VEM_TIGHT = 7,
 	VEM_ZRLE = 16,
-	VEM_TIGHTPNG = -260
+	VEM_TIGHTPNG = -260,
+
+	VEM_DESKTOP_SIZE = -223, // pseudo-encodings
+	VEM_CURSOR_POS = -232,
+	VEM_CURSOR = -239,
+	VEM_XCURSOR = -240,
+	VEM_EXTENDED_DESKTOP_SIZE = -308,
+	VEM_FENCE = -312,
+	VEM_CONTINUOUS_UPDATES = -313
+};
+
+enum VncdFenceFlags {
+	VFF_BLOCK_BEFORE	= 1 << 0,
+	VFF_BLOCK_AFTER		= 1 << 1,
+	VFF_SYNC_NEXT		= 1 << 2,
+	VFF_REQUEST			= 1u << 31
 };
 
 enum VncdMouseButtonMask {
@@ -60,7 +92,60 @@ enum VncdMouseButtonMask {
 	VMBM_WHEELDOWN	= 1 << 4
 };
 
-class VncdConnection : public asio::noncopyable {
+// Approximate memory held by one connection, in bytes
+struct VncdMemoryReport {
+	size_t connection;		// the connection object itself
+	size_t encoderState;	// deflate compressors
+	size_t updateArenas;	// scratch memory kept for the next update
+	size_t sendQueue;		// messages waiting to be written
+	size_t receiveBuffer;	// including any partial message
+	size_t tileHashes;		// what the client was last sent
+	size_t scaledFramebuffer;
+	size_t pooledMemory;	// freed blocks kept for reuse
+
+	size_t total() const {
+		return connection + encoderState + updateArenas + sendQueue + receiveBuffer + tileHashes + scaledFramebuffer + pooledMemory;
+	}
+};
+
+// Traffic of one connection
+struct VncdBandwidthReport {
+	uint64_t bytesSent;						// since the connection opened
+	size_t bytesPerSecond;					// over the last second or so
+	size_t limit;							// the connection's own quota; zero if none
+	std::chrono::milliseconds throttledTime;	// spent waiting for quota, in total
+	size_t estimatedBandwidth;				// measured with fences; zero if unknown
+	std::chrono::milliseconds roundTripTime;
+	int compressionLevel;					// for the next update
+};
+
+// One monitor of the framebuffer, as laid out by ExtendedDesktopSize
+struct VncdScreen {
+	uint32_t id;
+	VncdRect area;
+	uint32_t flags;
+};
+
+// The answer to a client's SetDesktopSize request
+enum VncdResizeStatus {
+	VRS_OK = 0,
+	VRS_PROHIBITED = 1,
+	VRS_OUT_OF_RESOURCES = 2,
+	VRS_INVALID_LAYOUT = 3
+};
+
+// Why an ExtendedDesktopSize rect was sent
+enum VncdDesktopSizeReason {
+	VDR_SERVER = 0,
+	VDR_CLIENT = 1, // this client asked for it
+	VDR_OTHER_CLIENT = 2
+};
+
+class VncdConnection : public asio::noncopyable, public std::enable_shared_from_this<VncdConnection> {
+
+	template <typename ConnectionAcceptor> friend class Vncd;
+	friend class VncdConnectionRegistry;
+	friend class VncdBroadcastGroup;
 
 /* IMPLEMENTATION SHARED FOR ALL CHILD CLASSES */
 
@@ -74,21 +159,287 @@ public:
 
 	void notifyClient_regionUpdated(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
 
+	// For a VncdSharedFramebuffer whose changes are reported through damage():
+	// sends whatever changed since this connection's last update. Calls made
+	// before that runs are merged into it.
+	void notifyClient_framebufferDamaged();
+
 	void notifyClient_bell();
 
+	// The pointer shape, for clients that draw the pointer themselves. It is
+	// sent only when it differs from what the client already has, so the same
+	// cursor may be passed to every connection whenever it might have changed.
+	void notifyClient_cursorChanged(std::shared_ptr<const VncdCursor> cursor);
+
+	// The application moved the pointer itself; sent to clients that support
+	// the CursorPos pseudo-encoding
+	void notifyClient_cursorMoved(uint16_t x, uint16_t y);
+
+	// Once the client draws the pointer, the application should leave it out
+	// of the framebuffer, so moving it doesn't cause any updates
+	bool clientDrawsCursor() const;
+
+	bool isOpen() const;
+
+	// Blocks this connection's memory pool has had to take from the heap. Stops
+	// growing once updates reach a steady state.
+	size_t heapAllocations() const;
+
+	// Call on the connection's strand, e.g. from one of its callbacks
+	VncdMemoryReport memoryReport();
+
+	VncdBandwidthReport bandwidthReport(); // likewise
+
 	asio::ip::tcp::socket tcpConnection;
 
 	VncdTimer timer;
+
+	// All handlers for this connection run through the strand, so the io_service
+	// may be run from several threads without locking the connection state
+	asio::io_service::strand strand;
 	
 protected:
 
+	// Linked through the memory pool rather than a std::deque, which allocates
+	// and frees blocks as the queue moves
+	struct QueuedMessage {
+		QueuedMessage(VncdBufferChain data, std::function<void()> onSent) : data(std::move(data)), onSent(std::move(onSent)), next(nullptr) {}
+
+		VncdBufferChain data;
+		std::function<void()> onSent;
+		QueuedMessage* next;
+	};
+
+	QueuedMessage* sendQueueHead;
+
+	QueuedMessage* sendQueueTail;
+
+	std::atomic<size_t> sendQueueBytes; // read by broadcast groups to spot slow viewers
+
+	void popQueuedMessage();
+
+	// Recycled memory for asio's operations: the read loop and the send queue
+	// each have one outstanding at a time, as do (usually) region notifications
+	// from the application and finished updates coming back from the encoders
+	VncdHandlerMemory readHandlerMemory;
+
+	VncdHandlerMemory writeHandlerMemory;
+
+	VncdHandlerMemory notifyHandlerMemory;
+
+	VncdHandlerMemory damageHandlerMemory;
+
+	VncdHandlerMemory updateHandlerMemory;
+
+	VncdHandlerMemory timerHandlerMemory;
+
+	VncdHandlerMemory sliceHandlerMemory;
+
+	// Gather list for the write in progress; kept so its capacity is reused
+	std::vector<asio::const_buffer> sendBuffers;
+
+	std::atomic<bool> connectionOpen;
+
+	// Send buffers and arenas come from here. Every connection has its own,
+	// created on first use, so connections don't contend for one lock.
+	std::shared_ptr<VncdMemoryPool> memoryPool;
+
+	// Set while the server's registry holds this connection; closing removes it
+	VncdConnectionRegistry* registry;
+
+	size_t registrySlot;
+
+	VncdBufferChain newMessage();
+
+	void queueMessage(std::string message, std::function<void()> onSent = nullptr);
+
+	void queueMessage(VncdBufferChain message, std::function<void()> onSent = nullptr);
+
+	void sendNextQueuedMessage();
+
+	void closeConnection();
+
+	// refresh is set when the client asked for the rect rather than it having changed
+	void sendRegionUpdate(uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool refresh = false);
+
+	// One FramebufferUpdate, from the request until it is queued for sending.
+	// It lives in its own arena, along with all of its scratch state; the arena
+	// is reset and reused once the update has been queued.
+	struct PendingUpdate {
+		PendingUpdate(std::shared_ptr<VncdConnection> connection, VncdArena* arena, const VncdRectEncoder& encoder, uint32_t encoding);
+
+		void reserveParts(size_t count);
+
+		// The encoder reads the pixels from here from now on
+		void setSnapshot(std::vector<uint8_t> pixels, const VncdRect& area);
+
+		std::shared_ptr<VncdConnection> connection; // alive while encoder jobs are out
+		VncdArena* arena;
+		VncdBufferChain message;
+		VncdRectEncoder encoder;
+		uint32_t encoding;
+		const VncdSharedFramebuffer* sharedFramebuffer; // with the version below, keys the encode cache
+		uint64_t framebufferVersion;
+		uint8_t tightReset; // stream reset bits for the first Tight rect
+		std::vector<uint8_t> snapshot; // the pixels its tile hashes were taken from
+		VncdRect snapshotArea;
+		bool speculative; // not in the pending list until committed
+		VncdRectList rects;
+		size_t nextRect; // when encoded inline, a slice at a time
+		std::vector<VncdBufferChain, VncdArenaAllocator<VncdBufferChain>> parts; // one per rect when encoded in parallel
+		std::vector<VncdEncodeWaiter, VncdArenaAllocator<VncdEncodeWaiter>> waiters; // for rects another update is encoding
+		bool waiting; // inline, for the next rect
+		std::atomic<size_t> remaining;
+		std::atomic<bool> failed; // encoding threw; the connection closes when it is back
+		bool finished;
+		PendingUpdate* next;
+	};
+
+	// Updates in request order; they may finish encoding out of order
+	PendingUpdate* pendingHead;
+
+	PendingUpdate* pendingTail;
+
+	std::vector<std::unique_ptr<VncdArena>> arenas;
+
+	std::vector<VncdArena*> idleArenas;
+
+	// Snapshot buffers of finished updates, reused like their arenas
+	std::vector<std::vector<uint8_t>> idleSnapshots;
+
+	PendingUpdate* beginUpdate(uint32_t encoding, bool speculative = false);
+
+	std::vector<uint8_t> takeSnapshot(const VncdRect& area);
+
+	// Destroys a sent or discarded update and keeps its memory for the next
+	void releaseUpdate(PendingUpdate* update);
+
+	void finishPart(PendingUpdate* update);
+
+	// Runs one part of an update on an encoder thread and counts it as done.
+	// Whatever it throws, e.g. bad_alloc from a bounded pool, fails the update
+	// rather than reaching the pool.
+	template <typename Encode>
+	static void encodePart(PendingUpdate* update, Encode encode) {
+		try {
+			encode();
+		} catch (...) {
+			update->failed = true;
+		}
+		update->connection->finishPart(update);
+	}
+
+	void finishUpdate(PendingUpdate* update);
+
+	void encodeRect(VncdRectEncoder& encoder, uint32_t encoding, VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	void encodeTightRect(VncdRectEncoder& encoder, uint8_t streamId, VncdBufferChain& out, const VncdRect& r, uint8_t resetStreams = 0);
+
+	// encodeRect() through the encode cache, when the rect can be shared.
+	// Returns false if another update is encoding the same rect; the waiter
+	// then gets its result.
+	bool encodeSharedRect(PendingUpdate* update, VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h, VncdEncodeWaiter* waiter);
+
+	// Encodes every rect of a stateless update on the pool, one job each
+	void submitSharedParts(PendingUpdate* update);
+
+	static void encodeSharedPart(PendingUpdate* update, size_t index);
+
+	void resumeSlice(PendingUpdate* update, VncdEncodeCache::Payload payload);
+
+	// encodeRect() through the tile cache, when the same pixels were encoded before
+	void encodeTile(VncdRectEncoder& encoder, uint32_t encoding, VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	// Set by Vncd. Without a pool, updates are encoded inline on the strand,
+	// a slice at a time: each slice is posted behind whatever the io_service
+	// already has ready, so input from this and other clients isn't held up
+	// by a large update.
+	VncdEncoderPool* encoderPool;
+
+	bool slicePosted;
+
+	void postEncodeSlice();
+
+	void encodeSlice();
+
+	// Set by Vncd; shared by every connection of the server
+	VncdEncodeCache* encodeCache;
+
+	VncdEncodeCache* tileCache;
+
+	// Set by Vncd in broadcast mode. Once a connection with a shared framebuffer
+	// has sent its first update, its updates come from a group instead.
+	VncdBroadcastHub* broadcastHub;
+
+	std::shared_ptr<VncdBroadcastGroup> broadcastGroup;
+
+	void joinBroadcast();
+
+	void leaveBroadcast();
+
+	void deliverBroadcast(VncdBroadcastGroup* group, VncdEncodeCache::Payload update);
+
+	void demoteBroadcast(VncdBroadcastGroup* group);
+
+	// zlibStream and zrleStream are only advanced from jobs on this sequence
+	std::shared_ptr<VncdEncoderSequence> deflateSequence;
+
+	// tightStreams[i] is only advanced from jobs on tightSequences[i]
+	std::shared_ptr<VncdEncoderSequence> tightSequences[VNCD_TIGHT_STREAMS];
+
+	// DesktopSize and ExtendedDesktopSize, as listed in the last SetEncodings.
+	// A size change waits for the updates already being encoded at the old
+	// size to go out, and holds back new ones until the client has been told.
+	bool desktopSizeSupported;
+
+	bool extendedDesktopSizeSupported;
+
+	bool sizeChangePending;
+
+	VncdDesktopSizeReason sizeChangeReason;
+
+	void sendSizeChanged(VncdDesktopSizeReason reason = VDR_SERVER);
+
+	void queueDesktopSize(VncdDesktopSizeReason reason, VncdResizeStatus status);
+
+	void handleSetDesktopSize(const std::string& message);
+
+	// With a scale divisor above 1 the client is shown a box-filtered copy of
+	// the framebuffer. Damage is resampled into it as it arrives and then
+	// handled in the client's coordinates, like everything from the client.
+	// Scaled connections don't share encoded rects or join broadcast groups.
+	VncdScaler scaler;
+
+	bool scaled() const { return scaler.divisor() > 1; }
+
+	uint8_t* clientFramebuffer();
+
+	uint16_t clientFrameWidth();
+
+	uint16_t clientFrameHeight();
+
+	void updateScale(); // resamples everything
+
+	// Maps damage to the client's coordinates and resamples it. Returns false
+	// if nothing the client sees changed.
+	bool scaleDamage(uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h);
+
 	RFBPixelFormat networkPixelFormat;
 
 	asio::streambuf sb;
 
 	asio::streambuf::mutable_buffers_type sb_mutable;
 
-	std::string getBuffer(size_t numBytes);
+	// Bytes read but not yet handled. Clients may send several messages in
+	// one segment, or one message across several.
+	std::string inbox;
+
+	// The length of the message at the front, or 0 if more bytes are needed
+	// to tell. VNCD_MESSAGE_UNKNOWN if it is of a type we can't frame,
+	// VNCD_MESSAGE_TOO_LONG if it is longer than we are willing to buffer.
+	size_t protocolMessageLength(const char* data, size_t available) const;
+
+	void handleProtocolMessages();
 
 	std::vector<uint32_t> supportedEncodings;
 
@@ -96,8 +447,170 @@ protected:
 
 	VncdConnectionState currentState;
 
-	mz_stream zrleStream;
-	mz_stream zlibStream;
+	// Compressors are created on first use, and released when the client
+	// switches to an encoding that doesn't use them or the connection idles
+	VncdDeflateStream zrleStream;
+	VncdDeflateStream zlibStream;
+	VncdDeflateStream tightStreams[VNCD_TIGHT_STREAMS];
+
+	void releaseStream(VncdDeflateStream& stream, std::shared_ptr<VncdEncoderSequence>& sequence);
+
+	void releaseUnusedEncoderState();
+
+	// The client's Tight inflaters may not match our compressors, e.g. after
+	// leaving a broadcast group; the next Tight update resets them all
+	bool tightResetPending;
+
+	void restartTightStreams();
+
+	// Updates only cover tiles that differ from what the client was last sent
+	VncdTileHashes sentTiles;
+
+	// Version of the shared framebuffer that damage has been sent up to
+	uint64_t damageSentVersion;
+
+	std::atomic<bool> damagePending;
+
+	std::vector<VncdRect> damagedRects; // kept so its capacity is reused
+
+	void sendFramebufferDamage();
+
+	// Set by Vncd; zero sends every update however far behind the client is
+	size_t sendQueueLimit;
+
+	// While the client can't keep up, damage collects here instead of being
+	// encoded. Once it drains, the latest pixels of the whole region go out in
+	// one go, so a slow client skips frames rather than falling behind.
+	VncdRegion deferredDamage;
+
+	VncdRegion deferredRefresh; // requested by the client, so sent in full
+
+	// Rects deferred since the regions were last brought up to date. Uniting
+	// them one by one costs the region's size each time; mergeDeferred() adds
+	// them all in one go.
+	std::vector<VncdRect> deferredDamageRects;
+
+	std::vector<VncdRect> deferredRefreshRects;
+
+	void deferRect(uint16_t x, uint16_t y, uint16_t w, uint16_t h, bool refresh);
+
+	void mergeDeferred();
+
+	bool damagePullDeferred;
+
+	bool stripBacklog; // the rest of a large update is deferred, a strip at a time
+
+	bool congested() const;
+
+	void sendDeferredUpdates();
+
+	// While updates are held back, the damage collected so far is encoded
+	// ahead on the encoder pool, one update at a time. If no damage lands on
+	// it before the client drains, it is sent as is. Only for the stateless
+	// encodings: a deflate stream has to see rects in the order they are sent.
+	PendingUpdate* speculation;
+
+	VncdRegion speculationRegion; // whole tiles, as the tile filter sends them
+
+	bool speculationValid;
+
+	std::vector<VncdRect> speculationRects;
+
+	void speculate();
+
+	void finishSpeculation(PendingUpdate* update);
+
+	void invalidateSpeculation(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	void dropSpeculation(); // the encoding, pixel format or size changed
+
+	void discardSpeculation(); // only once it has finished encoding
+
+	bool commitSpeculation();
+
+	// Once the client lists the Fence pseudo-encoding, a fence follows every
+	// update. Its answers time the round trip and acknowledge what the client
+	// has processed, which limits how much is sent ahead of it.
+	bool fenceSupported;
+
+	VncdCongestion congestion;
+
+	void sendFence(uint32_t flags, const std::string& payload);
+
+	void sendPing();
+
+	void handleFence(const std::string& message);
+
+	// Slow links get the most compression, fast ones the cheapest
+	int compressionLevel() const;
+
+	// Writes wait for both quotas. While one does, the connection counts as
+	// congested, so damage is merged and fewer frames go out; if it keeps
+	// waiting, updates are also compressed harder.
+	VncdTokenBucket bandwidthLimit;
+
+	VncdTokenBucket* totalBandwidthLimit; // set by Vncd; shared by every connection of the server
+
+	VncdTimer throttleTimer;
+
+	bool throttleWaiting;
+
+	size_t throttleStreak; // writes in a row that had to wait
+
+	VncdTokenBucket::Clock::duration throttledTime;
+
+	bool throttle(size_t bytes); // true if the write must wait; the timer resumes it
+
+	uint64_t bytesSent;
+
+	uint64_t rateWindowBytes;
+
+	std::chrono::steady_clock::time_point rateWindowStart;
+
+	size_t recentRate;
+
+	// Damage is pushed without waiting for requests either way; with
+	// continuous updates enabled the client also limits it to an area.
+	// EndOfContinuousUpdates announces support, and confirms disabling once
+	// the updates already being encoded have gone out.
+	bool continuousUpdatesSupported;
+
+	bool continuousUpdates;
+
+	VncdRect continuousUpdatesArea;
+
+	bool endOfContinuousUpdatesPending;
+
+	void handleEnableContinuousUpdates(const std::string& message);
+
+	void sendEndOfContinuousUpdates();
+
+	// Clients that list Cursor are sent the shape in their pixel format, those
+	// that only list XCursor get a two-colour version
+	std::shared_ptr<const VncdCursor> cursor;
+
+	std::shared_ptr<const VncdCursor> sentCursor;
+
+	int32_t sentCursorEncoding; // zero until a shape has been sent
+
+	std::atomic<bool> cursorShapeSupported;
+
+	bool cursorPosSupported;
+
+	int32_t cursorEncoding() const;
+
+	void sendCursorShape();
+
+	// Set by Vncd; zero leaves encoder state and arenas allocated while idle
+	std::chrono::milliseconds idleTrimPeriod;
+
+	std::chrono::system_clock::time_point lastUpdateTime;
+
+	bool trimTimerArmed;
+
+	void armTrimTimer(std::chrono::milliseconds delay);
+
+	void trimIdleState();
 
 	std::string desChallengeNonce;
 
@@ -121,12 +634,29 @@ protected:
 	
 	virtual void connectionStarted() = 0;
 
-	virtual uint8_t* getFramebufferRGBX32() = 0;
+	virtual uint8_t* getFramebufferRGBX32() = 0; // read from encoder threads
 
 	virtual uint16_t getFrameWidth() = 0;
 
 	virtual uint16_t getFrameHeight() = 0;
 
+	// Shrinks what the client is sent by this factor each way, e.g. for small
+	// screens. Read when the session starts and on notifyClient_sizeChanged().
+	virtual unsigned getScaleDivisor() { return 1; }
+
+	// The monitors making up the framebuffer, for clients that support
+	// ExtendedDesktopSize. By default one screen covers all of it.
+	virtual std::vector<VncdScreen> getScreenLayout();
+
+	// A client asked for a new size and layout. To accept, resize the
+	// framebuffer and return VRS_OK; this client is then told as if by
+	// notifyClient_sizeChanged(), which should be called for the others.
+	virtual VncdResizeStatus desktopResizeRequested(uint16_t /* width */, uint16_t /* height */, const std::vector<VncdScreen>& /* screens */) { return VRS_PROHIBITED; }
+
+	// Connections that return the same object show the same pixels, so RAW
+	// and TightPNG rects encoded for one can be sent to the others
+	virtual VncdSharedFramebuffer* getSharedFramebuffer() { return nullptr; }
+
 	virtual std::string getSessionTitle() = 0;
 
 	virtual std::string requirePassword() = 0;
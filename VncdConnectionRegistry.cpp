@@ -0,0 +1,97 @@
+/* VncdConnectionRegistry.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdConnectionRegistry.hpp"
+#include "VncdConnection.hpp"
+
+VncdConnectionRegistry::VncdConnectionRegistry() :
+	firstFree(0),
+	count(0),
+	limit(0)
+{
+}
+
+bool VncdConnectionRegistry::add(std::shared_ptr<VncdConnection> connection) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	if (limit && count >= limit) {
+		return false;
+	}
+
+	size_t slot = firstFree;
+
+	if (slot == slots.size()) {
+		Slot fresh;
+		fresh.nextFree = slots.size() + 1;
+		slots.push_back(fresh);
+	}
+
+	firstFree = slots[slot].nextFree;
+
+	connection->registry = this;
+	connection->registrySlot = slot;
+	slots[slot].connection = std::move(connection);
+
+	++count;
+	return true;
+}
+
+void VncdConnectionRegistry::remove(size_t slot) {
+
+	std::shared_ptr<VncdConnection> released; // dropped once the lock is released
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	released = std::move(slots[slot].connection);
+	released->registry = nullptr;
+
+	slots[slot].nextFree = firstFree;
+	firstFree = slot;
+	--count;
+}
+
+size_t VncdConnectionRegistry::size() {
+	std::lock_guard<std::mutex> guard(lock);
+	return count;
+}
+
+void VncdConnectionRegistry::setLimit(size_t maxConnections) {
+	std::lock_guard<std::mutex> guard(lock);
+	limit = maxConnections;
+}
+
+void VncdConnectionRegistry::forEach(const std::function<void(const std::shared_ptr<VncdConnection>&)>& callback) {
+
+	std::vector<std::shared_ptr<VncdConnection>> snapshot;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		snapshot.reserve(count);
+		for (Slot& slot : slots) {
+			if (slot.connection) {
+				snapshot.push_back(slot.connection);
+			}
+		}
+	}
+
+	for (const std::shared_ptr<VncdConnection>& connection : snapshot) {
+		callback(connection);
+	}
+}
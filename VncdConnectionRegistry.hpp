@@ -0,0 +1,70 @@
+/* VncdConnectionRegistry.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <functional>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+
+class VncdConnection;
+
+// Every live connection, in a slot map. A connection knows its slot and
+// removes itself in O(1) when it closes; freed slots are reused by later
+// connections. Shared by all of a server's shards.
+
+class VncdConnectionRegistry : public asio::noncopyable {
+
+public:
+
+	VncdConnectionRegistry();
+
+	// False, without adding it, if the limit has been reached
+	bool add(std::shared_ptr<VncdConnection> connection);
+
+	void remove(size_t slot);
+
+	size_t size();
+
+	// 0 for no limit
+	void setLimit(size_t maxConnections);
+
+	// Runs over a snapshot, so the callback may close connections
+	void forEach(const std::function<void(const std::shared_ptr<VncdConnection>&)>& callback);
+
+protected:
+
+	struct Slot {
+		std::shared_ptr<VncdConnection> connection;
+		size_t nextFree;
+	};
+
+	std::mutex lock;
+
+	std::vector<Slot> slots;
+
+	size_t firstFree; // slots.size() when there is none
+
+	size_t count;
+
+	size_t limit;
+
+};
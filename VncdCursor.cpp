@@ -0,0 +1,129 @@
+/* VncdCursor.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdCursor.hpp"
+#include <algorithm>
+#include "VncdConnection.hpp"
+#include "VncdRectEncoder.hpp"
+
+VncdCursor::VncdCursor() :
+	width(0),
+	height(0),
+	hotspotX(0),
+	hotspotY(0)
+{
+}
+
+VncdCursor::VncdCursor(uint16_t width, uint16_t height, uint16_t hotspotX, uint16_t hotspotY, const uint8_t* pixelsRGBA32) :
+	width(width),
+	height(height),
+	hotspotX(hotspotX),
+	hotspotY(hotspotY),
+	pixels(pixelsRGBA32, pixelsRGBA32 + (size_t)width * height * 4)
+{
+}
+
+bool VncdCursor::sameShape(const VncdCursor& other) const {
+	return width == other.width && height == other.height && hotspotX == other.hotspotX && hotspotY == other.hotspotY && pixels == other.pixels;
+}
+
+bool VncdCursor::dark(size_t x, size_t y) const {
+	const uint8_t* px = &pixels[(x + y * width) * 4];
+	return (px[0] * 299 + px[1] * 587 + px[2] * 114) < 128 * 1000;
+}
+
+void VncdCursor::encode(VncdBufferChain& out, RFBPixelFormat& pixelFormat) const {
+
+	VncdRectEncoder::appendRectHeader(out, hotspotX, hotspotY, width, height, VEM_CURSOR);
+
+	size_t bytesPerPixel = pixelFormat.bitsPerPixel / 8;
+	size_t piecePixels = VNCD_CHUNK_SIZE / 2 / bytesPerPixel;
+
+	for (size_t y = 0; y < height; ++y) {
+		for (size_t x = 0; x < width; x += piecePixels) {
+			size_t n = std::min(piecePixels, (size_t)width - x);
+
+			char* dest = out.reserve(n * bytesPerPixel);
+			pixelFormat.copyRect(const_cast<uint8_t*>(pixels.data()), width, dest, (uint16_t)x, (uint16_t)y, (uint16_t)n, 1);
+			out.commit(n * bytesPerPixel);
+		}
+	}
+
+	appendMask(out);
+}
+
+void VncdCursor::encodeX(VncdBufferChain& out) const {
+
+	VncdRectEncoder::appendRectHeader(out, hotspotX, hotspotY, width, height, VEM_XCURSOR);
+
+	if (width == 0 || height == 0) {
+		return;
+	}
+
+	// Primary (bitmap set) is the dark colour, secondary the light one
+	size_t sums[2][3] = {}, counts[2] = {};
+	for (size_t y = 0; y < height; ++y) {
+		for (size_t x = 0; x < width; ++x) {
+			if (!visible(x, y)) {
+				continue;
+			}
+			const uint8_t* px = &pixels[(x + y * width) * 4];
+			int which = dark(x, y) ? 0 : 1;
+			for (int c = 0; c < 3; ++c) {
+				sums[which][c] += px[c];
+			}
+			++counts[which];
+		}
+	}
+
+	uint8_t colours[6] = { 0, 0, 0, 255, 255, 255 };
+	for (int which = 0; which < 2; ++which) {
+		if (counts[which]) {
+			for (int c = 0; c < 3; ++c) {
+				colours[which * 3 + c] = (uint8_t)(sums[which][c] / counts[which]);
+			}
+		}
+	}
+	out.append(colours, sizeof(colours));
+
+	for (size_t y = 0; y < height; ++y) {
+		char* row = out.reserve(rowBytes());
+		std::fill(row, row + rowBytes(), 0);
+		for (size_t x = 0; x < width; ++x) {
+			if (dark(x, y)) {
+				row[x / 8] |= (char)(0x80 >> (x % 8));
+			}
+		}
+		out.commit(rowBytes());
+	}
+
+	appendMask(out);
+}
+
+void VncdCursor::appendMask(VncdBufferChain& out) const {
+	for (size_t y = 0; y < height; ++y) {
+		char* row = out.reserve(rowBytes());
+		std::fill(row, row + rowBytes(), 0);
+		for (size_t x = 0; x < width; ++x) {
+			if (visible(x, y)) {
+				row[x / 8] |= (char)(0x80 >> (x % 8));
+			}
+		}
+		out.commit(rowBytes());
+	}
+}
@@ -0,0 +1,67 @@
+/* VncdCursor.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "RFBPixelFormat.hpp"
+#include "VncdBufferChain.hpp"
+
+// A pointer shape for clients that draw the pointer themselves. Pixels are
+// RGBX32 like the framebuffer, except that the fourth byte is alpha: pixels
+// with less than 128 are transparent. An empty shape hides the pointer.
+
+class VncdCursor {
+
+public:
+
+	VncdCursor();
+
+	VncdCursor(uint16_t width, uint16_t height, uint16_t hotspotX, uint16_t hotspotY, const uint8_t* pixelsRGBA32);
+
+	bool sameShape(const VncdCursor& other) const;
+
+	// Cursor pseudo-encoding: the pixels in the client's format, then the mask
+	void encode(VncdBufferChain& out, RFBPixelFormat& pixelFormat) const;
+
+	// XCursor pseudo-encoding: two colours, a bitmap choosing between them, then
+	// the mask. Dark pixels take the average of the dark ones, light pixels of
+	// the light ones.
+	void encodeX(VncdBufferChain& out) const;
+
+	uint16_t width;
+
+	uint16_t height;
+
+	uint16_t hotspotX;
+
+	uint16_t hotspotY;
+
+	std::vector<uint8_t> pixels;
+
+protected:
+
+	size_t rowBytes() const { return ((size_t)width + 7) / 8; }
+
+	bool visible(size_t x, size_t y) const { return pixels[(x + y * width) * 4 + 3] >= 128; }
+
+	bool dark(size_t x, size_t y) const;
+
+	void appendMask(VncdBufferChain& out) const;
+
+};
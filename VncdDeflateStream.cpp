@@ -0,0 +1,90 @@
+/* VncdDeflateStream.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdDeflateStream.hpp"
+#include <cstring>
+
+VncdDeflateStream::VncdDeflateStream() :
+	started(false),
+	level(VNCD_ZLIB_COMPRESSION),
+	allocated(false)
+{
+	memset(&stream, 0, sizeof(stream));
+}
+
+VncdDeflateStream::~VncdDeflateStream() {
+	release();
+}
+
+mz_stream* VncdDeflateStream::get(int level) {
+
+	// miniz can't change the level of a live compressor, only start it over
+	if (!stream.state || level != this->level) {
+		init(level);
+	}
+
+	return &stream;
+}
+
+void VncdDeflateStream::init(int level) {
+
+	// Only the first compressor of the stream writes the zlib header
+	int windowBits = started ? -MZ_DEFAULT_WINDOW_BITS : MZ_DEFAULT_WINDOW_BITS;
+
+	if (!stream.state) {
+		mz_deflateInit2(&stream, level, MZ_DEFLATED, windowBits, 9, MZ_DEFAULT_STRATEGY);
+		allocated = true;
+
+	} else {
+		mz_uint flags = TDEFL_COMPUTE_ADLER32 | tdefl_create_comp_flags_from_zip_params(level, windowBits, MZ_DEFAULT_STRATEGY);
+		tdefl_init((tdefl_compressor*)stream.state, NULL, NULL, flags);
+		stream.adler = MZ_ADLER32_INIT;
+		stream.total_in = stream.total_out = 0;
+
+	}
+
+	this->level = level;
+	started = true;
+}
+
+void VncdDeflateStream::release() {
+	if (stream.state) {
+		mz_deflateEnd(&stream);
+		memset(&stream, 0, sizeof(stream));
+		allocated = false;
+	}
+}
+
+void VncdDeflateStream::restart(bool withHeader) {
+	started = !withHeader;
+	if (stream.state) {
+		init(level);
+	}
+}
+
+bool VncdDeflateStream::begun() const {
+	return started;
+}
+
+bool VncdDeflateStream::active() const {
+	return allocated;
+}
+
+size_t VncdDeflateStream::memoryUsage() const {
+	return active() ? sizeof(tdefl_compressor) : 0;
+}
@@ -0,0 +1,73 @@
+/* VncdDeflateStream.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "miniz_wrapper.h"
+
+#define VNCD_ZLIB_COMPRESSION	MZ_DEFAULT_COMPRESSION
+
+// One of the client's continuous zlib streams. The compressor is only
+// created when the first rect needs it, and it can be released again while
+// the stream is idle. A replacement compressor carries on the client's
+// stream as raw deflate: every rect ends on a sync flush, so the client's
+// inflater simply sees more blocks, which don't refer back to old data.
+// Asking for another level starts the compressor over the same way, in
+// place, rather than freeing and allocating its few hundred KB again.
+
+class VncdDeflateStream : public asio::noncopyable {
+
+public:
+
+	VncdDeflateStream();
+
+	~VncdDeflateStream();
+
+	mz_stream* get(int level);
+
+	void release();
+
+	// Drops the compressor's history at a flush boundary. With a header, the
+	// client is expected to reset its inflater too (Tight can); without, the
+	// stream carries on as raw deflate, like a released stream.
+	void restart(bool withHeader);
+
+	bool begun() const; // the client's inflater has seen the zlib header
+
+	bool active() const;
+
+	size_t memoryUsage() const; // bytes held by the compressor, 0 when released
+
+protected:
+
+	mz_stream stream;
+
+	// Creates the compressor, or starts the existing one over at a flush
+	// boundary, continuing the client's stream
+	void init(int level);
+
+	bool started; // the zlib header has gone out
+
+	int level;
+
+	std::atomic<bool> allocated; // readable from other threads, for memory reports
+
+};
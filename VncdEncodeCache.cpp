@@ -0,0 +1,221 @@
+/* VncdEncodeCache.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdEncodeCache.hpp"
+
+bool VncdEncodeKey::operator==(const VncdEncodeKey& other) const {
+	return framebuffer == other.framebuffer && version == other.version && contentHash == other.contentHash &&
+		encoding == other.encoding && compressionLevel == other.compressionLevel && x == other.x && y == other.y && w == other.w && h == other.h &&
+		pixelFormat == other.pixelFormat;
+}
+
+size_t VncdEncodeKeyHash::operator()(const VncdEncodeKey& key) const {
+
+	// FNV-1a over the fields that vary between rects; the pixel format
+	// rarely differs and is left to operator==
+
+	uint64_t values[] = {
+		key.framebuffer,
+		key.version,
+		key.contentHash,
+		((uint64_t)(uint32_t)key.compressionLevel << 32) | key.encoding,
+		((uint64_t)key.x << 48) | ((uint64_t)key.y << 32) | ((uint64_t)key.w << 16) | key.h
+	};
+
+	uint64_t hash = 14695981039346656037ULL;
+	for (uint64_t value : values) {
+		for (int i = 0; i < 8; ++i) {
+			hash = (hash ^ ((value >> (i * 8)) & 0xFF)) * 1099511628211ULL;
+		}
+	}
+	return (size_t)hash;
+}
+
+VncdEncodeCache::VncdEncodeCache(size_t capacity) :
+	newest(nullptr),
+	oldest(nullptr),
+	capacity(capacity),
+	bytes(0),
+	hitCount(0),
+	missCount(0)
+{
+}
+
+VncdEncodeLookup VncdEncodeCache::find(const VncdEncodeKey& key, Payload& payload, VncdEncodeWaiter* waiter) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	EntryMap::iterator it = entries.find(key);
+
+	if (it == entries.end()) {
+
+		// Claim it; anyone else asking before our store() waits for it
+
+		it = entries.emplace(key, Entry()).first;
+		it->second.waiters = nullptr;
+		it->second.newer = it->second.older = nullptr;
+		it->second.key = &it->first;
+
+		++missCount;
+		return VEL_MISS;
+	}
+
+	Entry& entry = it->second;
+
+	if (!entry.payload) {
+		if (!waiter) {
+			++missCount;
+			return VEL_MISS;
+		}
+
+		waiter->next = entry.waiters;
+		entry.waiters = waiter;
+
+		++hitCount;
+		return VEL_WAITING;
+	}
+
+	unlink(&entry);
+	linkNewest(&entry);
+
+	++hitCount;
+	payload = entry.payload;
+	return VEL_HIT;
+}
+
+void VncdEncodeCache::store(const VncdEncodeKey& key, Payload payload) {
+
+	VncdEncodeWaiter* waiters;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		EntryMap::iterator it = entries.find(key);
+
+		// Whoever stores first fills the entry; later results are dropped
+		if (it == entries.end() || it->second.payload) {
+			return;
+		}
+
+		waiters = it->second.waiters;
+		it->second.waiters = nullptr;
+
+		if (!payload) {
+			entries.erase(it);
+
+		} else {
+
+			// Zero-initialised for a framebuffer seen for the first time
+			FramebufferVersions& versions = latestVersions[key.framebuffer];
+			if (key.version > versions.latest) {
+				versions.latest = key.version;
+			}
+			++versions.entries;
+
+			it->second.payload = payload;
+			bytes += payload->size();
+			linkNewest(&it->second);
+			evict();
+		}
+	}
+
+	// Outside the lock, since a waiter given null looks the rect up again.
+	// Each may be gone as soon as it has been called.
+
+	while (waiters) {
+		VncdEncodeWaiter* waiter = waiters;
+		waiters = waiter->next;
+		waiter->onStored(payload);
+	}
+}
+
+void VncdEncodeCache::setCapacity(size_t bytes) {
+	std::lock_guard<std::mutex> guard(lock);
+	capacity = bytes;
+	evict();
+}
+
+size_t VncdEncodeCache::hits() const {
+	return hitCount;
+}
+
+size_t VncdEncodeCache::misses() const {
+	return missCount;
+}
+
+double VncdEncodeCache::hitRatio() const {
+	size_t h = hitCount, m = missCount;
+	return (h + m) ? (double)h / (double)(h + m) : 0.0;
+}
+
+size_t VncdEncodeCache::cachedBytes() {
+	std::lock_guard<std::mutex> guard(lock);
+	return bytes;
+}
+
+void VncdEncodeCache::unlink(Entry* entry) {
+	if (entry->newer) {
+		entry->newer->older = entry->older;
+	} else {
+		newest = entry->older;
+	}
+
+	if (entry->older) {
+		entry->older->newer = entry->newer;
+	} else {
+		oldest = entry->newer;
+	}
+
+	entry->newer = entry->older = nullptr;
+}
+
+void VncdEncodeCache::linkNewest(Entry* entry) {
+	entry->newer = nullptr;
+	entry->older = newest;
+
+	if (newest) {
+		newest->newer = entry;
+	} else {
+		oldest = entry;
+	}
+	newest = entry;
+}
+
+bool VncdEncodeCache::superseded(const Entry* entry) {
+	return entry->key->version < latestVersions[entry->key->framebuffer].latest;
+}
+
+void VncdEncodeCache::evict() {
+
+	// Rects of a version that has since changed are only wanted by viewers that
+	// are behind, so they go as soon as they are the oldest. Connections still
+	// sending an evicted rect keep its payload alive.
+
+	while (oldest && (bytes > capacity || superseded(oldest))) {
+		Entry* victim = oldest;
+		unlink(victim);
+		bytes -= victim->payload->size();
+
+		auto versions = latestVersions.find(victim->key->framebuffer);
+		if (--versions->second.entries == 0) {
+			latestVersions.erase(versions);
+		}
+
+		entries.erase(entries.find(*victim->key));
+	}
+}
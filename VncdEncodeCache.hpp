@@ -0,0 +1,152 @@
+/* VncdEncodeCache.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <unordered_map>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "RFBPixelFormat.hpp"
+#include "VncdBufferChain.hpp"
+#include "VncdSharedFramebuffer.hpp"
+
+#define VNCD_ENCODE_CACHE_SIZE	(64 * 1024 * 1024) // bytes of encoded rects
+#define VNCD_TILE_CACHE_SIZE	(32 * 1024 * 1024) // bytes of tiles cached by content
+
+// Everything that determines the bytes of an encoded rect. A rect is either
+// identified by where it is (framebuffer, version and position) along with a
+// hash of its pixels, or, for tiles cached by content, by the hash alone with
+// a framebuffer of 0.
+struct VncdEncodeKey {
+	uint64_t framebuffer; // VncdSharedFramebuffer::id()
+	uint64_t version;
+	uint64_t contentHash;
+	RFBPixelFormat pixelFormat;
+	uint32_t encoding;
+	int compressionLevel;
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+
+	bool operator==(const VncdEncodeKey& other) const;
+};
+
+struct VncdEncodeKeyHash {
+	size_t operator()(const VncdEncodeKey& key) const;
+};
+
+// Waits for a rect that someone else is encoding. Belongs to the caller, e.g.
+// in an update's arena, and must stay where it is until it has been called.
+struct VncdEncodeWaiter {
+	std::function<void(std::shared_ptr<const VncdBufferChain>)> onStored;
+	VncdEncodeWaiter* next;
+};
+
+enum VncdEncodeLookup {
+	VEL_HIT,		// the rect is cached
+	VEL_MISS,		// the caller encodes the rect and passes it to store()
+	VEL_WAITING		// the waiter is called once the rect is stored
+};
+
+// Encoded rects of stateless encodings, shared between every connection that
+// asks for the same rect of the same framebuffer version, and evicted least
+// recently used first. The first connection to miss on a rect encodes it;
+// the others wait for its result without holding up a thread.
+
+class VncdEncodeCache : public asio::noncopyable {
+
+public:
+
+	typedef std::shared_ptr<const VncdBufferChain> Payload;
+
+	explicit VncdEncodeCache(size_t capacity = VNCD_ENCODE_CACHE_SIZE);
+
+	// Sets payload on a hit. On a miss the caller has claimed the rect, and
+	// must encode it and pass it to store(). If someone else has claimed it,
+	// the waiter is called with their result once they store it, or with null
+	// if they fail, in which case the caller starts over. It is called on the
+	// storing thread, so it should only hand the result on. Without a waiter
+	// the caller encodes the rect as well, and the first result is kept.
+	VncdEncodeLookup find(const VncdEncodeKey& key, Payload& payload, VncdEncodeWaiter* waiter = nullptr);
+
+	// A null payload abandons the entry, e.g. if encoding failed
+	void store(const VncdEncodeKey& key, Payload payload);
+
+	void setCapacity(size_t bytes);
+
+	size_t hits() const; // including lookups that waited
+
+	size_t misses() const;
+
+	double hitRatio() const;
+
+	size_t cachedBytes();
+
+protected:
+
+	struct Entry {
+		Payload payload; // null while being encoded
+		VncdEncodeWaiter* waiters; // until then
+		Entry* newer;
+		Entry* older;
+		const VncdEncodeKey* key;
+	};
+
+	typedef std::unordered_map<VncdEncodeKey, Entry, VncdEncodeKeyHash> EntryMap;
+
+	std::mutex lock;
+
+	EntryMap entries;
+
+	// Finished entries, most recently used first
+	Entry* newest;
+
+	Entry* oldest;
+
+	// Newest version stored for each framebuffer; older ones are dropped
+	// first. A framebuffer is forgotten along with its last cached rect.
+	struct FramebufferVersions {
+		uint64_t latest;
+		size_t entries;
+	};
+
+	std::unordered_map<uint64_t, FramebufferVersions> latestVersions;
+
+	size_t capacity;
+
+	size_t bytes;
+
+	std::atomic<size_t> hitCount;
+
+	std::atomic<size_t> missCount;
+
+	void unlink(Entry* entry);
+
+	void linkNewest(Entry* entry);
+
+	bool superseded(const Entry* entry);
+
+	void evict();
+
+};
@@ -0,0 +1,189 @@
+/* VncdEncoderPool.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdEncoderPool.hpp"
+
+VncdEncoderPool::VncdEncoderPool(size_t workerCount) :
+	queuedJobs(0),
+	nextWorker(0),
+	stopping(false)
+{
+	if (workerCount == 0) {
+		workerCount = std::thread::hardware_concurrency();
+	}
+	if (workerCount == 0) {
+		workerCount = 1; // unknown
+	}
+
+	for (size_t i = 0; i < workerCount; ++i) {
+		workers.emplace_back(new Worker());
+	}
+
+	for (size_t i = 0; i < workerCount; ++i) {
+		workers[i]->thread = std::thread(&VncdEncoderPool::workerLoop, this, i);
+	}
+}
+
+VncdEncoderPool::~VncdEncoderPool() {
+
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		stopping = true;
+	}
+	wake.notify_all();
+
+	for (std::unique_ptr<Worker>& w : workers) {
+		w->thread.join();
+	}
+
+}
+
+size_t VncdEncoderPool::workerCount() const {
+	return workers.size();
+}
+
+void VncdEncoderPool::submit(Job job) {
+
+	Worker& target = *workers[nextWorker++ % workers.size()];
+
+	{
+		std::lock_guard<std::mutex> guard(target.lock);
+		target.jobs.push_back(std::move(job));
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(sleepLock);
+		++queuedJobs;
+	}
+	wake.notify_one();
+}
+
+bool VncdEncoderPool::takeJob(size_t index, Job& job) {
+
+	// Own work first, oldest first
+
+	{
+		Worker& own = *workers[index];
+		std::lock_guard<std::mutex> guard(own.lock);
+		if (!own.jobs.empty()) {
+			job = std::move(own.jobs.front());
+			own.jobs.pop_front();
+			--queuedJobs;
+			return true;
+		}
+	}
+
+	// Steal the newest job from somebody else
+
+	for (size_t i = 1; i < workers.size(); ++i) {
+		Worker& victim = *workers[(index + i) % workers.size()];
+		std::lock_guard<std::mutex> guard(victim.lock);
+		if (!victim.jobs.empty()) {
+			job = std::move(victim.jobs.back());
+			victim.jobs.pop_back();
+			--queuedJobs;
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void VncdEncoderPool::workerLoop(size_t index) {
+
+	for (;;) {
+
+		Job job;
+		if (takeJob(index, job)) {
+			runJob(job);
+			continue;
+		}
+
+		std::unique_lock<std::mutex> guard(sleepLock);
+		wake.wait(guard, [this]() {
+			return stopping || queuedJobs > 0;
+		});
+
+		if (stopping) {
+			return;
+		}
+	}
+
+}
+
+void VncdEncoderPool::runJob(Job& job) {
+	try {
+		job();
+	} catch (...) {
+	}
+}
+
+VncdEncoderSequence::VncdEncoderSequence(VncdEncoderPool& pool) :
+	pool(pool),
+	jobs(VncdPoolAllocator<VncdEncoderPool::Job>(std::make_shared<VncdMemoryPool>())),
+	running(false)
+{
+}
+
+void VncdEncoderSequence::submit(VncdEncoderPool::Job job) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	jobs.push_back(std::move(job));
+
+	if (!running) {
+		running = true;
+		keepAlive = shared_from_this();
+		pool.submit([this]() {
+			runNext();
+		});
+	}
+}
+
+void VncdEncoderSequence::runNext() {
+
+	VncdEncoderPool::Job job;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		job = std::move(jobs.front());
+		jobs.pop_front();
+	}
+
+	// Whatever the job did, the sequence carries on with the next one
+	VncdEncoderPool::runJob(job);
+
+	// Hand the next job back to the pool rather than looping here, so a long
+	// sequence doesn't monopolise one worker
+
+	std::shared_ptr<VncdEncoderSequence> self;
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		if (jobs.empty()) {
+			running = false;
+			self = std::move(keepAlive); // may be the last reference
+
+		} else {
+			pool.submit([this]() {
+				runNext();
+			});
+		}
+	}
+}
@@ -0,0 +1,115 @@
+/* VncdEncoderPool.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <functional>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "VncdMemoryPool.hpp"
+
+// Encoding runs here instead of on the io threads. Every worker owns a deque;
+// it takes jobs from the front of its own deque and, once that is empty,
+// steals from the back of the other workers' deques.
+
+class VncdEncoderPool : public asio::noncopyable {
+
+	friend class VncdEncoderSequence;
+
+public:
+
+	typedef std::function<void()> Job;
+
+	VncdEncoderPool(size_t workerCount = 0); // 0: one worker per hardware thread
+
+	~VncdEncoderPool();
+
+	void submit(Job job);
+
+	size_t workerCount() const;
+
+protected:
+
+	typedef std::deque<Job, VncdPoolAllocator<Job>> JobQueue;
+
+	// Every job queue takes its blocks from a pool of its own, so queueing
+	// doesn't hit the heap once it has grown to its working size
+	struct Worker {
+		Worker() : jobs(VncdPoolAllocator<Job>(std::make_shared<VncdMemoryPool>())) {}
+
+		std::mutex lock;
+		JobQueue jobs;
+		std::thread thread;
+	};
+
+	std::vector<std::unique_ptr<Worker>> workers;
+
+	std::mutex sleepLock;
+
+	std::condition_variable wake;
+
+	std::atomic<long> queuedJobs;
+
+	std::atomic<size_t> nextWorker;
+
+	bool stopping;
+
+	bool takeJob(size_t index, Job& job);
+
+	// Jobs that can fail catch their own exceptions and hand them back to
+	// their owner, e.g. VncdConnection::encodePart(). One that doesn't is
+	// stopped here, so it can't take the worker and every session with it.
+	static void runJob(Job& job);
+
+	void workerLoop(size_t index);
+
+};
+
+// Runs jobs on the pool one at a time, in submission order. Used for encoder
+// state that can only be advanced serially, such as a deflate stream.
+
+class VncdEncoderSequence : public asio::noncopyable, public std::enable_shared_from_this<VncdEncoderSequence> {
+
+public:
+
+	VncdEncoderSequence(VncdEncoderPool& pool);
+
+	void submit(VncdEncoderPool::Job job);
+
+protected:
+
+	VncdEncoderPool& pool;
+
+	std::mutex lock;
+
+	VncdEncoderPool::JobQueue jobs;
+
+	bool running;
+
+	// Holds the sequence alive while a job of it is on the pool
+	std::shared_ptr<VncdEncoderSequence> keepAlive;
+
+	void runNext();
+
+};
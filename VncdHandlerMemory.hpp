@@ -0,0 +1,105 @@
+/* VncdHandlerMemory.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <utility>
+#include <type_traits>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "asio/asio/handler_alloc_hook.hpp"
+
+#define VNCD_HANDLER_MEMORY_SIZE	256
+
+// Storage for one asio operation at a time. Operations on a connection's
+// read loop or send queue follow one another, so a single slot each is
+// reused forever; anything larger, or arriving while the slot is taken,
+// falls back to the heap.
+
+class VncdHandlerMemory : public asio::noncopyable {
+
+public:
+
+	VncdHandlerMemory() :
+		inUse(false)
+	{
+	}
+
+	void* allocate(size_t size) {
+		if (size <= sizeof(storage) && !inUse.exchange(true)) {
+			return &storage;
+		}
+		return ::operator new(size);
+	}
+
+	void deallocate(void* ptr) {
+		if (ptr == &storage) {
+			inUse = false;
+		} else {
+			::operator delete(ptr);
+		}
+	}
+
+protected:
+
+	std::aligned_storage<VNCD_HANDLER_MEMORY_SIZE>::type storage;
+
+	std::atomic<bool> inUse;
+
+};
+
+// Wraps a completion handler so that asio allocates its operation from the
+// given VncdHandlerMemory, through asio's custom allocation hooks
+
+template <typename Handler>
+class VncdAllocHandler {
+
+public:
+
+	VncdAllocHandler(VncdHandlerMemory& memory, Handler handler) :
+		memory(memory),
+		handler(std::move(handler))
+	{
+	}
+
+	template <typename... Args>
+	void operator()(Args&&... args) {
+		handler(std::forward<Args>(args)...);
+	}
+
+	friend void* asio_handler_allocate(size_t size, VncdAllocHandler<Handler>* self) {
+		return self->memory.allocate(size);
+	}
+
+	friend void asio_handler_deallocate(void* ptr, size_t, VncdAllocHandler<Handler>* self) {
+		self->memory.deallocate(ptr);
+	}
+
+protected:
+
+	VncdHandlerMemory& memory;
+
+	Handler handler;
+
+};
+
+template <typename Handler>
+inline VncdAllocHandler<Handler> vncdAllocHandler(VncdHandlerMemory& memory, Handler handler) {
+	return VncdAllocHandler<Handler>(memory, std::move(handler));
+}
@@ -0,0 +1,159 @@
+/* VncdHash.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdHash.hpp"
+#include <cstring>
+
+#define PRIME64_1	11400714785074694791ULL
+#define PRIME64_2	14029467366897019727ULL
+#define PRIME64_3	1609587929392839161ULL
+#define PRIME64_4	9650029242287828579ULL
+#define PRIME64_5	2870177450012600261ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t read64(const unsigned char* p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t read32(const unsigned char* p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t mergeRound64(uint64_t acc, uint64_t val) {
+	acc ^= round64(0, val);
+	return acc * PRIME64_1 + PRIME64_4;
+}
+
+VncdHasher::VncdHasher(uint64_t seed) :
+	totalLength(0),
+	pendingLength(0),
+	seed(seed)
+{
+	lanes[0] = seed + PRIME64_1 + PRIME64_2;
+	lanes[1] = seed + PRIME64_2;
+	lanes[2] = seed;
+	lanes[3] = seed - PRIME64_1;
+}
+
+void VncdHasher::update(const void* data, size_t len) {
+
+	const unsigned char* p = static_cast<const unsigned char*>(data);
+	const unsigned char* end = p + len;
+
+	totalLength += len;
+
+	if (pendingLength + len < 32) {
+		memcpy(pending + pendingLength, p, len);
+		pendingLength += len;
+		return;
+	}
+
+	if (pendingLength) {
+		size_t fill = 32 - pendingLength;
+		memcpy(pending + pendingLength, p, fill);
+		p += fill;
+
+		lanes[0] = round64(lanes[0], read64(pending + 0));
+		lanes[1] = round64(lanes[1], read64(pending + 8));
+		lanes[2] = round64(lanes[2], read64(pending + 16));
+		lanes[3] = round64(lanes[3], read64(pending + 24));
+		pendingLength = 0;
+	}
+
+	uint64_t v1 = lanes[0], v2 = lanes[1], v3 = lanes[2], v4 = lanes[3];
+
+	for (; p + 32 <= end; p += 32) {
+		v1 = round64(v1, read64(p + 0));
+		v2 = round64(v2, read64(p + 8));
+		v3 = round64(v3, read64(p + 16));
+		v4 = round64(v4, read64(p + 24));
+	}
+
+	lanes[0] = v1; lanes[1] = v2; lanes[2] = v3; lanes[3] = v4;
+
+	pendingLength = end - p;
+	memcpy(pending, p, pendingLength);
+}
+
+uint64_t VncdHasher::digest() const {
+
+	uint64_t h;
+
+	if (totalLength >= 32) {
+		h = rotl64(lanes[0], 1) + rotl64(lanes[1], 7) + rotl64(lanes[2], 12) + rotl64(lanes[3], 18);
+		h = mergeRound64(h, lanes[0]);
+		h = mergeRound64(h, lanes[1]);
+		h = mergeRound64(h, lanes[2]);
+		h = mergeRound64(h, lanes[3]);
+	} else {
+		h = seed + PRIME64_5;
+	}
+
+	h += totalLength;
+
+	const unsigned char* p = pending;
+	const unsigned char* end = pending + pendingLength;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME64_1 + PRIME64_4;
+	}
+
+	if (p + 4 <= end) {
+		h ^= (uint64_t)read32(p) * PRIME64_1;
+		h = rotl64(h, 23) * PRIME64_2 + PRIME64_3;
+		p += 4;
+	}
+
+	for (; p < end; ++p) {
+		h ^= (*p) * PRIME64_5;
+		h = rotl64(h, 11) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64_t vncdHashRect(const uint8_t* framebuffer, uint16_t framebufferWidth, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	VncdHasher hasher;
+
+	for (size_t row = y; row < (size_t)y + (size_t)h; ++row) {
+		hasher.update(framebuffer + (x + row * framebufferWidth) * 4, (size_t)w * 4);
+	}
+
+	return hasher.digest();
+}
@@ -0,0 +1,52 @@
+/* VncdHash.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// 64-bit xxHash (XXH64). Four independent lanes of 8 bytes each, so the
+// compiler can keep them all in flight; fast enough to hash pixels on every
+// update. Not for anything adversarial.
+
+class VncdHasher {
+
+public:
+
+	explicit VncdHasher(uint64_t seed = 0);
+
+	void update(const void* data, size_t len);
+
+	uint64_t digest() const;
+
+protected:
+
+	uint64_t lanes[4];
+
+	uint64_t totalLength;
+
+	unsigned char pending[32]; // the part of a stripe not yet consumed
+
+	size_t pendingLength;
+
+	uint64_t seed;
+
+};
+
+// Hashes the pixels of a rect of an RGBX32 framebuffer, row by row
+uint64_t vncdHashRect(const uint8_t* framebuffer, uint16_t framebufferWidth, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
@@ -0,0 +1,131 @@
+/* VncdMemoryPool.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdMemoryPool.hpp"
+#include <new>
+
+VncdMemoryPool::VncdMemoryPool(size_t maxPooledBytes) :
+	maxPooledBytes(maxPooledBytes),
+	heapAllocationCount(0),
+	pooledByteCount(0)
+{
+	for (FreeBlock*& head : freeLists) {
+		head = nullptr;
+	}
+}
+
+VncdMemoryPool::~VncdMemoryPool() {
+	trim();
+}
+
+int VncdMemoryPool::sizeClass(size_t bytes) {
+
+	size_t blockSize = VNCD_POOL_MIN_BLOCK;
+
+	for (int i = 0; i < VNCD_POOL_SIZE_CLASSES; ++i, blockSize <<= 1) {
+		if (bytes <= blockSize) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+void* VncdMemoryPool::allocate(size_t bytes) {
+
+	int index = sizeClass(bytes);
+
+	if (index < 0) {
+		++heapAllocationCount;
+		return ::operator new(bytes);
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		FreeBlock* block = freeLists[index];
+		if (block) {
+			freeLists[index] = block->next;
+			pooledByteCount -= ((size_t)VNCD_POOL_MIN_BLOCK << index);
+			return block;
+		}
+	}
+
+	++heapAllocationCount;
+	return ::operator new((size_t)VNCD_POOL_MIN_BLOCK << index);
+}
+
+void VncdMemoryPool::deallocate(void* ptr, size_t bytes) {
+
+	if (!ptr) {
+		return;
+	}
+
+	int index = sizeClass(bytes);
+
+	if (index < 0) {
+		::operator delete(ptr);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		size_t blockSize = (size_t)VNCD_POOL_MIN_BLOCK << index;
+		if (pooledByteCount + blockSize <= maxPooledBytes) {
+			FreeBlock* block = static_cast<FreeBlock*>(ptr);
+			block->next = freeLists[index];
+			freeLists[index] = block;
+			pooledByteCount += blockSize;
+			return;
+		}
+	}
+
+	::operator delete(ptr);
+}
+
+void VncdMemoryPool::trim() {
+
+	FreeBlock* released[VNCD_POOL_SIZE_CLASSES];
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+
+		for (int i = 0; i < VNCD_POOL_SIZE_CLASSES; ++i) {
+			released[i] = freeLists[i];
+			freeLists[i] = nullptr;
+		}
+		pooledByteCount = 0;
+	}
+
+	for (FreeBlock* head : released) {
+		while (head) {
+			FreeBlock* next = head->next;
+			::operator delete(head);
+			head = next;
+		}
+	}
+}
+
+size_t VncdMemoryPool::heapAllocations() const {
+	return heapAllocationCount;
+}
+
+size_t VncdMemoryPool::pooledBytes() const {
+	return pooledByteCount;
+}
@@ -0,0 +1,124 @@
+/* VncdMemoryPool.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+
+#define VNCD_POOL_MIN_BLOCK		64
+#define VNCD_POOL_SIZE_CLASSES	15 // 64 bytes .. 1 MB; larger blocks bypass the pool
+#define VNCD_POOL_MAX_POOLED	(8 * 1024 * 1024) // blocks freed beyond this go back to the heap
+
+// Size-classed free lists. Freed blocks are kept for reuse instead of being
+// returned to the heap, so a steady workload stops allocating. Each pool is
+// meant to serve one owner (a connection, an encoder worker), so its lock
+// is rarely contended.
+
+class VncdMemoryPool : public asio::noncopyable {
+
+public:
+
+	VncdMemoryPool(size_t maxPooledBytes = VNCD_POOL_MAX_POOLED);
+
+	~VncdMemoryPool();
+
+	void* allocate(size_t bytes);
+
+	void deallocate(void* ptr, size_t bytes);
+
+	// Number of blocks that had to come from the heap
+	size_t heapAllocations() const;
+
+	// Bytes currently held on the free lists
+	size_t pooledBytes() const;
+
+	// Returns every pooled block to the heap
+	void trim();
+
+protected:
+
+	struct FreeBlock {
+		FreeBlock* next;
+	};
+
+	static int sizeClass(size_t bytes);
+
+	std::mutex lock;
+
+	FreeBlock* freeLists[VNCD_POOL_SIZE_CLASSES];
+
+	size_t maxPooledBytes;
+
+	std::atomic<size_t> heapAllocationCount;
+
+	std::atomic<size_t> pooledByteCount;
+
+};
+
+// Standard allocator over a shared VncdMemoryPool, e.g. for std::allocate_shared.
+// The pool stays alive as long as anything allocated from it.
+
+template <typename T>
+class VncdPoolAllocator {
+
+public:
+
+	typedef T value_type;
+
+	template <typename U>
+	struct rebind {
+		typedef VncdPoolAllocator<U> other;
+	};
+
+	std::shared_ptr<VncdMemoryPool> pool;
+
+	VncdPoolAllocator(std::shared_ptr<VncdMemoryPool> pool) :
+		pool(std::move(pool))
+	{
+	}
+
+	template <typename U>
+	VncdPoolAllocator(const VncdPoolAllocator<U>& other) :
+		pool(other.pool)
+	{
+	}
+
+	T* allocate(size_t n) {
+		return static_cast<T*>(pool->allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T* ptr, size_t n) {
+		pool->deallocate(ptr, n * sizeof(T));
+	}
+
+	template <typename U>
+	bool operator==(const VncdPoolAllocator<U>& other) const {
+		return pool == other.pool;
+	}
+
+	template <typename U>
+	bool operator!=(const VncdPoolAllocator<U>& other) const {
+		return pool != other.pool;
+	}
+
+};
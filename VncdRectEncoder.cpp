@@ -0,0 +1,428 @@
+/* VncdRectEncoder.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdRectEncoder.hpp"
+#include <algorithm>
+#include <memory>
+#include "asio_wrapper.h"
+#include "VncdConnection.hpp"
+#include "VncdHash.hpp"
+#include "VncdRegion.hpp"
+
+VncdRectEncoder::VncdRectEncoder(uint8_t* framebuffer, uint16_t framebufferWidth, const RFBPixelFormat& pixelFormat, VncdArena* arena) :
+	framebuffer(framebuffer),
+	framebufferWidth(framebufferWidth),
+	originX(0),
+	originY(0),
+	pixelFormat(pixelFormat),
+	arena(arena),
+	compressionLevel(MZ_DEFAULT_COMPRESSION)
+{
+}
+
+void VncdRectEncoder::setSource(uint8_t* pixels, const VncdRect& area) {
+	framebuffer = pixels;
+	framebufferWidth = area.w;
+	originX = area.x;
+	originY = area.y;
+}
+
+uint64_t VncdRectEncoder::hashRect(uint16_t x, uint16_t y, uint16_t w, uint16_t h) const {
+	return vncdHashRect(framebuffer, framebufferWidth, (uint16_t)(x - originX), (uint16_t)(y - originY), w, h);
+}
+
+VncdRectCost VncdRectEncoder::rectCost(uint32_t encoding, const RFBPixelFormat& pixelFormat) {
+
+	// Per rect: the header and anything the encoding adds to it, such as a
+	// length or a flush of the deflate stream, plus the time to set the encoder
+	// up, counted as bytes. Per pixel: about what a pixel costs once encoded.
+
+	VncdRectCost cost;
+
+	if (encoding == VEM_RAW) {
+		cost.perRect = 12;
+		cost.perPixel = pixelFormat.bitsPerPixel / 8;
+
+	} else if (encoding == (uint32_t)VEM_TIGHTPNG) {
+		cost.perRect = 512; // PNG chunks and a new compressor for every rect
+		cost.perPixel = 1;
+
+	} else {
+		cost.perRect = 64;
+		cost.perPixel = 1;
+
+	}
+
+	return cost;
+}
+
+void VncdRectEncoder::appendUpdateHeader(VncdBufferChain& message, uint16_t numRects) {
+
+	message.append("\x00\x00", 2); // FramebufferUpdate message
+
+	uint16_t numRects_network = htons(numRects);
+	message.append((char*)&numRects_network, sizeof(uint16_t));
+}
+
+void VncdRectEncoder::appendRectHeader(VncdBufferChain& message, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint32_t e) {
+
+	uint16_t
+		xnet = htons(x),
+		ynet = htons(y),
+		wnet = htons(w),
+		hnet = htons(h)
+		;
+
+	message.append((char*)&xnet, sizeof(uint16_t));
+	message.append((char*)&ynet, sizeof(uint16_t));
+	message.append((char*)&wnet, sizeof(uint16_t));
+	message.append((char*)&hnet, sizeof(uint16_t));
+
+	uint32_t encoding_type = htonl(e);
+	message.append((char*)&encoding_type, sizeof(uint32_t));
+}
+
+VncdBufferChain::Placeholder VncdRectEncoder::tightLengthPlaceholder(VncdBufferChain& message) {
+	return message.placeholder(3);
+}
+
+void VncdRectEncoder::patchTightLength(VncdBufferChain& message, const VncdBufferChain::Placeholder& where, size_t len) {
+
+	// Tight "compact length": 7 bits per byte, least significant first. Always
+	// using all three bytes is valid, as every byte but the last carries a
+	// continuation bit.
+
+	uint8_t compactLen[3] = {
+		(uint8_t)((len & 0x7F) | 0x80),
+		(uint8_t)(((len >> 7) & 0x7F) | 0x80),
+		(uint8_t)((len >> 14) & 0xFF)
+	};
+
+	message.patch(where, compactLen, sizeof(compactLen));
+}
+
+void VncdRectEncoder::splitTightRects(uint16_t x, uint16_t y, uint16_t w, uint16_t h, VncdRectList& out) {
+
+	for (size_t band_x = x; band_x < (size_t)x + (size_t)w; band_x += VNCD_TIGHT_MAX_RECT_WIDTH) {
+		uint16_t band_w = (uint16_t)std::min((size_t)VNCD_TIGHT_MAX_RECT_WIDTH, (size_t)x + (size_t)w - band_x);
+		size_t rows = std::max((size_t)1, (size_t)VNCD_TIGHT_MAX_RECT_SIZE / band_w);
+
+		for (size_t band_y = y; band_y < (size_t)y + (size_t)h; band_y += rows) {
+			VncdRect r;
+			r.x = (uint16_t)band_x;
+			r.y = (uint16_t)band_y;
+			r.w = band_w;
+			r.h = (uint16_t)std::min(rows, (size_t)y + (size_t)h - band_y);
+			out.push_back(r);
+		}
+	}
+}
+
+bool VncdRectEncoder::isSolid(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	x -= originX;
+	y -= originY;
+
+	const uint8_t* first = framebuffer + (x + (y * framebufferWidth)) * 4;
+
+	for (size_t ypos = y; ypos < (size_t)y + (size_t)h; ++ypos) {
+		const uint8_t* px = framebuffer + (x + (ypos * framebufferWidth)) * 4;
+		for (size_t xpos = 0; xpos < w; ++xpos, px += 4) {
+			if (px[0] != first[0] || px[1] != first[1] || px[2] != first[2]) {
+				return false;
+			}
+		}
+	}
+
+	return true;
+}
+
+size_t VncdRectEncoder::pixelSize(PixelKind kind) {
+	if (kind == PK_CPIXEL) {
+		return pixelFormat.cpixelSize();
+	}
+	if (kind == PK_TPIXEL) {
+		return pixelFormat.tpixelSize();
+	}
+	return pixelFormat.bitsPerPixel / 8;
+}
+
+void VncdRectEncoder::convertPixels(PixelKind kind, char* dest, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+	x -= originX;
+	y -= originY;
+	if (kind == PK_CPIXEL) {
+		pixelFormat.copyRectCpixel(framebuffer, framebufferWidth, dest, x, y, w, h);
+	} else if (kind == PK_TPIXEL) {
+		pixelFormat.copyRectTpixel(framebuffer, framebufferWidth, dest, x, y, w, h);
+	} else {
+		pixelFormat.copyRect(framebuffer, framebufferWidth, dest, x, y, w, h);
+	}
+}
+
+size_t VncdRectEncoder::deflateRect(VncdBufferChain& message, mz_stream* stream, PixelKind kind, uint16_t x, uint16_t y, uint16_t w, uint16_t h, int flush) {
+
+	char scratch[VNCD_ENCODER_SCRATCH_SIZE];
+	size_t scratchUsed = 0;
+	size_t compressed = 0;
+
+	size_t bytesPerPixel = pixelSize(kind);
+	size_t piecePixels = VNCD_ENCODER_SCRATCH_SIZE / bytesPerPixel;
+
+	for (size_t ypos = y; ypos < (size_t)y + (size_t)h; ++ypos) {
+		for (size_t xpos = x; xpos < (size_t)x + (size_t)w; xpos += piecePixels) {
+
+			size_t n = std::min(piecePixels, (size_t)x + (size_t)w - xpos);
+
+			if (scratchUsed + n * bytesPerPixel > sizeof(scratch)) {
+				compressed += message.appendDeflated(stream, scratch, scratchUsed, MZ_NO_FLUSH);
+				scratchUsed = 0;
+			}
+
+			convertPixels(kind, scratch + scratchUsed, (uint16_t)xpos, (uint16_t)ypos, (uint16_t)n, 1);
+			scratchUsed += n * bytesPerPixel;
+		}
+	}
+
+	compressed += message.appendDeflated(stream, scratch, scratchUsed, flush);
+	return compressed;
+}
+
+void VncdRectEncoder::encodeRaw(VncdBufferChain& message, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	appendRectHeader(message, x, y, w, h, VEM_RAW);
+
+	// Converted straight into the chain, a row (or part of one) at a time
+
+	size_t bytesPerPixel = pixelFormat.bitsPerPixel / 8;
+	size_t piecePixels = VNCD_CHUNK_SIZE / 2 / bytesPerPixel;
+
+	for (size_t ypos = y; ypos < (size_t)y + (size_t)h; ++ypos) {
+		for (size_t xpos = x; xpos < (size_t)x + (size_t)w; xpos += piecePixels) {
+			size_t n = std::min(piecePixels, (size_t)x + (size_t)w - xpos);
+
+			char* dest = message.reserve(n * bytesPerPixel);
+			pixelFormat.copyRect(framebuffer, framebufferWidth, dest, (uint16_t)(xpos - originX), (uint16_t)(ypos - originY), (uint16_t)n, 1);
+			message.commit(n * bytesPerPixel);
+		}
+	}
+}
+
+void VncdRectEncoder::encodeZlib(VncdBufferChain& message, mz_stream* zlibStream, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	appendRectHeader(message, x, y, w, h, VEM_ZLIB);
+
+	VncdBufferChain::Placeholder lengthField = message.placeholder(sizeof(uint32_t));
+
+	size_t compressed = deflateRect(message, zlibStream, PK_PIXEL, x, y, w, h, MZ_SYNC_FLUSH);
+
+	uint32_t compressed_network = htonl((uint32_t)compressed);
+	message.patch(lengthField, &compressed_network, sizeof(uint32_t));
+}
+
+// PNG chunks are checksummed, so the compressor's output passes through here
+struct VncdPngOutput {
+	VncdBufferChain* message;
+	mz_ulong crc;
+	size_t written;
+
+	static mz_bool put(const void* buf, int len, void* user) {
+		VncdPngOutput* self = static_cast<VncdPngOutput*>(user);
+		self->message->append(buf, len);
+		self->crc = mz_crc32(self->crc, static_cast<const unsigned char*>(buf), len);
+		self->written += len;
+		return MZ_TRUE;
+	}
+};
+
+static void appendPngChunkHeader(VncdBufferChain& message, VncdPngOutput& output, uint32_t len, const char* type) {
+
+	uint32_t len_network = htonl(len);
+	message.append(&len_network, sizeof(uint32_t));
+
+	output.crc = MZ_CRC32_INIT;
+	VncdPngOutput::put(type, 4, &output);
+}
+
+static void appendPngChunkCrc(VncdBufferChain& message, VncdPngOutput& output) {
+	uint32_t crc_network = htonl((uint32_t)output.crc);
+	message.append(&crc_network, sizeof(uint32_t));
+}
+
+void VncdRectEncoder::encodeTightPng(VncdBufferChain& message, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	appendRectHeader(message, x, y, w, h, VEM_TIGHT);
+
+	message.append("\xA0", 1); // png
+
+	VncdBufferChain::Placeholder lengthField = tightLengthPlaceholder(message);
+	size_t pngStart = message.size();
+
+	VncdPngOutput output = { &message, MZ_CRC32_INIT, 0 };
+
+	message.append("\x89PNG\r\n\x1a\n", 8);
+
+	// IHDR: 8-bit RGB, no interlacing
+
+	uint8_t ihdr[13] = { 0 };
+	uint32_t w_network = htonl(w), h_network = htonl(h);
+	memcpy(ihdr + 0, &w_network, sizeof(uint32_t));
+	memcpy(ihdr + 4, &h_network, sizeof(uint32_t));
+	ihdr[8] = 8;
+	ihdr[9] = 2;
+
+	appendPngChunkHeader(message, output, sizeof(ihdr), "IHDR");
+	VncdPngOutput::put(ihdr, sizeof(ihdr), &output);
+	appendPngChunkCrc(message, output);
+
+	// IDAT: the length goes in once the compressor has finished. The PNG
+	// carries plain RGB, whatever the client's pixel format.
+
+	VncdBufferChain::Placeholder idatLength = message.placeholder(sizeof(uint32_t));
+	output.crc = MZ_CRC32_INIT;
+	VncdPngOutput::put("IDAT", 4, &output);
+	output.written = 0;
+
+	// tdefl_compressor is a few hundred KB, so it comes from the arena when
+	// there is one. It holds no resources, so it is never destroyed.
+
+	std::unique_ptr<tdefl_compressor> ownedCompressor;
+	tdefl_compressor* compressor;
+
+	if (arena) {
+		compressor = static_cast<tdefl_compressor*>(arena->allocate(sizeof(tdefl_compressor)));
+	} else {
+		ownedCompressor.reset(new tdefl_compressor);
+		compressor = ownedCompressor.get();
+	}
+
+	tdefl_init(
+		compressor, &VncdPngOutput::put, &output,
+		tdefl_create_comp_flags_from_zip_params(compressionLevel < 0 ? MZ_DEFAULT_LEVEL : compressionLevel, MZ_DEFAULT_WINDOW_BITS, MZ_DEFAULT_STRATEGY)
+	);
+
+	char scratch[VNCD_ENCODER_SCRATCH_SIZE];
+	size_t piecePixels = (VNCD_ENCODER_SCRATCH_SIZE - 1) / 3;
+
+	for (size_t ypos = y; ypos < (size_t)y + (size_t)h; ++ypos) {
+
+		tdefl_compress_buffer(compressor, "\x00", 1, TDEFL_NO_FLUSH); // row filter: none
+
+		for (size_t xpos = x; xpos < (size_t)x + (size_t)w; xpos += piecePixels) {
+			size_t n = std::min(piecePixels, (size_t)x + (size_t)w - xpos);
+
+			char* nextPos = scratch;
+			const uint8_t* src = framebuffer + ((xpos - originX) + ((ypos - originY) * framebufferWidth)) * 4;
+			for (size_t i = 0; i < n; ++i, src += 4) {
+				*nextPos++ = src[0];
+				*nextPos++ = src[1];
+				*nextPos++ = src[2];
+			}
+
+			tdefl_compress_buffer(compressor, scratch, n * 3, TDEFL_NO_FLUSH);
+		}
+	}
+
+	tdefl_compress_buffer(compressor, nullptr, 0, TDEFL_FINISH);
+
+	uint32_t idat_network = htonl((uint32_t)output.written);
+	message.patch(idatLength, &idat_network, sizeof(uint32_t));
+	appendPngChunkCrc(message, output);
+
+	appendPngChunkHeader(message, output, 0, "IEND");
+	appendPngChunkCrc(message, output);
+
+	patchTightLength(message, lengthField, message.size() - pngStart);
+}
+
+void VncdRectEncoder::encodeTight(VncdBufferChain& message, mz_stream* tightStream, uint8_t streamId, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t resetStreams) {
+
+	appendRectHeader(message, x, y, w, h, VEM_TIGHT);
+
+	if (isSolid(x, y, w, h)) {
+
+		uint8_t fill = 0x80 | (resetStreams & 0x0F);
+		message.append((char*)&fill, 1);
+
+		char tpixel[4] = { 0 };
+		pixelFormat.copyRectTpixel(framebuffer, framebufferWidth, tpixel, (uint16_t)(x - originX), (uint16_t)(y - originY), 1, 1);
+		message.append(tpixel, pixelFormat.tpixelSize());
+		return;
+	}
+
+	// Basic compression, implicit copy filter
+
+	uint8_t control = ((streamId & 0x03) << 4) | (resetStreams & 0x0F);
+	message.append((char*)&control, 1);
+
+	size_t dataSize = (size_t)w * (size_t)h * pixelFormat.tpixelSize();
+
+	if (dataSize < VNCD_TIGHT_MIN_TO_COMPRESS) {
+		// too small to compress, and the stream is left untouched
+		char* dest = message.reserve(dataSize);
+		convertPixels(PK_TPIXEL, dest, x, y, w, h);
+		message.commit(dataSize);
+		return;
+	}
+
+	VncdBufferChain::Placeholder lengthField = tightLengthPlaceholder(message);
+
+	size_t compressed = deflateRect(message, tightStream, PK_TPIXEL, x, y, w, h, MZ_SYNC_FLUSH);
+
+	patchTightLength(message, lengthField, compressed);
+}
+
+void VncdRectEncoder::encodeZrle(VncdBufferChain& message, mz_stream* zrleStream, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	appendRectHeader(message, x, y, w, h, VEM_ZRLE);
+
+	VncdBufferChain::Placeholder lengthField = message.placeholder(sizeof(uint32_t));
+	size_t compressed = 0;
+
+	// Each tile is a raw subencoding byte followed by its CPIXELs. Tiles go
+	// into the stream as they are converted; only the last one is flushed.
+
+	char tile[1 + 64 * 64 * 4];
+	tile[0] = 0;
+
+	for (size_t tile_y = y; tile_y < (size_t)y + (size_t)h; tile_y += 64) {
+		for (size_t tile_x = x; tile_x < (size_t)x + (size_t)w; tile_x += 64) {						
+
+			// start at tile_x,tile_y ;; go to MIN(tile_x + 64, x+w),MIN(tile_y+64, y+h)
+
+			size_t tile_y_max = std::min(tile_y + 64, (size_t)y + (size_t)h);
+			size_t tile_x_max = std::min(tile_x + 64, (size_t)x + (size_t)w);
+			size_t tile_width = tile_x_max - tile_x;
+			size_t tile_height = tile_y_max - tile_y;
+
+			pixelFormat.copyRectCpixel(
+				framebuffer, framebufferWidth, tile + 1,
+				(uint16_t)(tile_x - originX), (uint16_t)(tile_y - originY), (uint16_t)tile_width, (uint16_t)tile_height
+			);
+
+			bool lastTile = (tile_x_max == (size_t)x + (size_t)w) && (tile_y_max == (size_t)y + (size_t)h);
+
+			compressed += message.appendDeflated(
+				zrleStream, tile, 1 + tile_width * tile_height * pixelFormat.cpixelSize(),
+				lastTile ? MZ_SYNC_FLUSH : MZ_NO_FLUSH
+			);
+		}
+	}
+	
+	uint32_t compressed_network = htonl((uint32_t)compressed);
+	message.patch(lengthField, &compressed_network, sizeof(uint32_t));
+}
@@ -0,0 +1,134 @@
+/* VncdRectEncoder.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <string>
+#include <cstdint>
+#include <vector>
+#include "miniz_wrapper.h"
+#include "RFBPixelFormat.hpp"
+#include "VncdBufferChain.hpp"
+#include "VncdArena.hpp"
+
+#define VNCD_TIGHT_STREAMS			4
+#define VNCD_TIGHT_MAX_RECT_WIDTH	2048
+#define VNCD_TIGHT_MAX_RECT_SIZE	65536 // pixels
+#define VNCD_TIGHT_MIN_TO_COMPRESS	12
+#define VNCD_TIGHT_PNG_MAX_PIXELS	(1024 * 1024) // keeps the PNG length within three bytes
+#define VNCD_ENCODER_SCRATCH_SIZE	16384 // pixels are converted this many bytes at a time
+#define VNCD_RECT_HEADER_SIZE		12
+
+struct VncdRect {
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+};
+
+typedef std::vector<VncdRect, VncdArenaAllocator<VncdRect>> VncdRectList;
+
+struct VncdRectCost;
+
+// Encodes rectangles of an RGBX32 framebuffer into FramebufferUpdate rects.
+// Holds copies of everything it needs, so it can be handed to an encoder
+// thread while the connection carries on. Pixels are converted a few KB at a
+// time and compressed straight into the output chain; length prefixes are
+// filled in once the compressed size is known.
+
+class VncdRectEncoder {
+
+public:
+
+	// Large scratch state, such as the PNG compressor, comes from the arena if one is given
+	VncdRectEncoder(uint8_t* framebuffer, uint16_t framebufferWidth, const RFBPixelFormat& pixelFormat, VncdArena* arena = nullptr);
+
+	const RFBPixelFormat& format() const { return pixelFormat; }
+
+	// zlib level for TightPNG, and for the streams the caller passes in
+	void setCompressionLevel(int level) { compressionLevel = level; }
+
+	int level() const { return compressionLevel; }
+
+	// Reads from a copy of an area of the framebuffer, row after row, instead
+	// of the framebuffer itself. Every rect encoded must lie inside the area.
+	void setSource(uint8_t* pixels, const VncdRect& area);
+
+	uint64_t hashRect(uint16_t x, uint16_t y, uint16_t w, uint16_t h) const;
+
+	static void appendUpdateHeader(VncdBufferChain& out, uint16_t numRects);
+
+	static void appendRectHeader(VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint32_t e);
+
+	// Rough cost of a rect in each encoding, for VncdRegion::cover()
+	static VncdRectCost rectCost(uint32_t encoding, const RFBPixelFormat& pixelFormat);
+
+	// Tight limits the size of a single rect; this splits an update into
+	// sub-rects in the order they are to be sent
+	static void splitTightRects(uint16_t x, uint16_t y, uint16_t w, uint16_t h, VncdRectList& out);
+
+	// Each of these appends the rect header followed by the encoded pixels
+
+	void encodeRaw(VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	void encodeZlib(VncdBufferChain& out, mz_stream* zlibStream, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	void encodeTightPng(VncdBufferChain& out, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	void encodeZrle(VncdBufferChain& out, mz_stream* zrleStream, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	// The rect must already fit the Tight limits. Uses fill compression for
+	// solid rects, else basic compression on the given zlib stream (0-3).
+	// Bit i of resetStreams tells the client to reset its inflater for stream i
+	// before decoding the rect.
+	void encodeTight(VncdBufferChain& out, mz_stream* tightStream, uint8_t streamId, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t resetStreams = 0);
+
+protected:
+
+	enum PixelKind { PK_PIXEL, PK_CPIXEL, PK_TPIXEL };
+
+	size_t pixelSize(PixelKind kind);
+
+	void convertPixels(PixelKind kind, char* dest, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	// Converts the rect a scratch buffer at a time and deflates it, ending
+	// with the given flush. Returns the number of compressed bytes.
+	size_t deflateRect(VncdBufferChain& out, mz_stream* stream, PixelKind kind, uint16_t x, uint16_t y, uint16_t w, uint16_t h, int flush);
+
+	// Tight lengths are written in the three byte form so they can be
+	// filled in afterwards
+	static VncdBufferChain::Placeholder tightLengthPlaceholder(VncdBufferChain& out);
+
+	static void patchTightLength(VncdBufferChain& out, const VncdBufferChain::Placeholder& where, size_t len);
+
+	bool isSolid(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	uint8_t* framebuffer;
+
+	uint16_t framebufferWidth;
+
+	uint16_t originX; // of the pixels in the framebuffer
+
+	uint16_t originY;
+
+	RFBPixelFormat pixelFormat;
+
+	VncdArena* arena;
+
+	int compressionLevel;
+
+};
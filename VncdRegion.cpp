@@ -0,0 +1,455 @@
+/* VncdRegion.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdRegion.hpp"
+#include <algorithm>
+#include <climits>
+#include <map>
+
+VncdRegion::VncdRegion() {
+}
+
+VncdRegion::VncdRegion(int32_t x, int32_t y, int32_t w, int32_t h) {
+	if (w > 0 && h > 0) {
+		Box box = { x, y, x + w, y + h };
+		boxes.push_back(box);
+	}
+}
+
+VncdRegion::VncdRegion(const VncdRect& r) :
+	VncdRegion(r.x, r.y, r.w, r.h)
+{
+}
+
+bool VncdRegion::empty() const {
+	return boxes.empty();
+}
+
+void VncdRegion::clear() {
+	boxes.clear();
+}
+
+void VncdRegion::swap(VncdRegion& other) {
+	boxes.swap(other.boxes);
+}
+
+VncdRect VncdRegion::bounds() const {
+
+	VncdRect r = { 0, 0, 0, 0 };
+
+	if (boxes.empty()) {
+		return r;
+	}
+
+	int32_t x1 = INT32_MAX, x2 = INT32_MIN;
+	for (const Box& box : boxes) {
+		x1 = std::min(x1, box.x1);
+		x2 = std::max(x2, box.x2);
+	}
+
+	int32_t y1 = boxes.front().y1, y2 = boxes.back().y2;
+
+	x1 = std::max(x1, 0);
+	y1 = std::max(y1, 0);
+	x2 = std::min(x2, (int32_t)UINT16_MAX);
+	y2 = std::min(y2, (int32_t)UINT16_MAX);
+
+	if (x1 < x2 && y1 < y2) {
+		r.x = (uint16_t)x1;
+		r.y = (uint16_t)y1;
+		r.w = (uint16_t)(x2 - x1);
+		r.h = (uint16_t)(y2 - y1);
+	}
+	return r;
+}
+
+size_t VncdRegion::area() const {
+	size_t pixels = 0;
+	for (const Box& box : boxes) {
+		pixels += (size_t)(box.x2 - box.x1) * (size_t)(box.y2 - box.y1);
+	}
+	return pixels;
+}
+
+size_t VncdRegion::rectCount() const {
+	return boxes.size();
+}
+
+bool VncdRegion::operator==(const VncdRegion& other) const {
+
+	// Bands are kept in a single form, so equal regions have equal boxes
+
+	if (boxes.size() != other.boxes.size()) {
+		return false;
+	}
+
+	for (size_t i = 0; i < boxes.size(); ++i) {
+		const Box& a = boxes[i];
+		const Box& b = other.boxes[i];
+		if (a.x1 != b.x1 || a.y1 != b.y1 || a.x2 != b.x2 || a.y2 != b.y2) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void VncdRegion::unite(const VncdRegion& other) {
+
+	if (other.boxes.empty()) {
+		return;
+	}
+	if (boxes.empty()) {
+		boxes = other.boxes;
+		return;
+	}
+
+	std::vector<Box> result;
+	combine(boxes, other.boxes, VRO_UNION, result);
+	boxes.swap(result);
+}
+
+void VncdRegion::unite(const VncdRect& r) {
+	unite(VncdRegion(r));
+}
+
+void VncdRegion::unite(const std::vector<VncdRect>& rects) {
+
+	// Pairs of regions are joined, then pairs of those, and so on, so each
+	// rect takes part in log(n) unions rather than n
+
+	std::vector<VncdRegion> level;
+	level.reserve(rects.size() + 1);
+	level.push_back(std::move(*this));
+	for (const VncdRect& r : rects) {
+		level.push_back(VncdRegion(r));
+	}
+
+	while (level.size() > 1) {
+		size_t joined = 0;
+		for (size_t i = 0; i < level.size(); i += 2) {
+			if (i + 1 < level.size()) {
+				level[i].unite(level[i + 1]);
+			}
+			if (joined != i) {
+				level[joined] = std::move(level[i]);
+			}
+			++joined;
+		}
+		level.resize(joined);
+	}
+
+	*this = std::move(level[0]);
+}
+
+void VncdRegion::intersect(const VncdRegion& other) {
+
+	if (boxes.empty() || other.boxes.empty()) {
+		boxes.clear();
+		return;
+	}
+
+	std::vector<Box> result;
+	combine(boxes, other.boxes, VRO_INTERSECT, result);
+	boxes.swap(result);
+}
+
+void VncdRegion::subtract(const VncdRegion& other) {
+
+	if (boxes.empty() || other.boxes.empty()) {
+		return;
+	}
+
+	std::vector<Box> result;
+	combine(boxes, other.boxes, VRO_SUBTRACT, result);
+	boxes.swap(result);
+}
+
+void VncdRegion::translate(int32_t dx, int32_t dy) {
+	for (Box& box : boxes) {
+		box.x1 += dx;
+		box.x2 += dx;
+		box.y1 += dy;
+		box.y2 += dy;
+	}
+}
+
+void VncdRegion::rects(std::vector<VncdRect>& out) const {
+
+	for (const Box& box : boxes) {
+		int32_t x1 = std::max(box.x1, 0), y1 = std::max(box.y1, 0);
+		int32_t x2 = std::min(box.x2, (int32_t)UINT16_MAX), y2 = std::min(box.y2, (int32_t)UINT16_MAX);
+
+		if (x1 < x2 && y1 < y2) {
+			VncdRect r = { (uint16_t)x1, (uint16_t)y1, (uint16_t)(x2 - x1), (uint16_t)(y2 - y1) };
+			out.push_back(r);
+		}
+	}
+}
+
+void VncdRegion::cover(const VncdRectCost& cost, std::vector<VncdRect>& out) const {
+
+	// Rects are taken top to bottom, and each joins a nearby one whenever the
+	// pixels that adds cost no more than the rect it saves. Rects further
+	// apart than one rect's worth of pixels can't pay for the gap, so rects
+	// that ended further up are set aside, and the rest are looked up by x.
+
+	double pixelsPerRect = cost.perPixel > 0 ? cost.perRect / cost.perPixel : (double)INT32_MAX;
+	int32_t reach = (int32_t)std::min(pixelsPerRect, (double)INT32_MAX / 4);
+
+	std::multimap<int32_t, Box> active; // by left edge
+	std::vector<Box> done;
+	int32_t widest = 0;
+	int32_t bandTop = INT32_MIN;
+
+	for (const Box& box : boxes) {
+
+		if (box.y1 != bandTop) {
+			bandTop = box.y1;
+			for (std::multimap<int32_t, Box>::iterator it = active.begin(); it != active.end(); ) {
+				if (box.y1 - it->second.y2 > reach) {
+					done.push_back(it->second);
+					it = active.erase(it);
+				} else {
+					++it;
+				}
+			}
+		}
+
+		Box current = box;
+
+		for (bool joined = true; joined; ) {
+			joined = false;
+
+			std::multimap<int32_t, Box>::iterator it = active.lower_bound(current.x1 - reach - widest);
+			for (; it != active.end() && it->first <= current.x2 + reach; ++it) {
+				const Box& other = it->second;
+				Box both = {
+					std::min(current.x1, other.x1), std::min(current.y1, other.y1),
+					std::max(current.x2, other.x2), std::max(current.y2, other.y2)
+				};
+
+				double extra =
+					(double)(both.x2 - both.x1) * (double)(both.y2 - both.y1) -
+					(double)(current.x2 - current.x1) * (double)(current.y2 - current.y1) -
+					(double)(other.x2 - other.x1) * (double)(other.y2 - other.y1);
+
+				if (extra * cost.perPixel <= cost.perRect) {
+					current = both;
+					active.erase(it);
+					joined = true;
+					break;
+				}
+			}
+		}
+
+		widest = std::max(widest, current.x2 - current.x1);
+		active.insert(std::make_pair(current.x1, current));
+	}
+
+	for (const std::pair<const int32_t, Box>& entry : active) {
+		done.push_back(entry.second);
+	}
+
+	VncdRegion covered;
+	covered.boxes.swap(done);
+	std::sort(covered.boxes.begin(), covered.boxes.end(), [](const Box& a, const Box& b) {
+		return a.y1 != b.y1 ? a.y1 < b.y1 : a.x1 < b.x1;
+	});
+	covered.rects(out);
+}
+
+size_t VncdRegion::bandEnd(const std::vector<Box>& boxes, size_t begin) {
+	size_t end = begin + 1;
+	while (end < boxes.size() && boxes[end].y1 == boxes[begin].y1) {
+		++end;
+	}
+	return end;
+}
+
+void VncdRegion::appendBand(std::vector<Box>& out, size_t& lastBand, int32_t y1, int32_t y2, const std::vector<Span>& spans) {
+
+	// Joins the band above if it ends here with the same spans
+
+	if (lastBand < out.size() && out[lastBand].y2 == y1 && out.size() - lastBand == spans.size()) {
+		bool same = true;
+		for (size_t i = 0; i < spans.size() && same; ++i) {
+			same = out[lastBand + i].x1 == spans[i].x1 && out[lastBand + i].x2 == spans[i].x2;
+		}
+
+		if (same) {
+			for (size_t i = lastBand; i < out.size(); ++i) {
+				out[i].y2 = y2;
+			}
+			return;
+		}
+	}
+
+	lastBand = out.size();
+	for (const Span& span : spans) {
+		Box box = { span.x1, y1, span.x2, y2 };
+		out.push_back(box);
+	}
+}
+
+void VncdRegion::combine(const std::vector<Box>& a, const std::vector<Box>& b, Operation op, std::vector<Box>& out) {
+
+	// Walks both regions' bands together, cutting them wherever either starts
+	// or ends, so each piece combines two fixed sets of spans
+
+	out.clear();
+	out.reserve(a.size() + b.size());
+
+	std::vector<Span> spans;
+	size_t lastBand = 0;
+
+	size_t ia = 0, ib = 0;
+
+	// Bands of a that end above b are copied as they are, and so are those
+	// below it once b runs out
+
+	if (op != VRO_INTERSECT && !b.empty()) {
+		while (ia < a.size() && a[ia].y2 <= b[0].y1) {
+			lastBand = ia;
+			ia = bandEnd(a, ia);
+		}
+		out.insert(out.end(), a.begin(), a.begin() + ia);
+	}
+
+	int32_t y = std::min(ia < a.size() ? a[ia].y1 : INT32_MAX, b.empty() ? INT32_MAX : b[0].y1);
+
+	while (ia < a.size() || ib < b.size()) {
+
+		if (ib == b.size() && op != VRO_INTERSECT && a[ia].y1 >= y) {
+			size_t end = bandEnd(a, ia);
+			spans.clear();
+			for (size_t i = ia; i < end; ++i) {
+				Span span = { a[i].x1, a[i].x2 };
+				spans.push_back(span);
+			}
+			appendBand(out, lastBand, a[ia].y1, a[ia].y2, spans); // may join the band above
+			out.insert(out.end(), a.begin() + end, a.end());
+			break;
+		}
+
+		size_t aEnd = ia < a.size() ? bandEnd(a, ia) : ia;
+		size_t bEnd = ib < b.size() ? bandEnd(b, ib) : ib;
+
+		bool aActive = ia < a.size() && a[ia].y1 <= y;
+		bool bActive = ib < b.size() && b[ib].y1 <= y;
+
+		int32_t next = INT32_MAX;
+		if (ia < a.size()) {
+			next = std::min(next, aActive ? a[ia].y2 : a[ia].y1);
+		}
+		if (ib < b.size()) {
+			next = std::min(next, bActive ? b[ib].y2 : b[ib].y1);
+		}
+
+		if (aActive || bActive) {
+			spans.clear();
+			combineSpans(
+				aActive ? &a[ia] : nullptr, aActive ? aEnd - ia : 0,
+				bActive ? &b[ib] : nullptr, bActive ? bEnd - ib : 0,
+				op, spans);
+
+			if (!spans.empty()) {
+				appendBand(out, lastBand, y, next, spans);
+			}
+		}
+
+		y = next;
+
+		if (ia < a.size() && a[ia].y2 <= y) {
+			ia = aEnd;
+		}
+		if (ib < b.size() && b[ib].y2 <= y) {
+			ib = bEnd;
+		}
+
+		if (op != VRO_UNION && ia == a.size()) {
+			break; // nothing left to intersect with or subtract from
+		}
+		if (op == VRO_INTERSECT && ib == b.size()) {
+			break;
+		}
+	}
+}
+
+void VncdRegion::combineSpans(const Box* a, size_t aCount, const Box* b, size_t bCount, Operation op, std::vector<Span>& out) {
+
+	size_t i = 0, j = 0;
+
+	if (op == VRO_UNION) {
+
+		// Merge by left edge, joining spans that overlap or touch
+
+		while (i < aCount || j < bCount) {
+			const Box& next = (j == bCount || (i < aCount && a[i].x1 <= b[j].x1)) ? a[i++] : b[j++];
+
+			if (!out.empty() && next.x1 <= out.back().x2) {
+				out.back().x2 = std::max(out.back().x2, next.x2);
+			} else {
+				Span span = { next.x1, next.x2 };
+				out.push_back(span);
+			}
+		}
+
+	} else if (op == VRO_INTERSECT) {
+
+		while (i < aCount && j < bCount) {
+			int32_t x1 = std::max(a[i].x1, b[j].x1);
+			int32_t x2 = std::min(a[i].x2, b[j].x2);
+
+			if (x1 < x2) {
+				Span span = { x1, x2 };
+				out.push_back(span);
+			}
+
+			if (a[i].x2 < b[j].x2) {
+				++i;
+			} else {
+				++j;
+			}
+		}
+
+	} else {
+
+		for (; i < aCount; ++i) {
+			int32_t x = a[i].x1;
+
+			// Spans of b that end before this one can't reach any later one either
+			while (j < bCount && b[j].x2 <= x) {
+				++j;
+			}
+
+			for (size_t k = j; k < bCount && b[k].x1 < a[i].x2; ++k) {
+				if (b[k].x1 > x) {
+					Span span = { x, b[k].x1 };
+					out.push_back(span);
+				}
+				x = std::max(x, b[k].x2);
+			}
+
+			if (x < a[i].x2) {
+				Span span = { x, a[i].x2 };
+				out.push_back(span);
+			}
+		}
+
+	}
+}
@@ -0,0 +1,116 @@
+/* VncdRegion.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "VncdRectEncoder.hpp"
+
+// What sending a rect costs an encoding, in bytes or the encoder time they
+// stand for: a fixed amount per rect, for its header and the encoder's setup,
+// plus an amount per pixel
+struct VncdRectCost {
+	double perRect;
+	double perPixel;
+};
+
+// A set of pixels, kept as bands: rows of equal height, top to bottom, each
+// holding sorted, disjoint spans. Adjacent bands with the same spans are
+// joined, so a region has a single representation and operations on it walk
+// both operands once. Coordinates may leave the framebuffer while translated;
+// rects() only reports what lies within 0..65535.
+
+class VncdRegion {
+
+public:
+
+	VncdRegion();
+
+	VncdRegion(int32_t x, int32_t y, int32_t w, int32_t h);
+
+	explicit VncdRegion(const VncdRect& r);
+
+	bool empty() const;
+
+	void clear();
+
+	void swap(VncdRegion& other);
+
+	VncdRect bounds() const;
+
+	size_t area() const; // in pixels
+
+	size_t rectCount() const;
+
+	bool operator==(const VncdRegion& other) const;
+
+	void unite(const VncdRegion& other);
+
+	void unite(const VncdRect& r);
+
+	// Much faster than adding many rects one at a time
+	void unite(const std::vector<VncdRect>& rects);
+
+	void intersect(const VncdRegion& other);
+
+	void subtract(const VncdRegion& other);
+
+	void translate(int32_t dx, int32_t dy);
+
+	// The bands' rects, top to bottom and left to right
+	void rects(std::vector<VncdRect>& out) const;
+
+	// Rects covering the region for an encoding with the given costs. Rects
+	// close together are sent as one whenever the pixels between them cost
+	// less than another rect, so the result lies between the exact rects and
+	// the bounding box, whichever is cheaper where.
+	void cover(const VncdRectCost& cost, std::vector<VncdRect>& out) const;
+
+protected:
+
+	// Half open. Every box of a band has the same y1 and y2.
+	struct Box {
+		int32_t x1;
+		int32_t y1;
+		int32_t x2;
+		int32_t y2;
+	};
+
+	struct Span {
+		int32_t x1;
+		int32_t x2;
+	};
+
+	enum Operation {
+		VRO_UNION,
+		VRO_INTERSECT,
+		VRO_SUBTRACT
+	};
+
+	std::vector<Box> boxes;
+
+	static void combine(const std::vector<Box>& a, const std::vector<Box>& b, Operation op, std::vector<Box>& out);
+
+	static void combineSpans(const Box* a, size_t aCount, const Box* b, size_t bCount, Operation op, std::vector<Span>& out);
+
+	static size_t bandEnd(const std::vector<Box>& boxes, size_t begin);
+
+	static void appendBand(std::vector<Box>& out, size_t& lastBand, int32_t y1, int32_t y2, const std::vector<Span>& spans);
+
+};
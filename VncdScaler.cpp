@@ -0,0 +1,148 @@
+/* VncdScaler.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdScaler.hpp"
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define VNCD_HAS_SSE2 1
+#else
+	#define VNCD_HAS_SSE2 0
+#endif
+
+VncdScaler::VncdScaler() :
+	srcWidth(0),
+	srcHeight(0),
+	scaledWidth(0),
+	scaledHeight(0),
+	factor(1)
+{
+}
+
+void VncdScaler::setSource(uint16_t sourceWidth, uint16_t sourceHeight, unsigned divisor) {
+
+	factor = std::max(1u, divisor);
+	srcWidth = sourceWidth;
+	srcHeight = sourceHeight;
+	scaledWidth = (uint16_t)((sourceWidth + factor - 1) / factor);
+	scaledHeight = (uint16_t)((sourceHeight + factor - 1) / factor);
+
+	if (factor == 1) {
+		std::vector<uint8_t>().swap(pixels);
+	} else {
+		pixels.resize((size_t)scaledWidth * scaledHeight * 4);
+		pixels.shrink_to_fit();
+	}
+}
+
+bool VncdScaler::mapRect(uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h) const {
+
+	size_t right = std::min(((size_t)x + w + factor - 1) / factor, (size_t)scaledWidth);
+	size_t bottom = std::min(((size_t)y + h + factor - 1) / factor, (size_t)scaledHeight);
+	size_t left = x / factor, top = y / factor;
+
+	if (left >= right || top >= bottom) {
+		return false;
+	}
+
+	x = (uint16_t)left;
+	y = (uint16_t)top;
+	w = (uint16_t)(right - left);
+	h = (uint16_t)(bottom - top);
+	return true;
+}
+
+void VncdScaler::mapPoint(uint16_t& x, uint16_t& y) const {
+	if (srcWidth && srcHeight) {
+		x = (uint16_t)std::min((size_t)x * factor + factor / 2, (size_t)srcWidth - 1);
+		y = (uint16_t)std::min((size_t)y * factor + factor / 2, (size_t)srcHeight - 1);
+	}
+}
+
+void VncdScaler::resample(const uint8_t* source, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	if (factor == 1) {
+		return;
+	}
+
+	for (size_t row = y; row < (size_t)y + h; ++row) {
+		uint8_t* dest = pixels.data() + (row * scaledWidth + x) * 4;
+		size_t column = x;
+
+#if VNCD_HAS_SSE2
+
+		// The common halving, two output pixels at a time: widen both source
+		// rows to 16 bits, add them, add neighbouring pixels, round and narrow
+
+		if (factor == 2 && row * 2 + 1 < srcHeight) {
+			const __m128i zero = _mm_setzero_si128();
+			const __m128i two = _mm_set1_epi16(2);
+
+			const uint8_t* top = source + (row * 2 * srcWidth) * 4;
+			const uint8_t* bottom = top + (size_t)srcWidth * 4;
+
+			for (; column + 2 <= (size_t)x + w && column * 2 + 4 <= srcWidth; column += 2, dest += 8) {
+				__m128i a = _mm_loadu_si128((const __m128i*)(top + column * 8));
+				__m128i b = _mm_loadu_si128((const __m128i*)(bottom + column * 8));
+
+				__m128i low = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+				__m128i high = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+				low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+				high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+
+				__m128i sum = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(low, high), two), 2);
+				_mm_storel_epi64((__m128i*)dest, _mm_packus_epi16(sum, zero));
+			}
+		}
+
+#endif
+
+		for (; column < (size_t)x + w; ++column, dest += 4) {
+			resampleBox(source, (uint16_t)column, (uint16_t)row, dest);
+		}
+	}
+}
+
+void VncdScaler::resampleBox(const uint8_t* source, uint16_t x, uint16_t y, uint8_t* dest) {
+
+	size_t left = (size_t)x * factor, right = std::min(left + factor, (size_t)srcWidth);
+	size_t top = (size_t)y * factor, bottom = std::min(top + factor, (size_t)srcHeight);
+
+	uint32_t sum[4] = { 0 };
+
+	for (size_t row = top; row < bottom; ++row) {
+		const uint8_t* src = source + (row * srcWidth + left) * 4;
+		for (size_t column = left; column < right; ++column, src += 4) {
+			sum[0] += src[0];
+			sum[1] += src[1];
+			sum[2] += src[2];
+			sum[3] += src[3];
+		}
+	}
+
+	uint32_t count = (uint32_t)((right - left) * (bottom - top));
+	for (int i = 0; i < 4; ++i) {
+		dest[i] = (uint8_t)((sum[i] + count / 2) / count);
+	}
+}
+
+size_t VncdScaler::memoryUsage() const {
+	return pixels.capacity();
+}
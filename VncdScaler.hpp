@@ -0,0 +1,80 @@
+/* VncdScaler.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+
+// A copy of an RGBX32 framebuffer reduced by a whole factor each way, each
+// pixel the average of the box it replaces. Boxes cut short by the right or
+// bottom edge are averaged over the pixels they have. A factor of 1 keeps no
+// copy; the source is used as it is.
+
+class VncdScaler : public asio::noncopyable {
+
+public:
+
+	VncdScaler();
+
+	// Resizes the copy; its contents are undefined until resampled
+	void setSource(uint16_t sourceWidth, uint16_t sourceHeight, unsigned divisor);
+
+	unsigned divisor() const { return factor; }
+
+	uint16_t sourceWidth() const { return srcWidth; }
+
+	uint16_t sourceHeight() const { return srcHeight; }
+
+	uint16_t width() const { return scaledWidth; }
+
+	uint16_t height() const { return scaledHeight; }
+
+	uint8_t* data() { return pixels.data(); }
+
+	// Turns a source rect into the scaled rect covering it. Returns false if
+	// that is empty.
+	bool mapRect(uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h) const;
+
+	// Turns a scaled position into the source position at the centre of its box
+	void mapPoint(uint16_t& x, uint16_t& y) const;
+
+	// Recomputes a rect of the copy, in scaled coordinates, from the source
+	void resample(const uint8_t* source, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	size_t memoryUsage() const;
+
+protected:
+
+	void resampleBox(const uint8_t* source, uint16_t x, uint16_t y, uint8_t* dest);
+
+	std::vector<uint8_t> pixels;
+
+	uint16_t srcWidth;
+
+	uint16_t srcHeight;
+
+	uint16_t scaledWidth;
+
+	uint16_t scaledHeight;
+
+	unsigned factor;
+
+};
@@ -0,0 +1,131 @@
+/* VncdSharedFramebuffer.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdSharedFramebuffer.hpp"
+#include <algorithm>
+
+static std::atomic<uint64_t> nextIdentity(1); // 0 stands for no framebuffer
+
+VncdSharedFramebuffer::VncdSharedFramebuffer(uint16_t width, uint16_t height) :
+	identity(nextIdentity++),
+	version(0),
+	width(0),
+	height(0),
+	columns(0),
+	rows(0)
+{
+	if (width && height) {
+		resize(width, height);
+	}
+}
+
+void VncdSharedFramebuffer::resize(uint16_t newWidth, uint16_t newHeight) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	uint64_t changed = ++version;
+
+	width = newWidth;
+	height = newHeight;
+	columns = (width + VNCD_DAMAGE_TILE_SIZE - 1) / VNCD_DAMAGE_TILE_SIZE;
+	rows = (height + VNCD_DAMAGE_TILE_SIZE - 1) / VNCD_DAMAGE_TILE_SIZE;
+
+	tileVersions.assign(columns * rows, changed);
+	rowVersions.assign(rows, changed);
+}
+
+void VncdSharedFramebuffer::damage(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	// Bumped under the lock, so a reader that sees this version also sees
+	// the tiles it changed
+
+	uint64_t changed = ++version;
+
+	if (x >= width || y >= height || !w || !h) {
+		return;
+	}
+
+	size_t lastColumn = (std::min((size_t)x + w, (size_t)width) - 1) / VNCD_DAMAGE_TILE_SIZE;
+	size_t lastRow = (std::min((size_t)y + h, (size_t)height) - 1) / VNCD_DAMAGE_TILE_SIZE;
+
+	for (size_t row = y / VNCD_DAMAGE_TILE_SIZE; row <= lastRow; ++row) {
+		uint64_t* tile = &tileVersions[row * columns];
+		for (size_t column = x / VNCD_DAMAGE_TILE_SIZE; column <= lastColumn; ++column) {
+			tile[column] = changed;
+		}
+		rowVersions[row] = changed;
+	}
+}
+
+uint64_t VncdSharedFramebuffer::damageSince(uint64_t sentVersion, std::vector<VncdRect>& out) {
+
+	std::lock_guard<std::mutex> guard(lock);
+
+	// Runs of changed tiles in a row become one rect, which grows downwards
+	// while the rows below have a run in the same place
+
+	openRects.clear();
+
+	for (size_t row = 0; row < rows; ++row) {
+		nextOpenRects.clear();
+
+		if (rowVersions[row] > sentVersion) {
+			const uint64_t* tile = &tileVersions[row * columns];
+			size_t open = 0;
+
+			for (size_t column = 0; column < columns; ) {
+				if (tile[column] <= sentVersion) {
+					++column;
+					continue;
+				}
+
+				size_t end = column + 1;
+				while (end < columns && tile[end] > sentVersion) {
+					++end;
+				}
+
+				VncdRect r;
+				r.x = (uint16_t)(column * VNCD_DAMAGE_TILE_SIZE);
+				r.y = (uint16_t)(row * VNCD_DAMAGE_TILE_SIZE);
+				r.w = (uint16_t)(std::min(end * VNCD_DAMAGE_TILE_SIZE, (size_t)width) - r.x);
+				r.h = (uint16_t)(std::min((row + 1) * VNCD_DAMAGE_TILE_SIZE, (size_t)height) - r.y);
+
+				// Both rows' runs are in order of x
+				while (open < openRects.size() && out[openRects[open]].x < r.x) {
+					++open;
+				}
+
+				if (open < openRects.size() && out[openRects[open]].x == r.x && out[openRects[open]].w == r.w) {
+					out[openRects[open]].h += r.h;
+					nextOpenRects.push_back(openRects[open]);
+				} else {
+					nextOpenRects.push_back(out.size());
+					out.push_back(r);
+				}
+
+				column = end;
+			}
+		}
+
+		openRects.swap(nextOpenRects);
+	}
+
+	return version;
+}
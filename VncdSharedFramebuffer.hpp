@@ -0,0 +1,97 @@
+/* VncdSharedFramebuffer.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+#include "VncdRectEncoder.hpp"
+
+#define VNCD_DAMAGE_TILE_SIZE	64 // pixels square, the same tiles as VncdTileHashes
+
+// A framebuffer shown to several connections. The application bumps the
+// version whenever it changes the pixels, before notifying the connections;
+// rects encoded from the same version can then be shared between them.
+//
+// If it reports the changed rects through damage() instead, each tile also
+// remembers the version that last changed it. A connection then only has to
+// remember the version it last sent, and asks for the tiles changed since,
+// however far behind it is; nothing is stored per connection.
+
+class VncdSharedFramebuffer : public asio::noncopyable {
+
+public:
+
+	VncdSharedFramebuffer(uint16_t width = 0, uint16_t height = 0);
+
+	void contentChanged() {
+		++version;
+	}
+
+	uint64_t currentVersion() const {
+		return version;
+	}
+
+	// Unique for the life of the process, unlike the framebuffer's address
+	uint64_t id() const {
+		return identity;
+	}
+
+	// Starts over with every tile changed
+	void resize(uint16_t width, uint16_t height);
+
+	// Marks the tiles under the rect changed, as a new version
+	void damage(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	// Appends the tiles changed after the given version, merged into rects, and
+	// returns the version they bring the caller up to. Every row of tiles with
+	// a change is scanned across its whole width, so this takes time in
+	// proportion to dirty rows times columns, plus one check per row.
+	uint64_t damageSince(uint64_t sentVersion, std::vector<VncdRect>& out);
+
+protected:
+
+	const uint64_t identity;
+
+	std::atomic<uint64_t> version;
+
+	std::mutex lock; // guards the tiles, not the version
+
+	uint16_t width;
+
+	uint16_t height;
+
+	size_t columns;
+
+	size_t rows;
+
+	std::vector<uint64_t> tileVersions;
+
+	// Newest version of any tile in the row, so unchanged rows are skipped
+	std::vector<uint64_t> rowVersions;
+
+	// Indexes into damageSince()'s output of the rects that may still grow
+	std::vector<size_t> openRects;
+
+	std::vector<size_t> nextOpenRects;
+
+};
@@ -0,0 +1,111 @@
+/* VncdTileHashes.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdTileHashes.hpp"
+#include <algorithm>
+#include <cstring>
+#include "VncdHash.hpp"
+
+VncdTileHashes::VncdTileHashes() :
+	width(0),
+	height(0),
+	columns(0),
+	rows(0)
+{
+}
+
+void VncdTileHashes::snapshot(const uint8_t* framebuffer, uint16_t framebufferWidth, const VncdRect& area, std::vector<uint8_t>& out) {
+
+	size_t rowBytes = (size_t)area.w * 4;
+	out.resize(rowBytes * area.h);
+
+	for (size_t row = 0; row < area.h; ++row) {
+		memcpy(&out[row * rowBytes], framebuffer + (area.x + (area.y + row) * framebufferWidth) * 4, rowBytes);
+	}
+}
+
+bool VncdTileHashes::filter(const uint8_t* pixels, const VncdRect& area, uint16_t framebufferWidth, uint16_t framebufferHeight,
+	uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h, bool force) {
+
+	if (framebufferWidth != width || framebufferHeight != height) {
+		width = framebufferWidth;
+		height = framebufferHeight;
+		columns = (width + VNCD_SHADOW_TILE_SIZE - 1) / VNCD_SHADOW_TILE_SIZE;
+		rows = (height + VNCD_SHADOW_TILE_SIZE - 1) / VNCD_SHADOW_TILE_SIZE;
+		hashes.assign(columns * rows, 0);
+		hashes.shrink_to_fit();
+	}
+
+	size_t firstColumn = x / VNCD_SHADOW_TILE_SIZE, lastColumn = ((size_t)x + w - 1) / VNCD_SHADOW_TILE_SIZE;
+	size_t firstRow = y / VNCD_SHADOW_TILE_SIZE, lastRow = ((size_t)y + h - 1) / VNCD_SHADOW_TILE_SIZE;
+
+	size_t left = columns, right = 0, top = rows, bottom = 0;
+
+	for (size_t row = firstRow; row <= lastRow; ++row) {
+		uint16_t tile_y = (uint16_t)(row * VNCD_SHADOW_TILE_SIZE);
+		uint16_t tile_h = (uint16_t)std::min((size_t)VNCD_SHADOW_TILE_SIZE, (size_t)height - tile_y);
+
+		for (size_t column = firstColumn; column <= lastColumn; ++column) {
+			uint16_t tile_x = (uint16_t)(column * VNCD_SHADOW_TILE_SIZE);
+			uint16_t tile_w = (uint16_t)std::min((size_t)VNCD_SHADOW_TILE_SIZE, (size_t)width - tile_x);
+
+			uint64_t hash = vncdHashRect(pixels, area.w, (uint16_t)(tile_x - area.x), (uint16_t)(tile_y - area.y), tile_w, tile_h);
+			if (!hash) {
+				hash = 1; // keep 0 for unknown
+			}
+
+			uint64_t& sent = hashes[row * columns + column];
+			if (hash == sent && !force) {
+				continue;
+			}
+			sent = hash;
+
+			left = std::min(left, column);
+			right = std::max(right, column);
+			top = std::min(top, row);
+			bottom = std::max(bottom, row);
+		}
+	}
+
+	if (left > right) {
+		return false;
+	}
+
+	x = (uint16_t)(left * VNCD_SHADOW_TILE_SIZE);
+	y = (uint16_t)(top * VNCD_SHADOW_TILE_SIZE);
+	w = (uint16_t)(std::min((right + 1) * VNCD_SHADOW_TILE_SIZE, (size_t)width) - x);
+	h = (uint16_t)(std::min((bottom + 1) * VNCD_SHADOW_TILE_SIZE, (size_t)height) - y);
+	return true;
+}
+
+void VncdTileHashes::alignToTiles(uint16_t framebufferWidth, uint16_t framebufferHeight, uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h) {
+	size_t right = std::min(((size_t)x + w + VNCD_SHADOW_TILE_SIZE - 1) / VNCD_SHADOW_TILE_SIZE * VNCD_SHADOW_TILE_SIZE, (size_t)framebufferWidth);
+	size_t bottom = std::min(((size_t)y + h + VNCD_SHADOW_TILE_SIZE - 1) / VNCD_SHADOW_TILE_SIZE * VNCD_SHADOW_TILE_SIZE, (size_t)framebufferHeight);
+	x = x / VNCD_SHADOW_TILE_SIZE * VNCD_SHADOW_TILE_SIZE;
+	y = y / VNCD_SHADOW_TILE_SIZE * VNCD_SHADOW_TILE_SIZE;
+	w = (uint16_t)(right - x);
+	h = (uint16_t)(bottom - y);
+}
+
+void VncdTileHashes::clear() {
+	std::fill(hashes.begin(), hashes.end(), 0);
+}
+
+size_t VncdTileHashes::memoryUsage() const {
+	return hashes.capacity() * sizeof(uint64_t);
+}
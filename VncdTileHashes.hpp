@@ -0,0 +1,69 @@
+/* VncdTileHashes.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "VncdRectEncoder.hpp"
+
+#define VNCD_SHADOW_TILE_SIZE	64 // pixels square; 16 KB of hashes for a 4K framebuffer
+
+// What a client was last sent, as one 64-bit hash per tile rather than a copy
+// of the pixels. Damage whose tiles hash the same as before is dropped.
+
+class VncdTileHashes {
+
+public:
+
+	VncdTileHashes();
+
+	// Copies an area of the framebuffer, row after row. Updates are filtered
+	// and encoded from the copy, so the client gets exactly the pixels whose
+	// hashes were recorded, whatever the application draws meanwhile.
+	static void snapshot(const uint8_t* framebuffer, uint16_t framebufferWidth, const VncdRect& area, std::vector<uint8_t>& out);
+
+	// Hashes the tiles under the rect and keeps those that differ from what was
+	// last sent, or all of them if force is set. The rect becomes the bounding
+	// box of those tiles, which are recorded as sent. Returns false if nothing
+	// changed. Whole tiles are sent so every recorded hash matches the client.
+	// The pixels are a snapshot() of an area holding those whole tiles.
+	bool filter(const uint8_t* pixels, const VncdRect& area, uint16_t framebufferWidth, uint16_t framebufferHeight,
+		uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h, bool force);
+
+	// Grows the rect to the whole tiles under it, as filter() does
+	static void alignToTiles(uint16_t framebufferWidth, uint16_t framebufferHeight, uint16_t& x, uint16_t& y, uint16_t& w, uint16_t& h);
+
+	// Forgets everything, e.g. when the client's picture came from elsewhere
+	void clear();
+
+	size_t memoryUsage() const;
+
+protected:
+
+	std::vector<uint64_t> hashes; // 0 = unknown
+
+	uint16_t width;
+
+	uint16_t height;
+
+	size_t columns;
+
+	size_t rows;
+
+};
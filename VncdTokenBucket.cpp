@@ -0,0 +1,81 @@
+/* VncdTokenBucket.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdTokenBucket.hpp"
+#include <algorithm>
+
+VncdTokenBucket::VncdTokenBucket() :
+	bytesPerSecond(0),
+	burst(0),
+	tokens(0),
+	lastRefill(Clock::now())
+{
+}
+
+void VncdTokenBucket::setRate(size_t bytesPerSecond, size_t burst) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (!burst) {
+		burst = std::max((size_t)VNCD_TOKEN_BUCKET_MIN_BURST, (size_t)((uint64_t)bytesPerSecond * VNCD_TOKEN_BUCKET_BURST_MS / 1000));
+	}
+
+	if (bytesPerSecond != this->bytesPerSecond || burst != this->burst) {
+		refill(Clock::now());
+		this->burst = (double)burst;
+		tokens = this->bytesPerSecond ? std::min(tokens, this->burst) : this->burst; // starts full
+		this->bytesPerSecond = bytesPerSecond;
+	}
+}
+
+size_t VncdTokenBucket::rate() const {
+	std::lock_guard<std::mutex> lock(mutex);
+	return bytesPerSecond;
+}
+
+VncdTokenBucket::Clock::duration VncdTokenBucket::delay() {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (!bytesPerSecond) {
+		return Clock::duration::zero();
+	}
+
+	Clock::time_point now = Clock::now();
+	refill(now);
+
+	if (tokens >= 0) {
+		return Clock::duration::zero();
+	}
+
+	std::chrono::duration<double> seconds(-tokens / bytesPerSecond);
+	return std::max(std::chrono::duration_cast<Clock::duration>(seconds), Clock::duration(1));
+}
+
+void VncdTokenBucket::take(size_t bytes) {
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (bytesPerSecond) {
+		tokens -= (double)bytes;
+	}
+}
+
+void VncdTokenBucket::refill(Clock::time_point now) {
+	if (now > lastRefill) {
+		tokens = std::min(burst, tokens + std::chrono::duration<double>(now - lastRefill).count() * bytesPerSecond);
+	}
+	lastRefill = now;
+}
@@ -0,0 +1,68 @@
+/* VncdTokenBucket.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <chrono>
+#include <mutex>
+#include "asio_wrapper.h"
+#include "asio/asio/detail/noncopyable.hpp"
+
+#define VNCD_TOKEN_BUCKET_MIN_BURST	(64 * 1024)
+#define VNCD_TOKEN_BUCKET_BURST_MS	100 // of the rate, when it is more than the minimum
+
+// A bandwidth quota. Tokens refill at the rate, up to the burst size, and
+// sending takes as many as it has bytes. A message may take the bucket into
+// debt, so one larger than the burst still goes out; the next waits until the
+// debt is paid off. Safe to share between connections on any thread.
+
+class VncdTokenBucket : public asio::noncopyable {
+
+public:
+
+	typedef std::chrono::steady_clock Clock;
+
+	VncdTokenBucket();
+
+	// Zero removes the limit. The burst defaults to VNCD_TOKEN_BUCKET_BURST_MS
+	// worth of the rate.
+	void setRate(size_t bytesPerSecond, size_t burst = 0);
+
+	size_t rate() const;
+
+	// How long until the bucket is out of debt; zero if sending may go ahead
+	Clock::duration delay();
+
+	void take(size_t bytes);
+
+protected:
+
+	void refill(Clock::time_point now);
+
+	mutable std::mutex mutex;
+
+	size_t bytesPerSecond;
+
+	double burst;
+
+	double tokens; // negative while in debt
+
+	Clock::time_point lastRefill;
+
+};
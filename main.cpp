@@ -22,6 +22,13 @@
 int main(int argc, char** argv) {
 	
 	Vncd<SampleVncdConnection> v;
+
+	// To run the io_service on several threads instead:
+	// Vncd<SampleVncdConnection> v(std::thread::hardware_concurrency());
+
+	// Or, for many connections, one shard per core, each with its own acceptor
+	// on the same port and all encoding done on the shard's own thread:
+	// Vncd<SampleVncdConnection> v(1, VNCD_ENCODE_INLINE, std::thread::hardware_concurrency());
 	
 	v.acceptConnections("0.0.0.0", 5900);
 
@@ -0,0 +1,117 @@
+/* AllocationTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks that once a connection has warmed up, its updates are built without
+// going to the heap: VncdConnection::heapAllocations() must not move.
+// Usage: AllocationTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define WARMUP_UPDATES	20
+#define TESTED_UPDATES	200
+
+struct TestCase {
+	const char* name;
+	int32_t encoding;
+};
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<VncdTestConnection> server;
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	TestCase testCases[] = {
+		{ "Raw", VEM_RAW },
+		{ "Zlib", VEM_ZLIB },
+		{ "ZRLE", VEM_ZRLE }
+	};
+
+	int failures = 0;
+
+	for (TestCase& testCase : testCases) {
+
+		// The previous case's connection has to be gone, so the one found
+		// below is ours
+		while (server.connectionCount() != 0) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		asio::io_service clientService;
+		std::unique_ptr<VncdTestClient> client;
+
+		for (int attempt = 0; !client; ++attempt) {
+			try {
+				client.reset(new VncdTestClient(clientService, port));
+			} catch (asio::system_error&) {
+				if (attempt == 50) {
+					throw; // the server never came up
+				}
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			}
+		}
+
+		client->setEncodings(std::vector<int32_t>(1, testCase.encoding));
+		client->requestUpdate(false);
+		client->readUpdate();
+
+		std::shared_ptr<VncdTestConnection> connection;
+		server.forEachConnection([&connection](const std::shared_ptr<VncdTestConnection>& c) {
+			connection = c;
+		});
+
+		// The client may have read an update before the server hears that the
+		// write completed, and damage arriving in between needs more buffers
+		// than the steady state. Each update is sent only once the last one's
+		// buffers are back, so the count depends on the updates, not on timing.
+
+		uint8_t phase = 0;
+		size_t before = 0;
+
+		for (int i = 0; i < WARMUP_UPDATES + TESTED_UPDATES; ++i) {
+			if (i == WARMUP_UPDATES) {
+				before = connection->heapAllocations();
+			}
+
+			connection->waitUntilSent();
+			connection->repaint(++phase);
+			client->readUpdate();
+		}
+
+		size_t allocations = connection->heapAllocations() - before;
+
+		std::cout << testCase.name << ": " << allocations << " heap allocations in " << TESTED_UPDATES << " updates"
+			<< (allocations ? " FAILED" : "") << std::endl;
+
+		if (allocations) {
+			++failures;
+		}
+	}
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/* BroadcastTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks how viewers of one VncdSharedFramebuffer move between broadcast
+// groups: they join a group once their own first update is out, leave it when
+// they change encoding and join one for the new encoding, drop it when they
+// disconnect, and a viewer that stops reading is moved to a slower tier while
+// the others stay where they are.
+// Usage: BroadcastTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define VIEWERS			3
+#define MAX_UPDATES		100 // for the slow viewer to fall far enough behind
+
+typedef std::vector<std::shared_ptr<VncdTestSharedConnection>> Connections;
+
+static Connections connectionsOf(Vncd<VncdTestSharedConnection>& server) {
+	Connections connections;
+	server.forEachConnection([&connections](const std::shared_ptr<VncdTestSharedConnection>& c) {
+		connections.push_back(c);
+	});
+	return connections;
+}
+
+static size_t countInTier(const Connections& connections, int tier) {
+	size_t count = 0;
+	for (const std::shared_ptr<VncdTestSharedConnection>& c : connections) {
+		if (c->broadcastTier() == tier) {
+			++count;
+		}
+	}
+	return count;
+}
+
+// Polls for up to five seconds
+template <typename Condition>
+static bool waitFor(Condition condition) {
+	for (int i = 0; i < 500; ++i) {
+		if (condition()) {
+			return true;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	return false;
+}
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+	std::cout << what << (passed ? "" : " FAILED") << std::endl;
+	if (!passed) {
+		++failures;
+	}
+}
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<VncdTestSharedConnection> server;
+	server.broadcastMode = true;
+
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	uint8_t phase = 0;
+	VncdTestSharedConnection::repaintShared(phase);
+
+	asio::io_service clientService;
+	std::vector<std::unique_ptr<VncdTestClient>> clients;
+
+	for (int i = 0; i < VIEWERS; ++i) {
+		clients.push_back(VncdTestClient::connect(clientService, port));
+		clients.back()->setEncodings(std::vector<int32_t>(1, VEM_RAW));
+		clients.back()->requestUpdate(false);
+		clients.back()->readUpdate();
+	}
+
+	Connections connections = connectionsOf(server);
+
+	auto repaint = [&server, &phase]() {
+		VncdTestSharedConnection::repaintShared(++phase);
+		server.forEachConnection([](const std::shared_ptr<VncdTestSharedConnection>& c) {
+			c->notifyClient_regionUpdated(0, 0, VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT);
+		});
+	};
+
+	check(waitFor([&]() { return countInTier(connections, 0) == VIEWERS && server.broadcasts.groupCount() == 1; }),
+		"Every viewer joins one group after its first update");
+
+	repaint();
+	bool delivered = true;
+	for (std::unique_ptr<VncdTestClient>& client : clients) {
+		client->readUpdate();
+		delivered = delivered && client->rects.size() == 1 && client->rects[0].w == VNCD_TEST_WIDTH;
+	}
+	check(delivered, "The group sends every member the same update");
+
+	// A viewer that changes encoding gets its next update from itself, and
+	// then joins a group for its new encoding
+
+	clients[VIEWERS - 1]->setEncodings(std::vector<int32_t>(1, VEM_ZLIB));
+	check(waitFor([&]() { return countInTier(connections, -1) == 1; }), "A viewer that changes encoding leaves its group");
+
+	repaint();
+	for (std::unique_ptr<VncdTestClient>& client : clients) {
+		client->readUpdate();
+	}
+	check(waitFor([&]() { return countInTier(connections, 0) == VIEWERS && server.broadcasts.groupCount() == 2; }),
+		"It joins a group for its new encoding");
+
+	clients.pop_back();
+	check(waitFor([&]() { return server.connectionCount() == VIEWERS - 1 && server.broadcasts.groupCount() == 1; }),
+		"The group of a viewer that disconnects alone is dropped");
+
+	connections = connectionsOf(server);
+
+	// The last viewer stops reading; only the first keeps up
+
+	size_t updates = 0;
+	while (updates < MAX_UPDATES && countInTier(connections, 0) == connections.size()) {
+		repaint();
+		clients[0]->readUpdate();
+		++updates;
+	}
+
+	// It may go down more than one tier at once, if it is still too far
+	// behind for the first slower one
+
+	check(countInTier(connections, 0) == 1 && countInTier(connections, -1) == 0 && server.broadcasts.groupCount() == 2,
+		"A viewer that stops reading moves to a slower tier, and only that one");
+
+	std::cout << "Demoted after " << updates << " updates" << std::endl;
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+/* ContinuousUpdatesTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks the ContinuousUpdates handshake. A client that lists the
+// pseudo-encoding is sent EndOfContinuousUpdates to say the server supports
+// it. Once enabled, only damage inside the given area is pushed; disabling
+// ends with another EndOfContinuousUpdates, after which all damage is sent
+// again. A client that enables it without listing it first is disconnected.
+// Usage: ContinuousUpdatesTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define TILE		VNCD_SHADOW_TILE_SIZE
+#define AREA_W		(5 * TILE)
+#define AREA_H		(4 * TILE)
+#define OUTSIDE_X	(9 * TILE) // a whole tile, outside the area
+#define OUTSIDE_Y	(6 * TILE)
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+	std::cout << what << (passed ? "" : " FAILED") << std::endl;
+	if (!passed) {
+		++failures;
+	}
+}
+
+static bool onlyRect(const VncdTestClient& client, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+	return client.rects.size() == 1 && client.rects[0].x == x && client.rects[0].y == y && client.rects[0].w == w && client.rects[0].h == h;
+}
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<VncdTestConnection> server;
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	asio::io_service clientService;
+	std::unique_ptr<VncdTestClient> client = VncdTestClient::connect(clientService, port);
+
+	std::vector<int32_t> encodings;
+	encodings.push_back(VEM_RAW);
+	encodings.push_back(VEM_CONTINUOUS_UPDATES);
+	client->setEncodings(encodings);
+
+	std::shared_ptr<VncdTestConnection> connection;
+	server.forEachConnection([&connection](const std::shared_ptr<VncdTestConnection>& c) {
+		connection = c;
+	});
+
+	check(client->readMessage() == 150, "Listing ContinuousUpdates brings EndOfContinuousUpdates");
+
+	client->requestUpdate(false);
+	client->readUpdate();
+
+	// Messages are handled in order, so once the refresh asked for after
+	// enabling arrives, the server has enabled continuous updates
+
+	client->enableContinuousUpdates(true, 0, 0, AREA_W, AREA_H);
+	client->requestUpdate(false);
+	client->readUpdate();
+
+	uint8_t phase = 0;
+	connection->repaint(++phase);
+	client->readUpdate();
+
+	uint32_t right = 0, bottom = 0;
+	for (const VncdRect& r : client->rects) {
+		right = std::max(right, (uint32_t)r.x + r.w);
+		bottom = std::max(bottom, (uint32_t)r.y + r.h);
+	}
+	check(right == AREA_W && bottom == AREA_H, "Damage to the whole framebuffer is clipped to the area");
+
+	// Damage outside the area is dropped, so the next update is the one
+	// inside it
+
+	connection->fill(OUTSIDE_X, OUTSIDE_Y, TILE, TILE, 0x40);
+	connection->notifyClient_regionUpdated(OUTSIDE_X, OUTSIDE_Y, TILE, TILE);
+	connection->fill(0, 0, TILE, TILE, 0x40);
+	connection->notifyClient_regionUpdated(0, 0, TILE, TILE);
+	client->readUpdate();
+	check(onlyRect(*client, 0, 0, TILE, TILE), "Damage outside the area is not sent");
+
+	client->enableContinuousUpdates(false, 0, 0, AREA_W, AREA_H);
+	check(client->readMessage() == 150, "Disabling brings EndOfContinuousUpdates");
+
+	connection->fill(OUTSIDE_X, OUTSIDE_Y, TILE, TILE, 0xC0);
+	connection->notifyClient_regionUpdated(OUTSIDE_X, OUTSIDE_Y, TILE, TILE);
+	client->readUpdate();
+	check(onlyRect(*client, OUTSIDE_X, OUTSIDE_Y, TILE, TILE), "Once disabled, damage anywhere is sent");
+
+	// A client that never listed the pseudo-encoding
+
+	client.reset();
+	client = VncdTestClient::connect(clientService, port);
+	client->setEncodings(std::vector<int32_t>(1, VEM_RAW));
+	client->enableContinuousUpdates(true, 0, 0, AREA_W, AREA_H);
+
+	bool closed = false;
+	try {
+		client->readMessage();
+	} catch (asio::system_error&) {
+		closed = true;
+	}
+	check(closed, "Enabling without listing the pseudo-encoding closes the connection");
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/* DesktopSizeTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks ExtendedDesktopSize. A client that lists the pseudo-encoding is told
+// the size and screens straight away. Its own request to resize comes back as
+// a rect with the client as the reason, after any update still being encoded
+// at the old size, and the next full request covers just the new size. A layout
+// outside the requested size, or a size the application refuses, comes back
+// with the matching status and leaves the size alone. The application's own
+// resize is announced with the server as the reason.
+// Usage: DesktopSizeTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define SMALL_WIDTH		320
+#define SMALL_HEIGHT	240
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+	std::cout << what << (passed ? "" : " FAILED") << std::endl;
+	if (!passed) {
+		++failures;
+	}
+}
+
+// Takes any size that fits the test framebuffer, with the pattern laid out
+// again at the new width
+
+class ResizableConnection : public VncdTestConnection {
+
+public:
+
+	ResizableConnection(asio::ip::tcp::socket tcpConnection, VncdTimer timer) :
+		VncdTestConnection(std::move(tcpConnection), std::move(timer)),
+		width(VNCD_TEST_WIDTH),
+		height(VNCD_TEST_HEIGHT)
+	{
+	}
+
+	// Changes the size without telling the client. Call it on the strand.
+	void resize(uint16_t w, uint16_t h) {
+		width = w;
+		height = h;
+	}
+
+protected:
+
+	uint16_t width;
+
+	uint16_t height;
+
+	virtual uint16_t getFrameWidth() {
+		return width;
+	}
+
+	virtual uint16_t getFrameHeight() {
+		return height;
+	}
+
+	virtual VncdResizeStatus desktopResizeRequested(uint16_t w, uint16_t h, const std::vector<VncdScreen>&) {
+		if ((size_t)w * h > VNCD_TEST_WIDTH * VNCD_TEST_HEIGHT) {
+			return VRS_OUT_OF_RESOURCES;
+		}
+		resize(w, h);
+		return VRS_OK;
+	}
+
+};
+
+static bool isSize(VncdTestClient& client, uint16_t w, uint16_t h) {
+	return client.frameWidth == w && client.frameHeight == h && client.screens.size() == 1
+		&& client.screens[0].x == 0 && client.screens[0].y == 0 && client.screens[0].w == w && client.screens[0].h == h;
+}
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<ResizableConnection> server(1, 1);
+	server.sendQueueLimit = 0;
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	asio::io_service clientService;
+	std::unique_ptr<VncdTestClient> client = VncdTestClient::connect(clientService, port);
+
+	std::vector<int32_t> encodings;
+	encodings.push_back(VEM_RAW);
+	encodings.push_back(VEM_EXTENDED_DESKTOP_SIZE);
+	client->setEncodings(encodings);
+
+	std::shared_ptr<ResizableConnection> connection;
+	server.forEachConnection([&connection](const std::shared_ptr<ResizableConnection>& c) {
+		connection = c;
+	});
+
+	client->readUpdate();
+	check(client->desktopSizeReason == VDR_SERVER && client->desktopSizeStatus == VRS_OK && isSize(*client, VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT),
+		"Listing ExtendedDesktopSize brings the size and screens");
+
+	client->requestUpdate(false);
+	client->readUpdate();
+	client->requestUpdate(true);
+
+	// Hold the encoder so the resize arrives while an update is being encoded
+
+	std::vector<VncdRect> screens(1);
+	screens[0].x = 0;
+	screens[0].y = 0;
+	screens[0].w = SMALL_WIDTH;
+	screens[0].h = SMALL_HEIGHT;
+
+	{
+		VncdTestEncoderGate gate(*server.encoderPool);
+		connection->repaint(1);
+		client->setDesktopSize(SMALL_WIDTH, SMALL_HEIGHT, screens);
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+	}
+
+	client->readUpdate();
+	bool oldSize = !client->rects.empty();
+	for (const VncdRect& r : client->rects) {
+		oldSize = oldSize && r.x + r.w <= VNCD_TEST_WIDTH && r.y + r.h <= VNCD_TEST_HEIGHT;
+	}
+	check(oldSize && client->frameWidth == VNCD_TEST_WIDTH, "An update being encoded goes out at the old size first");
+
+	client->readUpdate();
+	check(client->desktopSizeReason == VDR_CLIENT && client->desktopSizeStatus == VRS_OK && isSize(*client, SMALL_WIDTH, SMALL_HEIGHT),
+		"The client's resize comes back with the client as the reason");
+
+	client->requestUpdate(false);
+	client->readUpdate();
+	size_t area = 0;
+	bool bounded = true;
+	for (const VncdRect& r : client->rects) {
+		area += (size_t)r.w * r.h;
+		bounded = bounded && r.x + r.w <= SMALL_WIDTH && r.y + r.h <= SMALL_HEIGHT;
+	}
+	check(bounded && area == SMALL_WIDTH * SMALL_HEIGHT, "A full request after it covers just the new size");
+
+	screens[0].w = SMALL_WIDTH * 2;
+	client->setDesktopSize(SMALL_WIDTH, SMALL_HEIGHT, screens);
+	client->readUpdate();
+	check(client->desktopSizeReason == VDR_CLIENT && client->desktopSizeStatus == VRS_INVALID_LAYOUT && isSize(*client, SMALL_WIDTH, SMALL_HEIGHT),
+		"A screen outside the requested size is an invalid layout");
+
+	screens[0].w = VNCD_TEST_WIDTH * 2;
+	screens[0].h = VNCD_TEST_HEIGHT * 2;
+	client->setDesktopSize(VNCD_TEST_WIDTH * 2, VNCD_TEST_HEIGHT * 2, screens);
+	client->readUpdate();
+	check(client->desktopSizeReason == VDR_CLIENT && client->desktopSizeStatus == VRS_OUT_OF_RESOURCES && isSize(*client, SMALL_WIDTH, SMALL_HEIGHT),
+		"A size the application refuses keeps the old size");
+
+	connection->runOnStrand([&connection]() {
+		connection->resize(VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT);
+	});
+	connection->notifyClient_sizeChanged();
+	client->readUpdate();
+	check(client->desktopSizeReason == VDR_SERVER && client->desktopSizeStatus == VRS_OK && isSize(*client, VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT),
+		"The application's resize comes back with the server as the reason");
+
+	client.reset();
+	connection.reset();
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
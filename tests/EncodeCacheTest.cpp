@@ -0,0 +1,109 @@
+/* EncodeCacheTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks that viewers of one VncdSharedFramebuffer share encoded rects. All
+// of them are told about every change at once, yet each rect is encoded only
+// once: the encode cache misses once per rect of the update, and every other
+// lookup is a hit or waits for the first.
+// Usage: EncodeCacheTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define VIEWERS			20
+#define ENCODER_THREADS	4
+#define TESTED_UPDATES	20
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<VncdTestSharedConnection> server(1, ENCODER_THREADS);
+
+	// A viewer whose last update is still queued would defer its damage and
+	// encode it as rects of its own
+	server.sendQueueLimit = 0;
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	VncdTestSharedConnection::repaintShared(0);
+
+	asio::io_service clientService;
+	std::vector<std::unique_ptr<VncdTestClient>> clients;
+
+	for (int i = 0; i < VIEWERS; ++i) {
+		clients.push_back(VncdTestClient::connect(clientService, port));
+		clients.back()->setEncodings(std::vector<int32_t>(1, VEM_RAW));
+		clients.back()->requestUpdate(false);
+		clients.back()->readUpdate();
+	}
+
+	int failures = 0;
+
+	for (uint8_t phase = 1; phase <= TESTED_UPDATES; ++phase) {
+
+		size_t before = server.encodeCache.misses();
+
+		for (std::unique_ptr<VncdTestClient>& client : clients) {
+			client->requestUpdate(true);
+		}
+
+		// Hold up the encoder threads until every viewer has queued its jobs,
+		// so that the lookups for each rect overlap
+
+		VncdTestEncoderGate gate(*server.encoderPool);
+
+		VncdTestSharedConnection::repaintShared(phase);
+		server.forEachConnection([](const std::shared_ptr<VncdTestSharedConnection>& c) {
+			c->notifyClient_regionUpdated(0, 0, VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT);
+		});
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		gate.release();
+
+		size_t rects = 0;
+		for (std::unique_ptr<VncdTestClient>& client : clients) {
+			client->readUpdate();
+			if (rects && client->rects.size() != rects) {
+				std::cout << "Viewers were sent different rects" << std::endl;
+				++failures;
+			}
+			rects = client->rects.size();
+		}
+
+		// Every viewer has its update, so every encode has been stored
+		size_t misses = server.encodeCache.misses() - before;
+
+		if (misses != rects) {
+			std::cout << "Update " << (int)phase << ": " << misses << " misses for " << rects << " rects FAILED" << std::endl;
+			++failures;
+		}
+	}
+
+	std::cout << VIEWERS << " viewers, " << TESTED_UPDATES << " updates: " << server.encodeCache.misses() << " misses, "
+		<< server.encodeCache.hits() << " hits" << (failures ? " FAILED" : "") << std::endl;
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
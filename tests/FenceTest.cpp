@@ -0,0 +1,104 @@
+/* FenceTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks the Fence handshake. A client that lists the pseudo-encoding is sent
+// a fence request straight away, and its answer gives the round trip time.
+// Every update is followed by another request. The client's own requests come
+// back with the request bit cleared and the payload intact, and a payload
+// longer than the protocol allows closes the connection.
+// Usage: FenceTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define ANSWER_DELAY	100 // ms
+
+static int failures = 0;
+
+static void check(bool passed, const char* what) {
+	std::cout << what << (passed ? "" : " FAILED") << std::endl;
+	if (!passed) {
+		++failures;
+	}
+}
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<VncdTestConnection> server;
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	asio::io_service clientService;
+	std::unique_ptr<VncdTestClient> client = VncdTestClient::connect(clientService, port);
+
+	std::vector<int32_t> encodings;
+	encodings.push_back(VEM_RAW);
+	encodings.push_back(VEM_FENCE);
+	client->setEncodings(encodings);
+
+	std::shared_ptr<VncdTestConnection> connection;
+	server.forEachConnection([&connection](const std::shared_ptr<VncdTestConnection>& c) {
+		connection = c;
+	});
+
+	check(client->readMessage() == 248 && client->fenceFlags == (VFF_REQUEST | VFF_BLOCK_BEFORE) && client->fencePayload.empty(),
+		"Listing Fence brings a fence request");
+
+	std::this_thread::sleep_for(std::chrono::milliseconds(ANSWER_DELAY));
+	client->sendFence(client->fenceFlags & ~VFF_REQUEST, client->fencePayload);
+
+	// The answer is handled on the strand, some time after it is sent
+
+	std::chrono::milliseconds roundTrip(0);
+	for (int i = 0; i < 500 && roundTrip.count() == 0; ++i) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		connection->runOnStrand([&connection, &roundTrip]() {
+			roundTrip = connection->bandwidthReport().roundTripTime;
+		});
+	}
+	check(roundTrip.count() >= ANSWER_DELAY, "Its answer gives the round trip time");
+
+	client->requestUpdate(false);
+	client->readUpdate();
+	check(client->readMessage() == 248 && (client->fenceFlags & VFF_REQUEST), "An update is followed by a fence request");
+	client->sendFence(client->fenceFlags & ~VFF_REQUEST, client->fencePayload);
+
+	client->sendFence(VFF_REQUEST | VFF_BLOCK_BEFORE | VFF_SYNC_NEXT, "payload");
+	check(client->readMessage() == 248 && client->fenceFlags == (VFF_BLOCK_BEFORE | VFF_SYNC_NEXT) && client->fencePayload == "payload",
+		"The client's fence request is answered with its flags and payload");
+
+	client->sendFence(VFF_REQUEST, std::string(65, 'x'));
+	bool closed = false;
+	try {
+		client->readMessage();
+	} catch (asio::system_error&) {
+		closed = true;
+	}
+	check(closed, "A fence with more than 64 bytes of payload closes the connection");
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
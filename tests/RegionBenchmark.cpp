@@ -0,0 +1,207 @@
+/* RegionBenchmark.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// VncdRegion against damage patterns that are hard on banded regions: many
+// bands, many spans per band, or both. For each, the time to build the region
+// one rect at a time and all at once, to subtract, intersect and translate
+// it, and what cover() makes of it for Raw, ZRLE and TightPNG: the time, the
+// rects it sends and the pixels it sends per damaged pixel.
+// Usage: RegionBenchmark [repeats]
+
+#include "../VncdRegion.hpp"
+#include "../VncdConnection.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+
+#define SCREEN_WIDTH	1920
+#define SCREEN_HEIGHT	1080
+#define DEFAULT_REPEATS	10
+
+struct Pattern {
+	const char* name;
+	std::vector<VncdRect> rects;
+};
+
+static VncdRect makeRect(int x, int y, int w, int h) {
+	VncdRect r = { (uint16_t)x, (uint16_t)y, (uint16_t)w, (uint16_t)h };
+	return r;
+}
+
+// Same numbers on every platform, unlike rand()
+static uint32_t nextRandom(uint32_t& state) {
+	state = state * 1664525 + 1013904223;
+	return state >> 8;
+}
+
+static std::vector<Pattern> makePatterns() {
+
+	std::vector<Pattern> patterns;
+	Pattern p;
+
+	// Every other pixel of a 256x256 square: a band per row, 128 spans each
+	p.name = "checkerboard";
+	p.rects.clear();
+	for (int y = 0; y < 256; ++y) {
+		for (int x = y % 2; x < 256; x += 2) {
+			p.rects.push_back(makeRect(x, y, 1, 1));
+		}
+	}
+	patterns.push_back(p);
+
+	// A pixel on each row, at both ends of the screen: the bounding box is
+	// the whole screen, the pixels are nothing
+	p.name = "diagonals";
+	p.rects.clear();
+	for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+		p.rects.push_back(makeRect(y, y, 1, 1));
+		p.rects.push_back(makeRect(SCREEN_WIDTH - 1 - y, y, 1, 1));
+	}
+	patterns.push_back(p);
+
+	// Every other column, full height: one band of 960 spans
+	p.name = "stripes";
+	p.rects.clear();
+	for (int x = 0; x < SCREEN_WIDTH; x += 2) {
+		p.rects.push_back(makeRect(x, 0, 1, SCREEN_HEIGHT));
+	}
+	patterns.push_back(p);
+
+	// Half the cells of a 160x60 terminal of 8x16 glyphs, one glyph at a time
+	p.name = "terminal";
+	p.rects.clear();
+	{
+		uint32_t state = 1;
+		for (int row = 0; row < 60; ++row) {
+			for (int column = 0; column < 160; ++column) {
+				if (nextRandom(state) % 2) {
+					p.rects.push_back(makeRect(column * 12, row * 18, 8, 16));
+				}
+			}
+		}
+	}
+	patterns.push_back(p);
+
+	// Small rects anywhere, overlapping each other
+	p.name = "scattered";
+	p.rects.clear();
+	{
+		uint32_t state = 2;
+		for (int i = 0; i < 10000; ++i) {
+			int w = 1 + nextRandom(state) % 16, h = 1 + nextRandom(state) % 16;
+			p.rects.push_back(makeRect(nextRandom(state) % (SCREEN_WIDTH - w), nextRandom(state) % (SCREEN_HEIGHT - h), w, h));
+		}
+	}
+	patterns.push_back(p);
+
+	// Two pixels in opposite corners
+	p.name = "corners";
+	p.rects.clear();
+	p.rects.push_back(makeRect(0, 0, 1, 1));
+	p.rects.push_back(makeRect(SCREEN_WIDTH - 1, SCREEN_HEIGHT - 1, 1, 1));
+	patterns.push_back(p);
+
+	return patterns;
+}
+
+// Microseconds per call
+static double timeIt(int repeats, const std::function<void()>& work) {
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < repeats; ++i) {
+		work();
+	}
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / repeats;
+}
+
+int main(int argc, char** argv) {
+
+	int repeats = argc > 1 ? atoi(argv[1]) : DEFAULT_REPEATS;
+
+	struct Encoding {
+		const char* name;
+		uint32_t encoding;
+	} encodings[] = {
+		{ "Raw", VEM_RAW },
+		{ "ZRLE", VEM_ZRLE },
+		{ "TightPNG", (uint32_t)VEM_TIGHTPNG }
+	};
+
+	RFBPixelFormat pixelFormat;
+
+	VncdRegion window(SCREEN_WIDTH / 4, SCREEN_HEIGHT / 4, SCREEN_WIDTH / 2, SCREEN_HEIGHT / 2);
+
+	printf("%-13s %6s %7s | %9s %9s %9s %9s %9s | per encoding: cover us, rects, sent/damaged pixels\n",
+		"pattern", "rects", "boxes", "unite1 us", "uniteN us", "sub us", "inter us", "trans us");
+
+	for (Pattern& pattern : makePatterns()) {
+
+		VncdRegion region;
+
+		double uniteOne = timeIt(repeats, [&]() {
+			region.clear();
+			for (const VncdRect& r : pattern.rects) {
+				region.unite(r);
+			}
+		});
+
+		double uniteAll = timeIt(repeats, [&]() {
+			region.clear();
+			region.unite(pattern.rects);
+		});
+
+		double subtract = timeIt(repeats, [&]() {
+			VncdRegion copy = region;
+			copy.subtract(window);
+		});
+
+		double intersect = timeIt(repeats, [&]() {
+			VncdRegion copy = region;
+			copy.intersect(window);
+		});
+
+		double translate = timeIt(repeats, [&]() {
+			VncdRegion copy = region;
+			copy.translate(3, 5);
+		});
+
+		printf("%-13s %6u %7u | %9.1f %9.1f %9.1f %9.1f %9.1f |",
+			pattern.name, (unsigned)pattern.rects.size(), (unsigned)region.rectCount(), uniteOne, uniteAll, subtract, intersect, translate);
+
+		for (Encoding& e : encodings) {
+			VncdRectCost cost = VncdRectEncoder::rectCost(e.encoding, pixelFormat);
+			std::vector<VncdRect> cover;
+
+			double coverTime = timeIt(repeats, [&]() {
+				cover.clear();
+				region.cover(cost, cover);
+			});
+
+			size_t sent = 0;
+			for (const VncdRect& r : cover) {
+				sent += (size_t)r.w * r.h;
+			}
+
+			printf(" %s %.1f, %u, %.2f |", e.name, coverTime, (unsigned)cover.size(), (double)sent / region.area());
+		}
+
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+/* ScalingBenchmark.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Aggregate updates per second for many concurrent clients, as the number of
+// io threads grows. Every client asks for the whole framebuffer in ZRLE again
+// as soon as the last copy arrives. Encoding runs inline, on the io threads,
+// so the thread count is all that changes between runs.
+// Usage: ScalingBenchmark [port] [clients] [seconds per run] [most io threads]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <algorithm>
+#include <cstdlib>
+#include <cstdio>
+
+#define DEFAULT_CLIENTS		100
+#define DEFAULT_SECONDS		10
+
+static double measure(uint16_t port, size_t threadCount, size_t clientCount, int seconds) {
+
+	Vncd<VncdTestConnection> server(threadCount, VNCD_ENCODE_INLINE);
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	std::atomic<size_t> connected(0);
+	std::atomic<size_t> warmedUp(0);
+	std::atomic<bool> started(false);
+	std::atomic<bool> stopping(false);
+	std::atomic<size_t> updates(0);
+
+	std::vector<std::thread> clients;
+
+	for (size_t i = 0; i < clientCount; ++i) {
+		clients.emplace_back([&, port]() {
+			asio::io_service clientService;
+			std::unique_ptr<VncdTestClient> client;
+
+			for (int attempt = 0; !client; ++attempt) {
+				try {
+					client.reset(new VncdTestClient(clientService, port));
+				} catch (asio::system_error&) {
+					if (attempt == 50) {
+						throw; // the server never came up
+					}
+					std::this_thread::sleep_for(std::chrono::milliseconds(100));
+				}
+			}
+
+			client->setEncodings(std::vector<int32_t>(1, VEM_ZRLE));
+			++connected;
+
+			while (!started) {
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+
+			client->requestUpdate(false);
+			client->readUpdate();
+			++warmedUp;
+
+			while (!stopping) {
+				client->requestUpdate(false);
+				client->readUpdate();
+				++updates;
+			}
+		});
+	}
+
+	while (connected != clientCount) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	// Counting starts once every client has had its first update, since
+	// those all finish at about the same time
+
+	started = true;
+	while (warmedUp != clientCount) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+
+	size_t first = updates;
+	auto start = std::chrono::steady_clock::now();
+	std::this_thread::sleep_for(std::chrono::seconds(seconds));
+	size_t counted = updates - first;
+	auto elapsed = std::chrono::steady_clock::now() - start;
+	stopping = true;
+
+	for (std::thread& t : clients) {
+		t.join();
+	}
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return counted / std::chrono::duration<double>(elapsed).count();
+}
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+	size_t clientCount = argc > 2 ? atoi(argv[2]) : DEFAULT_CLIENTS;
+	int seconds = argc > 3 ? atoi(argv[3]) : DEFAULT_SECONDS;
+
+	size_t cores = std::max(1u, std::thread::hardware_concurrency());
+	size_t mostThreads = argc > 4 ? atoi(argv[4]) : cores;
+
+	printf("%u clients, %dx%d ZRLE, %u cores\n", (unsigned)clientCount, VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT, (unsigned)cores);
+
+	// Doubling up to the most threads, and that number itself. Each run has a
+	// port of its own, so it doesn't wait for the last one's to be released.
+
+	double baseline = 0;
+
+	for (size_t threadCount = 1, run = 0;; ++run) {
+		double rate = measure((uint16_t)(port + run), threadCount, clientCount, seconds);
+		if (!baseline) {
+			baseline = rate;
+		}
+
+		printf("%3u io threads: %9.1f updates/s  (%.2fx)\n", (unsigned)threadCount, rate, baseline ? rate / baseline : 0);
+
+		if (threadCount >= mostThreads) {
+			break;
+		}
+		threadCount = std::min(threadCount * 2, mostThreads);
+	}
+
+	return EXIT_SUCCESS;
+}
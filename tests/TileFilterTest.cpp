@@ -0,0 +1,95 @@
+/* TileFilterTest.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Checks that a tile changed and changed back while an update is being
+// encoded still reaches the client. The tile hashes recorded for the client
+// have to be those of the pixels it was actually sent, or the change back
+// looks like nothing and the client is left showing the pixels in between.
+// Usage: TileFilterTest [port]
+
+#include "../Vncd.hpp"
+#include "VncdTestConnection.hpp"
+#include "VncdTestClient.hpp"
+#include <cstdlib>
+#include <iostream>
+
+#define TILE		VNCD_SHADOW_TILE_SIZE
+#define BEFORE		0x40
+#define BETWEEN		0xC0
+
+int main(int argc, char** argv) {
+
+	uint16_t port = (uint16_t)(argc > 1 ? atoi(argv[1]) : 5999);
+
+	Vncd<VncdTestConnection> server(1, 1);
+	std::thread serverThread([&server, port]() {
+		server.acceptConnections("127.0.0.1", port);
+	});
+
+	asio::io_service clientService;
+	std::unique_ptr<VncdTestClient> client = VncdTestClient::connect(clientService, port);
+
+	client->setEncodings(std::vector<int32_t>(1, VEM_RAW));
+	client->requestUpdate(false);
+	client->readUpdate();
+
+	std::shared_ptr<VncdTestConnection> connection;
+	server.forEachConnection([&connection](const std::shared_ptr<VncdTestConnection>& c) {
+		connection = c;
+	});
+
+	// The tile changes while its update waits for the encoder thread, and
+	// changes back once the client has that update
+
+	{
+		VncdTestEncoderGate gate(*server.encoderPool);
+
+		client->requestUpdate(true);
+		connection->fill(0, 0, TILE, TILE, BEFORE);
+		connection->notifyClient_regionUpdated(0, 0, TILE, TILE);
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		connection->fill(0, 0, TILE, TILE, BETWEEN);
+	}
+
+	client->readUpdate();
+
+	client->requestUpdate(true);
+	connection->fill(0, 0, TILE, TILE, BEFORE);
+	connection->notifyClient_regionUpdated(0, 0, TILE, TILE);
+
+	// Another tile changes so that there is an update to wait for either way
+
+	connection->fill(TILE, 0, TILE, TILE, BEFORE);
+	connection->notifyClient_regionUpdated(TILE, 0, TILE, TILE);
+	client->readUpdate();
+
+	std::vector<uint8_t> shown = client->framebuffer;
+
+	client->requestUpdate(false);
+	client->readUpdate();
+
+	bool stale = shown != client->framebuffer;
+
+	std::cout << "Tile changed and changed back during an update: " << (stale ? "client left stale FAILED" : "client up to date") << std::endl;
+
+	server.io_service.stop();
+	serverThread.join();
+
+	return stale ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,292 @@
+/* VncdTestClient.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdTestClient.hpp"
+#include <algorithm>
+#include <stdexcept>
+#include <thread>
+
+VncdTestClient::VncdTestClient(asio::io_service& io_service, uint16_t port) :
+	frameWidth(0),
+	frameHeight(0),
+	fenceFlags(0),
+	desktopSizeReason(0),
+	desktopSizeStatus(0),
+	socket(io_service),
+	bytesPerPixel(4),
+	updateBytes(0)
+{
+	socket.connect(asio::ip::tcp::endpoint(asio::ip::address_v4::loopback(), port));
+	socket.set_option(asio::ip::tcp::no_delay(true));
+
+	// ProtocolVersion, then no authentication
+
+	char version[12];
+	read(version, sizeof(version));
+	write(std::string(version, sizeof(version)));
+
+	uint8_t securityTypes = readU8();
+	skip(securityTypes);
+	write(std::string("\x01", 1));
+
+	if (readU32() != 0) {
+		throw std::runtime_error("Security handshake failed");
+	}
+
+	// ClientInit (shared), ServerInit
+
+	write(std::string("\x01", 1));
+
+	frameWidth = readU16();
+	frameHeight = readU16();
+
+	char pixelFormat[16];
+	read(pixelFormat, sizeof(pixelFormat));
+	bytesPerPixel = (uint8_t)pixelFormat[0] / 8;
+	resize(frameWidth, frameHeight);
+
+	skip(readU32()); // desktop name
+}
+
+std::unique_ptr<VncdTestClient> VncdTestClient::connect(asio::io_service& io_service, uint16_t port) {
+	for (int attempt = 0;; ++attempt) {
+		try {
+			return std::unique_ptr<VncdTestClient>(new VncdTestClient(io_service, port));
+		} catch (asio::system_error&) {
+			if (attempt == 50) {
+				throw; // the server never came up
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+	}
+}
+
+void VncdTestClient::setEncodings(const std::vector<int32_t>& encodings) {
+
+	std::string message("\x02\x00", 2);
+	message.push_back((char)(encodings.size() >> 8));
+	message.push_back((char)encodings.size());
+
+	for (int32_t encoding : encodings) {
+		uint32_t e = htonl((uint32_t)encoding);
+		message.append((const char*)&e, 4);
+	}
+
+	write(message);
+}
+
+void VncdTestClient::requestUpdate(bool incremental) {
+
+	std::string message("\x03", 1);
+	message.push_back(incremental ? 1 : 0);
+	message.append(4, '\x00'); // x, y
+	message.push_back((char)(frameWidth >> 8));
+	message.push_back((char)frameWidth);
+	message.push_back((char)(frameHeight >> 8));
+	message.push_back((char)frameHeight);
+
+	write(message);
+}
+
+void VncdTestClient::sendFence(uint32_t flags, const std::string& payload) {
+
+	std::string message("\xF8\x00\x00\x00", 4); // ClientFence, padding
+	uint32_t flags_network = htonl(flags);
+	message.append((const char*)&flags_network, 4);
+	message.push_back((char)payload.size());
+	message.append(payload);
+
+	write(message);
+}
+
+void VncdTestClient::enableContinuousUpdates(bool enable, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+
+	std::string message("\x96", 1);
+	message.push_back(enable ? 1 : 0);
+
+	uint16_t area[4] = { htons(x), htons(y), htons(w), htons(h) };
+	message.append((const char*)area, sizeof(area));
+
+	write(message);
+}
+
+void VncdTestClient::setDesktopSize(uint16_t w, uint16_t h, const std::vector<VncdRect>& screens) {
+
+	std::string message("\xFB\x00", 2); // SetDesktopSize, padding
+	uint16_t size[2] = { htons(w), htons(h) };
+	message.append((const char*)size, sizeof(size));
+	message.push_back((char)screens.size());
+	message.push_back(0);
+
+	for (size_t i = 0; i < screens.size(); ++i) {
+		uint32_t id = htonl((uint32_t)i), flags = 0;
+		uint16_t area[4] = { htons(screens[i].x), htons(screens[i].y), htons(screens[i].w), htons(screens[i].h) };
+		message.append((const char*)&id, 4);
+		message.append((const char*)area, sizeof(area));
+		message.append((const char*)&flags, 4);
+	}
+
+	write(message);
+}
+
+uint8_t VncdTestClient::readMessage() {
+
+	uint8_t type = readU8();
+
+	if (type == 0) { // FramebufferUpdate
+		readRects();
+
+	} else if (type == 2) { // Bell
+
+	} else if (type == 3) { // ServerCutText
+		skip(3);
+		skip(readU32());
+
+	} else if (type == 150) { // EndOfContinuousUpdates
+
+	} else if (type == 248) { // ServerFence
+		skip(3);
+		fenceFlags = readU32();
+		fencePayload.resize(readU8());
+		if (!fencePayload.empty()) {
+			read(&fencePayload[0], fencePayload.size());
+		}
+
+	} else {
+		throw std::runtime_error("Unexpected message from the server");
+	}
+
+	return type;
+}
+
+size_t VncdTestClient::readUpdate() {
+
+	while (readMessage() != 0) {
+	}
+
+	return updateBytes;
+}
+
+void VncdTestClient::readRects() {
+
+	skip(1);
+	uint16_t rectCount = readU16();
+	size_t bytes = 0;
+
+	rects.clear();
+
+	for (uint16_t i = 0; i < rectCount; ++i) {
+		VncdRect r;
+		r.x = readU16();
+		r.y = readU16();
+		r.w = readU16();
+		r.h = readU16();
+		rects.push_back(r);
+
+		size_t w = r.w;
+		size_t h = r.h;
+		int32_t encoding = (int32_t)readU32();
+
+		size_t length;
+		if (encoding == 0) {
+			if (r.x + w > frameWidth || r.y + h > frameHeight) {
+				throw std::runtime_error("Rect outside the framebuffer");
+			}
+			for (size_t row = 0; row < h; ++row) {
+				read(&framebuffer[((r.y + row) * frameWidth + r.x) * bytesPerPixel], w * bytesPerPixel);
+			}
+			length = w * h * bytesPerPixel;
+		} else if (encoding == 6 || encoding == 16) {
+			length = readU32();
+			skip(length);
+		} else if (encoding == -223) { // DesktopSize
+			resize(r.w, r.h);
+			length = 0;
+		} else if (encoding == -308) { // ExtendedDesktopSize, with the reason and status as its position
+			desktopSizeReason = r.x;
+			desktopSizeStatus = r.y;
+
+			uint8_t screenCount = readU8();
+			skip(3);
+
+			screens.clear();
+			for (uint8_t j = 0; j < screenCount; ++j) {
+				VncdRect screen;
+				skip(4); // id
+				screen.x = readU16();
+				screen.y = readU16();
+				screen.w = readU16();
+				screen.h = readU16();
+				skip(4); // flags
+				screens.push_back(screen);
+			}
+
+			if (desktopSizeStatus == 0) {
+				resize(r.w, r.h);
+			}
+			length = 4 + screenCount * 16;
+		} else {
+			throw std::runtime_error("Unexpected encoding from the server");
+		}
+
+		bytes += 12 + length;
+	}
+
+	updateBytes = bytes;
+}
+
+void VncdTestClient::resize(uint16_t w, uint16_t h) {
+	frameWidth = w;
+	frameHeight = h;
+	framebuffer.assign((size_t)w * h * bytesPerPixel, 0);
+}
+
+void VncdTestClient::read(void* data, size_t length) {
+	asio::read(socket, asio::buffer(data, length));
+}
+
+void VncdTestClient::skip(size_t length) {
+	while (length) {
+		scratch.resize(65536);
+		size_t chunk = std::min(length, scratch.size());
+		read(scratch.data(), chunk);
+		length -= chunk;
+	}
+}
+
+uint8_t VncdTestClient::readU8() {
+	uint8_t value;
+	read(&value, 1);
+	return value;
+}
+
+uint16_t VncdTestClient::readU16() {
+	uint16_t value;
+	read(&value, 2);
+	return ntohs(value);
+}
+
+uint32_t VncdTestClient::readU32() {
+	uint32_t value;
+	read(&value, 4);
+	return ntohl(value);
+}
+
+void VncdTestClient::write(const std::string& data) {
+	asio::write(socket, asio::buffer(data));
+}
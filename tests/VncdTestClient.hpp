@@ -0,0 +1,107 @@
+/* VncdTestClient.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "../asio_wrapper.h"
+#include "../asio/asio/detail/noncopyable.hpp"
+#include "../VncdRectEncoder.hpp"
+
+// A blocking RFB 3.8 client for the tests and benchmarks. It understands just
+// enough to frame the server's messages: Raw rects are kept, Zlib and ZRLE
+// rects are skipped by their length, DesktopSize and ExtendedDesktopSize
+// resize the framebuffer, and nothing else should be asked for in
+// setEncodings().
+// Throws asio::system_error if the connection fails.
+
+class VncdTestClient : public asio::noncopyable {
+
+public:
+
+	VncdTestClient(asio::io_service& io_service, uint16_t port);
+
+	// Retries for a few seconds while the server starts up
+	static std::unique_ptr<VncdTestClient> connect(asio::io_service& io_service, uint16_t port);
+
+	uint16_t frameWidth;
+
+	uint16_t frameHeight;
+
+	void setEncodings(const std::vector<int32_t>& encodings);
+
+	void requestUpdate(bool incremental);
+
+	void sendFence(uint32_t flags, const std::string& payload);
+
+	void enableContinuousUpdates(bool enable, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+	// Screens are sent with their index as the id and no flags
+	void setDesktopSize(uint16_t w, uint16_t h, const std::vector<VncdRect>& screens);
+
+	// Reads one message and returns its type
+	uint8_t readMessage();
+
+	// Reads messages up to and including the next FramebufferUpdate, and
+	// returns how many bytes its rects took. Fences from the server on the
+	// way are not answered.
+	size_t readUpdate();
+
+	std::vector<VncdRect> rects; // of the last update read
+
+	std::vector<uint8_t> framebuffer; // as drawn by Raw rects, in the server's pixel format
+
+	uint32_t fenceFlags; // of the last ServerFence read
+
+	std::string fencePayload;
+
+	uint16_t desktopSizeReason; // of the last ExtendedDesktopSize rect read
+
+	uint16_t desktopSizeStatus;
+
+	std::vector<VncdRect> screens;
+
+protected:
+
+	asio::ip::tcp::socket socket;
+
+	uint8_t bytesPerPixel;
+
+	std::vector<char> scratch;
+
+	size_t updateBytes; // taken by the rects of the last update read
+
+	void readRects();
+
+	void resize(uint16_t w, uint16_t h);
+
+	void read(void* data, size_t length);
+
+	void skip(size_t length);
+
+	uint8_t readU8();
+
+	uint16_t readU16();
+
+	uint32_t readU32();
+
+	void write(const std::string& data);
+
+};
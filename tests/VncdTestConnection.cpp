@@ -0,0 +1,207 @@
+/* VncdTestConnection.cpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "VncdTestConnection.hpp"
+#include <future>
+#include <thread>
+
+VncdTestConnection::VncdTestConnection(asio::ip::tcp::socket tcpConnection, VncdTimer timer) :
+	VncdConnection(std::move(tcpConnection), std::move(timer))
+{
+	drawPattern(framebuffer, 0);
+}
+
+VncdTestConnection::~VncdTestConnection() {
+
+}
+
+void VncdTestConnection::repaint(uint8_t phase) {
+	drawPattern(framebuffer, phase);
+	notifyClient_regionUpdated(0, 0, VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT);
+}
+
+void VncdTestConnection::fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t shade) {
+	for (size_t row = y; row < (size_t)y + h; ++row) {
+		uint8_t* pixel = framebuffer + (x + row * VNCD_TEST_WIDTH) * 4;
+		for (size_t i = 0; i < w; ++i, pixel += 4) {
+			pixel[0] = pixel[1] = pixel[2] = shade;
+			pixel[3] = 0;
+		}
+	}
+}
+
+void VncdTestConnection::waitUntilSent() {
+
+	// The queue is only consistent on the strand, where a write's buffers are
+	// returned in the same handler that takes its bytes off the count
+
+	for (;;) {
+		std::promise<bool> sent;
+		strand.dispatch([this, &sent]() {
+			sent.set_value(sendQueueBytes == 0);
+		});
+
+		if (sent.get_future().get()) {
+			return;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+void VncdTestConnection::runOnStrand(const std::function<void()>& task) {
+
+	std::promise<void> done;
+	strand.dispatch([&task, &done]() {
+		task();
+		done.set_value();
+	});
+
+	done.get_future().wait();
+}
+
+void VncdTestConnection::drawPattern(uint8_t* pixels, uint8_t phase) {
+
+	// Gradients under a grid of flat blocks, so every encoding has both
+	// detail and runs to work on
+
+	for (int y = 0; y < VNCD_TEST_HEIGHT; ++y) {
+		for (int x = 0; x < VNCD_TEST_WIDTH; ++x) {
+			uint8_t* pixel = pixels + (x + y * VNCD_TEST_WIDTH) * 4;
+
+			if ((x / 32 + y / 32) % 2) {
+				pixel[0] = (uint8_t)(x + phase);
+				pixel[1] = (uint8_t)(y * 2 + phase);
+				pixel[2] = (uint8_t)(x ^ y);
+			} else {
+				pixel[0] = pixel[1] = pixel[2] = (uint8_t)((x / 32) * 16 + phase);
+			}
+			pixel[3] = 0;
+		}
+	}
+}
+
+void VncdTestConnection::keyDownEventRecieved(uint32_t) {
+
+}
+
+void VncdTestConnection::keyUpEventRecieved(uint32_t) {
+
+}
+
+void VncdTestConnection::mouseEventRecieved(uint16_t, uint16_t, uint8_t) {
+
+}
+
+void VncdTestConnection::connectionStarted() {
+
+}
+
+uint8_t* VncdTestConnection::getFramebufferRGBX32() {
+	return framebuffer;
+}
+
+uint16_t VncdTestConnection::getFrameWidth() {
+	return VNCD_TEST_WIDTH;
+}
+
+uint16_t VncdTestConnection::getFrameHeight() {
+	return VNCD_TEST_HEIGHT;
+}
+
+std::string VncdTestConnection::getSessionTitle() {
+	return "libvncd test";
+}
+
+std::string VncdTestConnection::requirePassword() {
+	return "";
+}
+
+void VncdTestConnection::setCurrentStatusMessage(std::string&) {
+
+}
+
+void VncdTestConnection::setCurrentStatusMessage(const char*) {
+
+}
+
+VncdSharedFramebuffer VncdTestSharedConnection::sharedFramebuffer(VNCD_TEST_WIDTH, VNCD_TEST_HEIGHT);
+
+uint8_t VncdTestSharedConnection::sharedPixels[VNCD_TEST_WIDTH * VNCD_TEST_HEIGHT * 4];
+
+VncdTestSharedConnection::VncdTestSharedConnection(asio::ip::tcp::socket tcpConnection, VncdTimer timer) :
+	VncdTestConnection(std::move(tcpConnection), std::move(timer))
+{
+}
+
+void VncdTestSharedConnection::repaintShared(uint8_t phase) {
+	drawPattern(sharedPixels, phase);
+	sharedFramebuffer.contentChanged();
+}
+
+int VncdTestSharedConnection::broadcastTier() {
+
+	int tier = -1;
+
+	runOnStrand([this, &tier]() {
+		for (size_t t = 0; broadcastGroup && t < VNCD_BROADCAST_TIERS; ++t) {
+			if (broadcastGroup->matches(&sharedFramebuffer, networkPixelFormat, useEncodingMode, t)) {
+				tier = (int)t;
+			}
+		}
+	});
+
+	return tier;
+}
+
+uint8_t* VncdTestSharedConnection::getFramebufferRGBX32() {
+	return sharedPixels;
+}
+
+VncdSharedFramebuffer* VncdTestSharedConnection::getSharedFramebuffer() {
+	return &sharedFramebuffer;
+}
+
+VncdTestEncoderGate::VncdTestEncoderGate(VncdEncoderPool& pool) :
+	released(false)
+{
+	std::shared_future<void> wait = opened.get_future().share();
+	std::shared_ptr<std::atomic<size_t>> held = std::make_shared<std::atomic<size_t>>(0);
+
+	for (size_t i = 0; i < pool.workerCount(); ++i) {
+		pool.submit([wait, held]() {
+			++*held;
+			wait.wait();
+		});
+	}
+
+	while (*held < pool.workerCount()) {
+		std::this_thread::yield();
+	}
+}
+
+VncdTestEncoderGate::~VncdTestEncoderGate() {
+	release();
+}
+
+void VncdTestEncoderGate::release() {
+	if (!released) {
+		released = true;
+		opened.set_value();
+	}
+}
@@ -0,0 +1,131 @@
+/* VncdTestConnection.hpp */
+
+/*
+ * Copyright (c) 2015, the libvncd author
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ *  purpose with or without fee is hereby granted, provided that the above
+ *  copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ *  WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ *  MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION
+ * OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN
+ * CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#pragma once
+#include "../VncdConnection.hpp"
+#include "../VncdEncoderPool.hpp"
+#include "../VncdTimer.hpp"
+#include <future>
+
+#define VNCD_TEST_WIDTH		640
+#define VNCD_TEST_HEIGHT	480
+
+// A connection showing a generated test pattern, for the tests and benchmarks
+
+class VncdTestConnection : public VncdConnection {
+
+public:
+
+	VncdTestConnection(asio::ip::tcp::socket tcpConnection, VncdTimer timer);
+
+	virtual ~VncdTestConnection();
+
+	// Draws the pattern shifted by phase and tells the client
+	void repaint(uint8_t phase);
+
+	// Fills a rect with one shade of grey without telling the client
+	void fill(uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t shade);
+
+	// Blocks until everything queued for the client has been written and
+	// its buffers returned. Don't call it from the connection's strand.
+	void waitUntilSent();
+
+	// Runs the task on the connection's strand and waits for it, e.g. to read
+	// the connection's state. Don't call it from the strand.
+	void runOnStrand(const std::function<void()>& task);
+
+protected:
+
+	uint8_t framebuffer[VNCD_TEST_WIDTH * VNCD_TEST_HEIGHT * 4];
+
+	static void drawPattern(uint8_t* pixels, uint8_t phase);
+
+	virtual void keyDownEventRecieved(uint32_t keysym);
+
+	virtual void keyUpEventRecieved(uint32_t keysym);
+
+	virtual void mouseEventRecieved(uint16_t xpos, uint16_t ypos, uint8_t buttonMask);
+
+	virtual void connectionStarted();
+
+	virtual uint8_t* getFramebufferRGBX32();
+
+	virtual uint16_t getFrameWidth();
+
+	virtual uint16_t getFrameHeight();
+
+	virtual std::string getSessionTitle();
+
+	virtual std::string requirePassword();
+
+	virtual void setCurrentStatusMessage(std::string& msg);
+
+	virtual void setCurrentStatusMessage(const char* msg);
+
+};
+
+// Connections of this kind all show one framebuffer, as a VncdSharedFramebuffer,
+// so they can share encoded rects
+
+class VncdTestSharedConnection : public VncdTestConnection {
+
+public:
+
+	VncdTestSharedConnection(asio::ip::tcp::socket tcpConnection, VncdTimer timer);
+
+	// Draws the pattern shifted by phase into the shared framebuffer and marks
+	// it changed. The connections still have to be told.
+	static void repaintShared(uint8_t phase);
+
+	// The tier of the broadcast group the connection is in, or -1 if it is in
+	// none. Don't call it from the connection's strand.
+	int broadcastTier();
+
+	static VncdSharedFramebuffer sharedFramebuffer;
+
+protected:
+
+	static uint8_t sharedPixels[VNCD_TEST_WIDTH * VNCD_TEST_HEIGHT * 4];
+
+	virtual uint8_t* getFramebufferRGBX32();
+
+	virtual VncdSharedFramebuffer* getSharedFramebuffer();
+
+};
+
+// Keeps every thread of an encoder pool busy until released, so that a test
+// can line up encoder jobs behind it
+
+class VncdTestEncoderGate : public asio::noncopyable {
+
+public:
+
+	// Returns once all of the threads are held
+	VncdTestEncoderGate(VncdEncoderPool& pool);
+
+	~VncdTestEncoderGate();
+
+	void release();
+
+protected:
+
+	std::promise<void> opened;
+
+	bool released;
+
+};